@@ -15,17 +15,21 @@
 */
 #include "bk_download.h"
 #include <errno.h>
+#include <math.h>
+#include <algorithm>
 #include <list>
 #include <set>
 #include <string>
-#include <thread>
+#include <vector>
 #include <sys/file.h>
 #include <photon/common/alog.h>
 #include <photon/common/alog-stdstring.h>
 #include <photon/common/alog-audit.h>
+#include <photon/fs/fiemap.h>
+#include <photon/fs/forwardfs.h>
 #include <photon/fs/localfs.h>
-#include <photon/fs/throttled-file.h>
 #include <photon/thread/thread.h>
+#include <photon/thread/thread11.h>
 #include <openssl/sha.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -35,41 +39,17 @@
 using namespace photon::fs;
 
 static constexpr size_t ALIGNMENT = 4096;
+static constexpr uint64_t DEMAND_HALF_LIFE_US = 10UL * 1000 * 1000;
+static constexpr size_t MAX_DEMAND_RANGES = 1024;
+static constexpr uint64_t ADAPT_INTERVAL_US = 1000UL * 1000;
+static constexpr uint64_t MIN_ADAPTIVE_RATE = 1024UL * 1024;
 
 namespace BKDL {
 
-std::string sha256sum(const char *fn) {
-    constexpr size_t BUFFERSIZE = 65536;
-    int fd = open(fn, O_RDONLY | O_DIRECT);
-    if (fd < 0) {
-        LOG_ERROR("failed to open `", fn);
-        return "";
-    }
-    DEFER(close(fd););
-
-    struct stat stat;
-    if (::fstat(fd, &stat) < 0) {
-        LOG_ERROR("failed to stat `", fn);
-        return "";
-    }
-    SHA256_CTX ctx = {0};
-    SHA256_Init(&ctx);
-    __attribute__((aligned(ALIGNMENT))) char buffer[65536];
-    unsigned char sha[32];
-    ssize_t recv = 0;
-    for (off_t offset = 0; offset < stat.st_size; offset += BUFFERSIZE) {
-        recv = pread(fd, &buffer, BUFFERSIZE, offset);
-        if (recv < 0) {
-            LOG_ERROR("io error: `", fn);
-            return "";
-        }
-        if (SHA256_Update(&ctx, buffer, recv) < 0) {
-            LOG_ERROR("sha256 calculate error: `", fn);
-            return "";
-        }
-    }
-    SHA256_Final(sha, &ctx);
-    char res[SHA256_DIGEST_LENGTH * 2];
+static std::string sha256_final(SHA256_CTX *ctx) {
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    SHA256_Final(sha, ctx);
+    char res[SHA256_DIGEST_LENGTH * 2 + 1];
     for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
         sprintf(res + (i * 2), "%02x", sha[i]);
     return "sha256:" + std::string(res, SHA256_DIGEST_LENGTH * 2);
@@ -109,17 +89,7 @@ bool BkDownload::download_done() {
     old_name = dir + "/" + DOWNLOAD_TMP_NAME;
     new_name = dir + "/" + COMMIT_FILE_NAME;
 
-    // verify sha256
-    photon::semaphore done;
-    std::string shares;
-    std::thread sha256_thread([&]() {
-        shares = sha256sum(old_name.c_str());
-        done.signal(1);
-    });
-    sha256_thread.detach();
-    // wait verify finish
-    done.wait(1);
-
+    // verify sha256, which is computed while downloading
     if (shares != digest) {
         LOG_ERROR("verify checksum ` failed (expect: `, got: `)", old_name, digest, shares);
         force_download = true; // force redownload next time
@@ -162,112 +132,386 @@ void BkDownload::unlock_file() {
     lock_files.erase(dir);
 }
 
-bool BkDownload::download_blob() {
-    std::string dl_file_path = dir + "/" + DOWNLOAD_TMP_NAME;
-    try_cnt--;
-    IFile *src = src_file;
-    if (limit_MB_ps > 0) {
-        ThrottleLimits limits;
-        limits.R.throughput = limit_MB_ps * 1024UL * 1024; // MB
-        limits.R.block_size = 1024UL * 1024;
-        limits.time_window = 1UL;
-        src = new_throttled_file(src, limits);
+void BandwidthLimiter::acquire(size_t bytes) {
+    if (m_rate == 0)
+        return;
+    while (true) {
+        auto elapsed = std::min(photon::now - m_last, 1000UL * 1000);
+        m_last = photon::now;
+        m_tokens = std::min((int64_t)m_rate, m_tokens + (int64_t)(elapsed * m_rate / 1000000));
+        if (m_tokens > 0) {
+            // a large block may overdraw, which is paid back by the following ones
+            m_tokens -= bytes;
+            return;
+        }
+        photon::thread_usleep((-m_tokens) * 1000000 / m_rate + 1000);
     }
-    DEFER({
-        if (limit_MB_ps > 0)
-            delete src;
-    });
+}
 
-    auto dst = open_localfile_adaptor(dl_file_path.c_str(), O_RDWR | O_CREAT, 0644);
-    if (dst == nullptr) {
-        LOG_ERRNO_RETURN(0, false, "failed to open dst file `", dl_file_path.c_str());
+void AdaptiveThrottle::adjust() {
+    photon::scoped_lock lock(m_stat->mutex);
+    auto rate = m_limiter->rate();
+    auto reads = m_stat->reads;
+    auto avg_latency = reads ? m_stat->latency_sum / reads : 0;
+    if (avg_latency > m_target_latency_us || m_stat->max_inflight > m_target_depth) {
+        rate = std::max(rate / 2, std::min(MIN_ADAPTIVE_RATE, m_ceiling));
+    } else {
+        rate = std::min(rate + m_ceiling / (reads ? 10 : 4), m_ceiling);
     }
-    DEFER(delete dst;);
-    dst->ftruncate(file_size);
+    if (rate != m_limiter->rate()) {
+        LOG_DEBUG("background download rate ` -> `, foreground reads: `, avg latency: `, depth: `",
+                  m_limiter->rate(), rate, reads, avg_latency, m_stat->max_inflight);
+        m_limiter->set_rate(rate);
+    }
+    m_stat->reads = 0;
+    m_stat->latency_sum = 0;
+    m_stat->max_inflight = m_stat->inflight;
+}
+
+void DemandTracker::add(off_t offset, size_t count) {
+    photon::scoped_lock lock(m_mutex);
+    m_score = decay() + count;
+    m_ranges.emplace_back(offset, count);
+    if (m_ranges.size() > MAX_DEMAND_RANGES)
+        m_ranges.pop_front();
+}
+
+uint64_t DemandTracker::score() {
+    photon::scoped_lock lock(m_mutex);
+    return decay();
+}
+
+double DemandTracker::decay() {
+    m_score *= exp2(-(double)(photon::now - m_last) / DEMAND_HALF_LIFE_US);
+    m_last = photon::now;
+    return m_score;
+}
+
+bool DemandTracker::pop(off_t &offset, size_t &count) {
+    photon::scoped_lock lock(m_mutex);
+    if (m_ranges.empty())
+        return false;
+    offset = m_ranges.back().first;
+    count = m_ranges.back().second;
+    m_ranges.pop_back();
+    return true;
+}
+
+class DemandFile : public ForwardFile_Ownership {
+public:
+    DemandFS *m_fs;
+    std::string m_path;
+
+    DemandFile(IFile *file, DemandFS *fs, const char *path)
+        : ForwardFile_Ownership(file, true), m_fs(fs), m_path(path) {
+    }
+
+    template <typename F>
+    ssize_t track(off_t offset, F read) {
+        auto watchers = m_fs->read_start(m_path);
+        if (watchers.empty())
+            return read();
+        auto start = photon::now;
+        auto ret = read();
+        m_fs->read_finish(m_path, watchers, offset, ret, photon::now - start);
+        return ret;
+    }
+
+    ssize_t pread(void *buf, size_t count, off_t offset) override {
+        return track(offset, [&]() { return m_file->pread(buf, count, offset); });
+    }
+
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        return track(offset, [&]() { return m_file->preadv(iov, iovcnt, offset); });
+    }
+};
+
+IFile *DemandFS::open(const char *pathname, int flags) {
+    auto file = m_fs->open(pathname, flags);
+    if (!file)
+        return nullptr;
+    return new DemandFile(file, this, pathname);
+}
+
+IFile *DemandFS::open(const char *pathname, int flags, mode_t mode) {
+    auto file = m_fs->open(pathname, flags, mode);
+    if (!file)
+        return nullptr;
+    return new DemandFile(file, this, pathname);
+}
+
+void DemandFS::watch(const std::string &path, DemandTracker *tracker, ForegroundStat *stat) {
+    photon::scoped_lock lock(m_mutex);
+    m_watchers.emplace(path, Watcher{tracker, stat});
+}
+
+void DemandFS::unwatch(DemandTracker *tracker) {
+    photon::scoped_lock lock(m_mutex);
+    for (auto it = m_watchers.begin(); it != m_watchers.end();) {
+        if (it->second.tracker == tracker)
+            it = m_watchers.erase(it);
+        else
+            ++it;
+    }
+}
+
+std::vector<DemandFS::Watcher> DemandFS::read_start(const std::string &path) {
+    std::vector<Watcher> watchers;
+    photon::scoped_lock lock(m_mutex);
+    auto range = m_watchers.equal_range(path);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second.stat)
+            it->second.stat->start();
+        watchers.push_back(it->second);
+    }
+    return watchers;
+}
+
+void DemandFS::read_finish(const std::string &path, const std::vector<Watcher> &watchers,
+                           off_t offset, ssize_t ret, uint64_t latency_us) {
+    photon::scoped_lock lock(m_mutex);
+    // only the ones still watching, others may have been destructed during the read
+    auto range = m_watchers.equal_range(path);
+    for (auto it = range.first; it != range.second; ++it) {
+        for (auto &w : watchers) {
+            if (w.tracker != it->second.tracker)
+                continue;
+            if (w.stat)
+                w.stat->finish(latency_us);
+            if (ret > 0)
+                w.tracker->add(offset, ret);
+            break;
+        }
+    }
+}
+
+bool BkDownload::hash_block(IFile *dst, void *buff, off_t offset, size_t count, bool present) {
+    // blocks are hashed in order of offset, the buffer is held until all
+    // the blocks before it are hashed
+    while (hashed_offset != offset) {
+        if (failed)
+            return false;
+        hash_cond.wait_no_lock();
+    }
+    if (present && dst->pread(buff, count, offset) != (ssize_t)count) {
+        LOG_ERRNO_RETURN(0, false, "failed to read downloaded block at ", VALUE(offset));
+    }
+    SHA256_Update(&sha_ctx, buff, count);
+    hashed_offset += count;
+    hash_cond.notify_all();
+    return true;
+}
+
+bool BkDownload::is_cached(off_t offset, size_t count) {
+    if (cached_file == nullptr)
+        return false;
+    struct fiemap_t<4> fie(offset, count);
+    if (cached_file->fiemap(&fie) != 0 || fie.fm_mapped_extents != 1)
+        return false;
+    auto &extent = fie.fm_extents[0];
+    return (off_t)extent.fe_logical <= offset &&
+           (off_t)(extent.fe_logical + extent.fe_length) >= offset + (off_t)count;
+}
+
+bool BkDownload::fetch_block(IFile *dst, void *buff, off_t offset, size_t count) {
+    // the cached file only fetches what is not resident, which is none
+    bool cached = is_cached(offset, count);
+    IFile *src = cached ? cached_file : src_file;
+    int retry = 2;
+again_read:
+    if (!(retry--))
+        LOG_ERROR_RETURN(EIO, false, "failed to read at ", VALUE(offset), VALUE(count));
+    if (limiter && !cached)
+        limiter->acquire(count);
+    ssize_t rlen;
+    {
+        SCOPE_AUDIT("bk_download", AU_FILEOP(url, offset, rlen));
+        rlen = src->pread(buff, count, offset);
+    }
+    if (rlen < 0) {
+        LOG_WARN("failed to read at ", VALUE(offset), VALUE(count), VALUE(errno), " retry...");
+        goto again_read;
+    }
+    retry = 2;
+again_write:
+    if (!(retry--))
+        LOG_ERROR_RETURN(EIO, false, "failed to write at ", VALUE(offset), VALUE(count));
+    auto wlen = dst->pwrite(buff, count, offset);
+    // but once write lenth larger than read length treats as OK
+    if (wlen < rlen) {
+        LOG_WARN("failed to write at ", VALUE(offset), VALUE(count), VALUE(errno), " retry...");
+        goto again_write;
+    }
+    if (cached)
+        reused_bytes += count;
+    return true;
+}
+
+bool BkDownload::download_block(IFile *dst, void *buff, off_t offset) {
+    auto count = std::min((size_t)block_size, file_size - offset);
+    auto idx = offset / block_size;
+    while (block_state[idx] == BLOCK_FETCHING) {
+        if (failed)
+            return false;
+        hash_cond.wait_no_lock();
+    }
+    if (block_state[idx] == BLOCK_DONE)
+        return hash_block(dst, buff, offset, count, true);
+    if (!force_download) {
+        // check aleady downloaded.
+        auto hole_pos = dst->lseek(offset, SEEK_HOLE);
+        if (hole_pos >= offset + (off_t)count) {
+            // only blocks downloaded by previous attempts are read back for hashing
+            return hash_block(dst, buff, offset, count, true);
+        }
+    }
+    if (!fetch_block(dst, buff, offset, count))
+        return false;
+    return hash_block(dst, buff, offset, count, false);
+}
 
-    size_t bs = block_size;
-    off_t offset = 0;
+bool BkDownload::next_hot_block(off_t &offset) {
+    while (true) {
+        if (hot_blocks.empty()) {
+            off_t range_offset;
+            size_t range_count;
+            if (demand == nullptr || !demand->pop(range_offset, range_count))
+                return false;
+            auto end = std::min((off_t)file_size, range_offset + (off_t)range_count);
+            for (off_t o = range_offset / block_size * block_size; o < end; o += block_size)
+                hot_blocks.push_back(o);
+            continue;
+        }
+        offset = hot_blocks.front();
+        hot_blocks.pop_front();
+        // blocks behind the cursor are already taken by the sequential pass
+        if (offset >= next_offset && block_state[offset / block_size] == BLOCK_NONE)
+            return true;
+    }
+}
+
+bool BkDownload::download_hot_block(IFile *dst, void *buff, off_t offset) {
+    auto count = std::min((size_t)block_size, file_size - offset);
+    auto idx = offset / block_size;
+    block_state[idx] = BLOCK_FETCHING;
+    bool ok = (!force_download && dst->lseek(offset, SEEK_HOLE) >= offset + (off_t)count) ||
+              fetch_block(dst, buff, offset, count);
+    // a failed block is left to the sequential pass
+    block_state[idx] = ok ? BLOCK_DONE : BLOCK_NONE;
+    if (ok)
+        hot_bytes += count;
+    hash_cond.notify_all();
+    return ok;
+}
+
+void BkDownload::download_blocks(IFile *dst) {
     void *buff = nullptr;
     // buffer allocate, with 4K alignment
-    ::posix_memalign(&buff, ALIGNMENT, bs);
-    if (buff == nullptr)
-        LOG_ERRNO_RETURN(0, false, "failed to allocate buffer with ", VALUE(bs));
+    ::posix_memalign(&buff, ALIGNMENT, block_size);
+    if (buff == nullptr) {
+        failed = true;
+        LOG_ERRNO_RETURN(0, , "failed to allocate buffer with ", VALUE(block_size));
+    }
     DEFER(free(buff));
 
-    LOG_INFO("download blob start. (`)", url);
-    while (offset < file_size) {
+    while (!failed) {
         if (running != 1) {
+            failed = true;
+            hash_cond.notify_all();
             LOG_INFO("image file exit when background downloading");
-            return false;
+            return;
         }
-        if (!force_download) {
-            // check aleady downloaded.
-            auto hole_pos = dst->lseek(offset, SEEK_HOLE);
-            if (hole_pos >= offset + bs) {
-                // alread downloaded
-                offset += bs;
-                continue;
-            }
-        }
-
-        int retry = 2;
-        auto count = bs;
-        if (offset + count > file_size)
-            count = file_size - offset;
-    again_read:
-        if (!(retry--))
-            LOG_ERROR_RETURN(EIO, false, "failed to read at ", VALUE(offset), VALUE(count));
-        ssize_t rlen;
-        {
-            SCOPE_AUDIT("bk_download", AU_FILEOP(url, offset, rlen));
-            rlen = src->pread(buff, bs, offset);
-        }
-        if (rlen < 0) {
-            LOG_WARN("failed to read at ", VALUE(offset), VALUE(count), VALUE(errno), " retry...");
-            goto again_read;
+        off_t offset;
+        if (next_hot_block(offset)) {
+            download_hot_block(dst, buff, offset);
+            continue;
         }
-        retry = 2;
-    again_write:
-        if (!(retry--))
-            LOG_ERROR_RETURN(EIO, false, "failed to write at ", VALUE(offset), VALUE(count));
-        auto wlen = dst->pwrite(buff, count, offset);
-        // but once write lenth larger than read length treats as OK
-        if (wlen < rlen) {
-            LOG_WARN("failed to write at ", VALUE(offset), VALUE(count), VALUE(errno), " retry...");
-            goto again_write;
+        if (next_offset >= (off_t)file_size)
+            break;
+        offset = next_offset;
+        next_offset += block_size;
+        if (!download_block(dst, buff, offset)) {
+            failed = true;
+            hash_cond.notify_all();
+            return;
         }
-        offset += count;
     }
-    LOG_INFO("download blob done. (`)", dl_file_path);
-    return true;
 }
 
-void bk_download_proc(std::list<BKDL::BkDownload *> &dl_list, uint64_t delay_sec, int &running) {
-    LOG_INFO("BACKGROUND DOWNLOAD THREAD STARTED.");
-    uint64_t time_st = photon::now;
-    while (photon::now - time_st < delay_sec * 1000000) {
-        photon::thread_usleep(200 * 1000);
-        if (running != 1)
-            break;
+bool BkDownload::download_blob() {
+    std::string dl_file_path = dir + "/" + DOWNLOAD_TMP_NAME;
+    try_cnt--;
+
+    auto dst = open_localfile_adaptor(dl_file_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (dst == nullptr) {
+        LOG_ERRNO_RETURN(0, false, "failed to open dst file `", dl_file_path.c_str());
+    }
+    DEFER(delete dst;);
+    dst->ftruncate(file_size);
+    if (cached_fs != nullptr) {
+        cached_file = cached_fs->open(url.c_str(), O_RDONLY);
+        if (cached_file == nullptr)
+            LOG_WARN("failed to open ` in registry cache, download all blocks", url);
+        cached_fs = nullptr;
+    }
+
+    LOG_INFO("download blob start. (`, concurrency `)", url, concurrency);
+    // blocks are fetched by concurrent range workers in order of offset, a block
+    // already downloaded in previous attempts is skipped by SEEK_HOLE, and blocks
+    // read by foreground recently are fetched ahead of the others
+    next_offset = 0;
+    hashed_offset = 0;
+    reused_bytes = 0;
+    hot_bytes = 0;
+    block_state.assign((file_size + block_size - 1) / block_size, BLOCK_NONE);
+    hot_blocks.clear();
+    failed = false;
+    SHA256_Init(&sha_ctx);
+    std::vector<photon::join_handle *> jhs;
+    for (int i = 0; i < concurrency; i++) {
+        auto th = photon::thread_create11(&BkDownload::download_blocks, this, dst);
+        jhs.push_back(photon::thread_enable_join(th));
+    }
+    for (auto jh : jhs) {
+        photon::thread_join(jh);
     }
+    if (failed) {
+        return false;
+    }
+    shares = sha256_final(&sha_ctx);
+    LOG_INFO("download blob done. (`, ` bytes from registry cache, ` bytes fetched on demand)",
+             dl_file_path, reused_bytes, hot_bytes);
+    return true;
+}
 
+// pointers are passed, so that all workers share the same list and status
+static void bk_download_worker(std::list<BKDL::BkDownload *> *list, int *status,
+                               BandwidthLimiter *limiter) {
+    auto &dl_list = *list;
+    auto &running = *status;
     while (!dl_list.empty()) {
         if (running != 1) {
             LOG_WARN("image exited, background download exit...");
             break;
         }
-        photon::thread_usleep(200 * 1000);
 
-        BKDL::BkDownload *dl_item = dl_list.front();
-        dl_list.pop_front();
+        // the blob read most recently goes first, in order of layers if none is read
+        auto it = std::max_element(dl_list.begin(), dl_list.end(),
+                                   [](BkDownload *a, BkDownload *b) {
+                                       return a->demand_score() < b->demand_score();
+                                   });
+        BKDL::BkDownload *dl_item = *it;
+        dl_list.erase(it);
 
-        LOG_INFO("start downloading for dir `", dl_item->dir);
+        LOG_INFO("start downloading for dir `, demand `", dl_item->dir, dl_item->demand_score());
 
         if (!dl_item->lock_file()) {
             dl_list.push_back(dl_item);
+            photon::thread_usleep(200 * 1000);
             continue;
         }
 
+        dl_item->set_limiter(limiter);
         bool succ = dl_item->download();
         dl_item->unlock_file();
 
@@ -280,12 +524,65 @@ void bk_download_proc(std::list<BKDL::BkDownload *> &dl_list, uint64_t delay_sec
         if (!succ && dl_item->try_cnt > 0) {
             dl_list.push_back(dl_item);
             LOG_WARN("download failed, push back to download queue and retry `", dl_item->dir);
+            photon::thread_usleep(200 * 1000);
             continue;
         }
         LOG_DEBUG("finish downloading or no retry any more: `, retry_cnt: `", dl_item->dir,
                   dl_item->try_cnt);
         delete dl_item;
     }
+}
+
+static void adaptive_throttle_proc(AdaptiveThrottle *throttle, int *status, bool *done) {
+    while (!*done && *status == 1) {
+        photon::thread_usleep(ADAPT_INTERVAL_US);
+        if (*done)
+            break;
+        throttle->adjust();
+    }
+}
+
+void bk_download_proc(std::list<BKDL::BkDownload *> &dl_list, uint64_t delay_sec, int &running,
+                      int32_t limit_MB_ps, int parallel_blobs, ForegroundStat *fg_stat,
+                      uint64_t target_latency_us, uint64_t target_depth) {
+    LOG_INFO("BACKGROUND DOWNLOAD THREAD STARTED.");
+    uint64_t time_st = photon::now;
+    while (photon::now - time_st < delay_sec * 1000000) {
+        photon::thread_usleep(200 * 1000);
+        if (running != 1)
+            break;
+    }
+
+    uint64_t ceiling = limit_MB_ps > 0 ? limit_MB_ps * 1024UL * 1024 : 0;
+    BandwidthLimiter limiter(ceiling);
+    // adaptive throttling needs a ceiling to ramp up to
+    AdaptiveThrottle throttle(&limiter, fg_stat, ceiling, target_latency_us, target_depth);
+    bool throttle_done = false;
+    photon::thread *throttle_th = nullptr;
+    photon::join_handle *throttle_jh = nullptr;
+    if (fg_stat != nullptr && target_latency_us > 0 && ceiling > 0) {
+        LOG_INFO("adaptive throttling of background download, target latency `us, depth `",
+                 target_latency_us, target_depth);
+        throttle_th = photon::thread_create11(&adaptive_throttle_proc, &throttle, &running,
+                                              &throttle_done);
+        throttle_jh = photon::thread_enable_join(throttle_th);
+    }
+    DEFER({
+        if (throttle_jh != nullptr) {
+            throttle_done = true;
+            photon::thread_interrupt(throttle_th);
+            photon::thread_join(throttle_jh);
+        }
+    });
+
+    std::vector<photon::join_handle *> jhs;
+    for (int i = 0; i < std::max(parallel_blobs, 1); i++) {
+        auto th = photon::thread_create11(&bk_download_worker, &dl_list, &running, &limiter);
+        jhs.push_back(photon::thread_enable_join(th));
+    }
+    for (auto jh : jhs) {
+        photon::thread_join(jh);
+    }
 
     if (!dl_list.empty()) {
         LOG_INFO("DOWNLOAD THREAD EXITED in advance, delete dl_list.");
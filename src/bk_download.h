@@ -14,9 +14,16 @@
    limitations under the License.
 */
 #pragma once
+#include <algorithm>
+#include <deque>
 #include <list>
 #include <string>
+#include <unordered_map>
+#include <vector>
+#include <openssl/sha.h>
 #include <photon/fs/filesystem.h>
+#include <photon/fs/forwardfs.h>
+#include <photon/thread/thread.h>
 
 class ImageFile;
 class ISwitchFile;
@@ -27,6 +34,128 @@ static std::string DOWNLOAD_TMP_NAME = ".download";
 
 bool check_downloaded(const std::string &dir);
 
+// Token bucket shared by all downloading blobs of an image, within a time window of 1s.
+class BandwidthLimiter {
+public:
+    explicit BandwidthLimiter(uint64_t bytes_per_sec) : m_rate(bytes_per_sec) {
+    }
+
+    // wait until `bytes` could be consumed, 0 rate means unlimited
+    void acquire(size_t bytes);
+
+    void set_rate(uint64_t bytes_per_sec) {
+        m_rate = bytes_per_sec;
+        m_tokens = std::min(m_tokens, (int64_t)m_rate);
+    }
+
+    uint64_t rate() const {
+        return m_rate;
+    }
+
+private:
+    uint64_t m_rate;
+    int64_t m_tokens = 0;
+    uint64_t m_last = 0;
+};
+
+// Foreground reads of remote blobs of an image that miss registry cache,
+// sampled by AdaptiveThrottle. They may be counted on any vCPU sharing the cache.
+struct ForegroundStat {
+    photon::mutex mutex;
+    uint64_t inflight = 0;
+    uint64_t max_inflight = 0;
+    uint64_t reads = 0;
+    uint64_t latency_sum = 0;
+
+    void start() {
+        photon::scoped_lock lock(mutex);
+        max_inflight = std::max(max_inflight, ++inflight);
+    }
+
+    void finish(uint64_t latency_us) {
+        photon::scoped_lock lock(mutex);
+        inflight--;
+        reads++;
+        latency_sum += latency_us;
+    }
+};
+
+// AIMD control of the download bandwidth, adjusted every second by foreground
+// reads in the last second. The rate is halved if their average latency is
+// above `target_latency_us` or their depth is above `target_depth`, otherwise
+// raised by 1/10 of `ceiling`, or 1/4 if there's no foreground read at all.
+class AdaptiveThrottle {
+public:
+    AdaptiveThrottle(BandwidthLimiter *limiter, ForegroundStat *stat, uint64_t ceiling,
+                     uint64_t target_latency_us, uint64_t target_depth)
+        : m_limiter(limiter), m_stat(stat), m_ceiling(ceiling),
+          m_target_latency_us(target_latency_us), m_target_depth(target_depth) {
+    }
+
+    void adjust();
+
+private:
+    BandwidthLimiter *m_limiter;
+    ForegroundStat *m_stat;
+    uint64_t m_ceiling;
+    uint64_t m_target_latency_us;
+    uint64_t m_target_depth;
+};
+
+// Demand of a blob observed from foreground reads of it reaching registry,
+// including the ones replayed from prefetch trace. Blobs read more recently are
+// downloaded first, and the ranges read are fetched ahead of the sequential pass.
+class DemandTracker {
+public:
+    void add(off_t offset, size_t count);
+
+    // bytes read, decayed by half every 10s
+    uint64_t score();
+
+    // pop the most recent range read, returns false if there's none
+    bool pop(off_t &offset, size_t &count);
+
+private:
+    double decay();
+
+    photon::mutex m_mutex;
+    double m_score = 0;
+    uint64_t m_last = 0;
+    std::deque<std::pair<off_t, size_t>> m_ranges;
+};
+
+// Forwards to `fs` without taking its ownership. Registry cache is built on it,
+// so that only the reads missing cache, in raw blob offsets, are counted into
+// the trackers and stats watching the blob. Reads of BkDownload itself go to
+// `fs` directly and are never counted.
+class DemandFS : public photon::fs::ForwardFS {
+public:
+    explicit DemandFS(photon::fs::IFileSystem *fs) : ForwardFS(fs) {
+    }
+
+    photon::fs::IFile *open(const char *pathname, int flags) override;
+    photon::fs::IFile *open(const char *pathname, int flags, mode_t mode) override;
+
+    // `stat` may be null, both must be unwatched before destructed
+    void watch(const std::string &path, DemandTracker *tracker, ForegroundStat *stat);
+    void unwatch(DemandTracker *tracker);
+
+private:
+    friend class DemandFile;
+
+    struct Watcher {
+        DemandTracker *tracker;
+        ForegroundStat *stat;
+    };
+
+    std::vector<Watcher> read_start(const std::string &path);
+    void read_finish(const std::string &path, const std::vector<Watcher> &watchers, off_t offset,
+                     ssize_t ret, uint64_t latency_us);
+
+    photon::mutex m_mutex;
+    std::unordered_multimap<std::string, Watcher> m_watchers;
+};
+
 class BkDownload {
 public:
     std::string dir;
@@ -40,31 +169,83 @@ public:
     ~BkDownload() {
         unlock_file();
         delete src_file;
+        delete cached_file;
     }
     BkDownload(ISwitchFile *sw_file, photon::fs::IFile *src_file, size_t file_size,
                const std::string &dir, const std::string &digest, const std::string &url,
-               int &running, int32_t limit_MB_ps, int32_t try_cnt, uint32_t bs)
+               int &running, int32_t try_cnt, uint32_t bs, int concurrency,
+               photon::fs::IFileSystem *cached_fs = nullptr)
         : dir(dir), try_cnt(try_cnt), sw_file(sw_file), src_file(src_file),
-          file_size(file_size), digest(digest), url(url), running(running),
-          limit_MB_ps(limit_MB_ps), block_size(bs) {
+          cached_fs(cached_fs), file_size(file_size), digest(digest), url(url),
+          running(running), block_size(bs), concurrency(concurrency > 0 ? concurrency : 1) {
+    }
+
+    void set_limiter(BandwidthLimiter *limiter) {
+        this->limiter = limiter;
+    }
+
+    // `demand` is owned by ImageFile, which outlives this
+    void set_demand(DemandTracker *demand) {
+        this->demand = demand;
+    }
+
+    uint64_t demand_score() {
+        return demand ? demand->score() : 0;
     }
 
 private:
     void switch_to_local_file();
     bool download_blob();
     bool download_done();
+    // range worker of download_blob(), fetches blocks until the cursor reaches EOF
+    void download_blocks(photon::fs::IFile *dst);
+    bool download_block(photon::fs::IFile *dst, void *buff, off_t offset);
+    // fetch a block read by foreground ahead of the cursor, it's hashed later
+    // when the cursor reaches it
+    bool download_hot_block(photon::fs::IFile *dst, void *buff, off_t offset);
+    bool next_hot_block(off_t &offset);
+    bool fetch_block(photon::fs::IFile *dst, void *buff, off_t offset, size_t count);
+    // whether the range is resident in registry cache
+    bool is_cached(off_t offset, size_t count);
+    // feed the block into the digest once all blocks before it are hashed
+    bool hash_block(photon::fs::IFile *dst, void *buff, off_t offset, size_t count,
+                    bool present);
 
     ISwitchFile *sw_file = nullptr;
     photon::fs::IFile *src_file = nullptr;
+    // the same blob opened from registry cache, blocks resident in it are copied
+    // locally instead of being fetched again. It's opened on the first download
+    // attempt, as opening stats the blob in registry.
+    photon::fs::IFileSystem *cached_fs = nullptr;
+    photon::fs::IFile *cached_file = nullptr;
     size_t file_size;
     std::string digest;
     std::string url;
     int &running;
-    int32_t limit_MB_ps;
     uint32_t block_size;
+    int concurrency;
     bool force_download = false;
+    BandwidthLimiter *limiter = nullptr; // owned by bk_download_proc
+    DemandTracker *demand = nullptr;
+
+    // shared by range workers
+    off_t next_offset = 0;
+    bool failed = false;
+    off_t hashed_offset = 0;
+    photon::condition_variable hash_cond;
+    SHA256_CTX sha_ctx;
+    std::string shares; // digest of the downloaded blob
+    enum BlockState : uint8_t { BLOCK_NONE, BLOCK_FETCHING, BLOCK_DONE };
+    std::vector<uint8_t> block_state; // of blocks fetched ahead of the cursor
+    std::deque<off_t> hot_blocks;
+    uint64_t hot_bytes = 0;
+    uint64_t reused_bytes = 0;
 };
 
-void bk_download_proc(std::list<BKDL::BkDownload *> &, uint64_t, int &);
+// download blobs in dl_list, `parallel_blobs` of them at a time, sharing `limit_MB_ps`,
+// which is adapted to foreground reads in `fg_stat` if `target_latency_us` is not 0
+void bk_download_proc(std::list<BKDL::BkDownload *> &dl_list, uint64_t delay_sec, int &running,
+                      int32_t limit_MB_ps, int parallel_blobs, ForegroundStat *fg_stat,
+                      uint64_t target_latency_us, uint64_t target_depth);
 
 } // namespace BKDL
\ No newline at end of file
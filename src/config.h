@@ -52,6 +52,10 @@ struct DownloadConfig : public ConfigUtils::Config {
     APPCFG_PARA(maxMBps, int, 100);
     APPCFG_PARA(tryCnt, int, 5);
     APPCFG_PARA(blockSize, uint32_t, 262144);
+    APPCFG_PARA(concurrency, int, 4);
+    APPCFG_PARA(parallelBlobs, int, 2);
+    APPCFG_PARA(adaptiveLatencyUs, uint32_t, 0);
+    APPCFG_PARA(adaptiveDepth, uint32_t, 16);
 };
 
 struct ImageConfig : public ConfigUtils::Config {
@@ -64,6 +68,8 @@ struct ImageConfig : public ConfigUtils::Config {
     APPCFG_PARA(download, DownloadConfig);
     APPCFG_PARA(accelerationLayer, bool, false);
     APPCFG_PARA(recordTracePath, std::string, "");
+    APPCFG_PARA(recordTraceLBA, bool, false);
+    APPCFG_PARA(prefetchFiles, std::vector<std::string>);
 };
 
 struct P2PConfig : public ConfigUtils::Config {
@@ -87,6 +93,7 @@ struct ExporterConfig : public ConfigUtils::Config {
 
     APPCFG_PARA(enable, bool, false);
     APPCFG_PARA(uriPrefix, std::string, "/metrics");
+    APPCFG_PARA(cacheUriPrefix, std::string, "/cache");
     APPCFG_PARA(port, int, 9863);
     APPCFG_PARA(updateInterval, uint64_t, 60UL * 1000 * 1000);
 };
@@ -98,6 +105,13 @@ struct CredentialConfig : public ConfigUtils::Config {
     APPCFG_PARA(timeout, int, 1);
 };
 
+struct CacheTierConfig : public ConfigUtils::Config {
+    APPCFG_CLASS
+
+    APPCFG_PARA(cacheDir, std::string, "");
+    APPCFG_PARA(cacheSizeGB, uint32_t, 4);
+};
+
 struct CacheConfig : public ConfigUtils::Config {
     APPCFG_CLASS
 
@@ -106,6 +120,12 @@ struct CacheConfig : public ConfigUtils::Config {
     APPCFG_PARA(cacheSizeGB, uint32_t, 4);
     APPCFG_PARA(refillSize, uint32_t, 262144);
     APPCFG_PARA(blockSize, uint32_t, 65536);
+    APPCFG_PARA(tiers, std::vector<CacheTierConfig>);
+    APPCFG_PARA(promoteHits, uint32_t, 2);
+    APPCFG_PARA(directIO, bool, false);
+    APPCFG_PARA(compression, std::string, "");
+    APPCFG_PARA(fillConcurrency, int, 0);
+    APPCFG_PARA(ioQueues, int, 1);
 };
 
 struct LogConfig : public ConfigUtils::Config {
@@ -121,6 +141,24 @@ struct PrefetchConfig : public ConfigUtils::Config {
     APPCFG_CLASS
 
     APPCFG_PARA(concurrency, int, 16);
+    APPCFG_PARA(leadWindowMs, uint32_t, 3000);
+};
+
+struct RegistryFsConfig : public ConfigUtils::Config {
+    APPCFG_CLASS
+
+    APPCFG_PARA(splitSize, uint32_t, 4194304);
+    APPCFG_PARA(splitConcurrency, int, 4);
+    APPCFG_PARA(coalesceWindowUs, uint32_t, 200);
+    APPCFG_PARA(coalesceGap, uint32_t, 65536);
+    APPCFG_PARA(coalesceMaxSize, uint32_t, 1048576);
+    APPCFG_PARA(hedgePercentile, uint32_t, 0);
+    APPCFG_PARA(hedgeMinDelayUs, uint32_t, 10000);
+    APPCFG_PARA(retryBackoffBaseUs, uint32_t, 1000);
+    APPCFG_PARA(retryBackoffMaxUs, uint32_t, 1000000);
+    APPCFG_PARA(retryBudgetPercent, uint32_t, 10);
+    APPCFG_PARA(breakerFailures, uint32_t, 5);
+    APPCFG_PARA(breakerCooldownMs, uint32_t, 1000);
 };
 
 struct GlobalConfig : public ConfigUtils::Config {
@@ -137,10 +175,13 @@ struct GlobalConfig : public ConfigUtils::Config {
     APPCFG_PARA(download, DownloadConfig);
     APPCFG_PARA(enableAudit, bool, true);
     APPCFG_PARA(enableThread, bool, false);
+    APPCFG_PARA(threadsPerDevice, uint32_t, 1);
+    APPCFG_PARA(persistLayerMeta, bool, false);
     APPCFG_PARA(p2pConfig, P2PConfig);
     APPCFG_PARA(exporterConfig, ExporterConfig);
     APPCFG_PARA(auditPath, std::string, "/var/log/overlaybd-audit.log");
     APPCFG_PARA(registryFsVersion, std::string, "v2");
+    APPCFG_PARA(registryFsConfig, RegistryFsConfig);
     APPCFG_PARA(cacheConfig, CacheConfig);
     APPCFG_PARA(gzipCacheConfig, GzipCacheConfig);
     APPCFG_PARA(logConfig, LogConfig);
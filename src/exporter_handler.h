@@ -21,6 +21,8 @@
 #include <photon/common/metric-meter/metrics.h>
 #include <photon/net/http/server.h>
 
+#include "overlaybd/cache/pool_store.h"
+#include "overlaybd/registryfs/registryfs.h"
 #include "textexporter.h"
 
 namespace ExposeMetrics {
@@ -50,9 +52,49 @@ struct ExposeRender : public photon::net::http::HTTPHandler {
     EXPOSE_PHOTON_METRICLIST(count, Metric::AddCounter);
     EXPOSE_PHOTON_METRICLIST(cache, Metric::ValueCounter);
 
+    FileSystem::ICachePool* cache_pool = nullptr;
+    RegistryFS* registryfs = nullptr;
+
     template <typename... Args>
     ExposeRender(Args&&... args) {}
 
+    void render_cache_pool(std::string& ret) {
+        EXPOSE_TEMPLATE(cache_stat, OverlayBD_Cache : gauge{type} #Bytes or Count);
+        FileSystem::CacheStat stat;
+        if (cache_pool == nullptr || cache_pool->stat(&stat) != 0)
+            return;
+        uint64_t unit = stat.refill_unit;
+        ret.append(cache_stat.help_str()).append("\n");
+        ret.append(cache_stat.type_str()).append("\n");
+        ret.append(cache_stat.render(stat.total_size * unit, "total_bytes")).append("\n");
+        ret.append(cache_stat.render(stat.used_size * unit, "used_bytes")).append("\n");
+        ret.append(cache_stat.render(stat.hit_bytes, "hit_bytes")).append("\n");
+        ret.append(cache_stat.render(stat.miss_bytes, "miss_bytes")).append("\n");
+        ret.append(cache_stat.render(stat.refill_bytes, "refill_bytes")).append("\n");
+        ret.append(cache_stat.render(stat.refill_count, "refill_count")).append("\n");
+        if (stat.dedup_bytes > 0) {
+            // logical / physical size of resident data, in percent
+            uint64_t physical = stat.used_size * unit;
+            ret.append(cache_stat.render(stat.dedup_bytes, "dedup_bytes")).append("\n");
+            ret.append(cache_stat.render(
+                physical ? (physical + stat.dedup_bytes) * 100 / physical : 100,
+                "dedup_ratio_percent")).append("\n");
+        }
+        ret.append("\n");
+    }
+
+    void render_registryfs(std::string& ret) {
+        EXPOSE_TEMPLATE(registry_stat, OverlayBD_Registry : gauge{type} #Count);
+        uint64_t hedged = 0, wins = 0;
+        if (registryfs == nullptr || registryfs->getHedgeStat(hedged, wins) != 0)
+            return;
+        ret.append(registry_stat.help_str()).append("\n");
+        ret.append(registry_stat.type_str()).append("\n");
+        ret.append(registry_stat.render(hedged, "hedged_requests")).append("\n");
+        ret.append(registry_stat.render(wins, "hedge_wins")).append("\n");
+        ret.append("\n");
+    }
+
     std::string render() {
         EXPOSE_TEMPLATE(alive, OverlayBD_Alive : gauge{node});
         EXPOSE_TEMPLATE(throughput, OverlayBD_Read_Throughtput
@@ -71,6 +113,8 @@ struct ExposeRender : public photon::net::http::HTTPHandler {
         LOOP_APPEND_METRIC(ret, qps);
         LOOP_APPEND_METRIC(ret, latency);
         LOOP_APPEND_METRIC(ret, count);
+        render_cache_pool(ret);
+        render_registryfs(ret);
         return ret;
     }
 
@@ -92,6 +136,113 @@ struct ExposeRender : public photon::net::http::HTTPHandler {
     }
 };
 
+// Admin API of the registry cache pool, e.g.
+//   GET <prefix>/stat                     overall stat of the pool
+//   GET <prefix>/stat?file=sha256:xxx     stat of a cached blob
+//   GET <prefix>/evict?file=sha256:xxx    evict a cached blob
+//   GET <prefix>/evict?size=1073741824    evict at least `size` bytes in lru order
+struct CacheHandler : public photon::net::http::HTTPHandler {
+    FileSystem::ICachePool* cache_pool = nullptr;
+    RegistryFS* registryfs = nullptr;
+
+    static std::string_view get_query(std::string_view target, std::string_view key) {
+        auto pos = target.find('?');
+        if (pos == std::string_view::npos)
+            return {};
+        estring_view query(target.substr(pos + 1));
+        for (auto kv : query.split('&')) {
+            auto eq = kv.find('=');
+            if (eq != std::string_view::npos && kv.substr(0, eq) == key)
+                return kv.substr(eq + 1);
+        }
+        return {};
+    }
+
+    static std::string render_stat(const FileSystem::CacheStat& stat) {
+        uint64_t unit = stat.refill_unit;
+        std::string ret = "{";
+        ret.append("\"total_bytes\":").append(std::to_string(stat.total_size * unit))
+            .append(",\"used_bytes\":").append(std::to_string(stat.used_size * unit))
+            .append(",\"hit_bytes\":").append(std::to_string(stat.hit_bytes))
+            .append(",\"miss_bytes\":").append(std::to_string(stat.miss_bytes))
+            .append(",\"refill_bytes\":").append(std::to_string(stat.refill_bytes))
+            .append(",\"refill_count\":").append(std::to_string(stat.refill_count))
+            .append(",\"dedup_bytes\":").append(std::to_string(stat.dedup_bytes))
+            .append("}");
+        return ret;
+    }
+
+    std::string do_stat(std::string_view target, int& code) {
+        FileSystem::CacheStat stat;
+        auto file = get_query(target, "file");
+        if (cache_pool->stat(&stat, std::string(file)) != 0) {
+            code = (errno == ENOENT) ? 404 : 500;
+            return "{\"error\":\"stat failed\"}";
+        }
+        return render_stat(stat);
+    }
+
+    std::string do_evict(std::string_view target, int& code) {
+        int ret = -1;
+        auto file = get_query(target, "file");
+        auto size = get_query(target, "size");
+        if (file.empty() && size.empty()) {
+            code = 400;
+            return "{\"error\":\"evict requires file or size\"}";
+        }
+        if (!file.empty()) {
+            ret = cache_pool->evict(std::string(file));
+        } else {
+            ret = cache_pool->evict((size_t)estring_view(size).to_uint64());
+        }
+        if (ret != 0) {
+            code = (errno == ENOENT) ? 404 : (errno == EBUSY ? 503 : 500);
+            return "{\"error\":\"evict failed\"}";
+        }
+        return "{\"success\":true}";
+    }
+
+    int handle_request(photon::net::http::Request& req,
+                       photon::net::http::Response& resp,
+                       std::string_view) override {
+        std::string body;
+        int code = 200;
+        auto target = req.target();
+        auto path = target.substr(0, target.find('?'));
+        if (cache_pool == nullptr) {
+            code = 501;
+            body = "{\"error\":\"cache type does not support admin api\"}";
+        } else if (estring_view(path).ends_with("/stat")) {
+            body = do_stat(target, code);
+        } else if (estring_view(path).ends_with("/evict")) {
+            // destructive, not to be triggered by scrapers or link prefetchers
+            auto verb = req.verb();
+            if (verb != photon::net::http::Verb::POST &&
+                verb != photon::net::http::Verb::DELETE) {
+                code = 405;
+                body = "{\"error\":\"evict requires POST or DELETE\"}";
+            } else {
+                body = do_evict(target, code);
+            }
+        } else {
+            code = 404;
+            body = "{\"error\":\"unknown cache api\"}";
+        }
+        resp.set_result(code);
+        resp.keep_alive(true);
+        resp.headers.insert("Content-Type", "application/json");
+        if (code == 405)
+            resp.headers.insert("Allow", "POST, DELETE");
+        resp.headers.content_length(body.length());
+        auto len = resp.write((void*)body.data(), body.length());
+        if (len == (ssize_t)body.length()) {
+            return 0;
+        } else {
+            LOG_ERRNO_RETURN(0, -1, "Failed to write cache api response");
+        }
+    }
+};
+
 #undef LOOP_APPEND_METRIC
 #undef EXPOSE_PHOTON_METRICLIST
 };  // namespace ExposeMetrics
\ No newline at end of file
@@ -31,6 +31,7 @@ public:
     MetricMeta pread, download;
 
     ExposeMetrics::ExposeRender exporter;
+    ExposeMetrics::CacheHandler cache;
 
     OverlayBDMetric() {
         exporter.add_throughput("pread", pread.throughput);
@@ -42,6 +43,15 @@ public:
         exporter.add_qps("download", download.qps);
         exporter.add_count("download", download.total);
     }
+
+    void set_cache_pool(FileSystem::ICachePool *pool) {
+        exporter.cache_pool = pool;
+        cache.cache_pool = pool;
+    }
+
+    void set_registryfs(RegistryFS *fs) {
+        exporter.registryfs = fs;
+    }
 };
 
 struct ExporterServer {
@@ -63,6 +73,8 @@ struct ExporterServer {
         httpserver = photon::net::http::new_http_server();
         httpserver->add_handler(&metrics->exporter, false,
                                 config.exporterConfig().uriPrefix());
+        httpserver->add_handler(&metrics->cache, false,
+                                config.exporterConfig().cacheUriPrefix());
         tcpserver->set_handler(httpserver->get_connection_handler());
         tcpserver->start_loop();
         ready = true;
@@ -143,7 +143,36 @@ IFile *ImageFile::__open_ro_remote(const std::string &dir, const std::string &di
     url += digest;
 
     LOG_INFO("open file from remotefs: `, size: `", url, size);
-    IFile *remote_file = image_service.global_fs.remote_fs->open(url.c_str(), O_RDONLY);
+    bool download = conf.HasMember("download") && conf.download().enable() == 1;
+    BKDL::DemandTracker *demand = nullptr;
+    auto remote_fs = image_service.global_fs.remote_fs;
+    if (download) {
+        // reads of the blob reaching registry are tracked to order background
+        // download, and to throttle it by their latency
+        demand = new BKDL::DemandTracker();
+        m_demands.push_back(demand);
+        image_service.global_fs.demand_fs->watch(url, demand, &fg_stat);
+        if (remote_fs == image_service.global_fs.srcfs)
+            remote_fs = image_service.global_fs.demand_fs;
+    }
+    auto open_remote = [remote_fs, url, size, dir]() -> IFile * {
+        IFile *file = remote_fs->open(url.c_str(), O_RDONLY);
+        if (file != nullptr) {
+            file->ioctl(SET_SIZE, size);
+            file->ioctl(SET_LOCAL_DIR, dir);
+        }
+        return file;
+    };
+    IFile *remote_file;
+    if (image_service.global_conf.persistLayerMeta() && !dir.empty()) {
+        // no request to registry until the first data read, if opened before
+        auto meta_file = open_layer_meta_file(dir + "/" + LAYER_META_FILE_NAME, open_remote);
+        if (meta_file != nullptr)
+            m_meta_files.push_back(meta_file);
+        remote_file = meta_file;
+    } else {
+        remote_file = open_remote();
+    }
     if (!remote_file) {
         std::string err_msg = "failed to open remote file " + url + ": ";
         if (errno == EPERM || errno == EACCES) {
@@ -164,8 +193,6 @@ IFile *ImageFile::__open_ro_remote(const std::string &dir, const std::string &di
         set_failed(err_msg);
         LOG_ERRNO_RETURN(0, nullptr, err_msg);
     }
-    remote_file->ioctl(SET_SIZE, size);
-    remote_file->ioctl(SET_LOCAL_DIR, dir);
 
     IFile *tar_file = new_tar_file_adaptor(remote_file);
     if (!tar_file) {
@@ -181,15 +208,22 @@ IFile *ImageFile::__open_ro_remote(const std::string &dir, const std::string &di
         LOG_ERROR_RETURN(0, nullptr, "failed to open switch file `", url);
     }
 
-    if (conf.HasMember("download") && conf.download().enable() == 1) {
+    if (download) {
         // download from registry, verify sha256 after downloaded.
         IFile *srcfile = image_service.global_fs.srcfs->open(url.c_str(), O_RDONLY);
         if (srcfile == nullptr) {
             LOG_WARN("failed to open source file, ignore download");
         } else {
+            // blocks resident in registry cache are reused rather than downloaded again
+            IFileSystem *cached_fs = image_service.global_fs.cached_fs;
+            if (cached_fs == image_service.global_fs.srcfs) {
+                cached_fs = nullptr;
+            }
             BKDL::BkDownload *obj =
                 new BKDL::BkDownload(switch_file, srcfile, size, dir, digest, url, m_status,
-                    conf.download().maxMBps(), conf.download().tryCnt(), conf.download().blockSize());
+                    conf.download().tryCnt(), conf.download().blockSize(), conf.download().concurrency(),
+                    cached_fs);
+            obj->set_demand(demand);
             LOG_DEBUG("add to download list for `", dir);
             dl_list.push_back(obj);
         }
@@ -207,10 +241,14 @@ void ImageFile::start_bk_dl_thread() {
     uint64_t extra_range = conf.download().delayExtra();
     extra_range = (extra_range <= 0) ? 30 : extra_range;
     uint64_t delay_sec = (rand() % extra_range) + conf.download().delay();
-    LOG_INFO("background download is enabled, delay `, maxMBps `, tryCnt `, blockSize `",
-             delay_sec, conf.download().maxMBps(), conf.download().tryCnt(), conf.download().blockSize());
+    LOG_INFO("background download is enabled, delay `, maxMBps `, tryCnt `, blockSize `, concurrency `, parallelBlobs `",
+             delay_sec, conf.download().maxMBps(), conf.download().tryCnt(), conf.download().blockSize(),
+             conf.download().concurrency(), conf.download().parallelBlobs());
     dl_thread_jh = photon::thread_enable_join(
-        photon::thread_create11(&BKDL::bk_download_proc, dl_list, delay_sec, m_status));
+        photon::thread_create11(&BKDL::bk_download_proc, dl_list, delay_sec, m_status,
+                                conf.download().maxMBps(), conf.download().parallelBlobs(),
+                                &fg_stat, conf.download().adaptiveLatencyUs(),
+                                conf.download().adaptiveDepth()));
 }
 
 struct ParallelOpenTask {
@@ -356,9 +394,13 @@ LSMT::IFileRO *ImageFile::open_lowers(std::vector<ImageConfigNS::LayerConfig> &l
         goto ERROR_EXIT;
     }
     LOG_INFO("LSMT::open_files_ro(files, `) success", lowers.size());
+    for (auto meta_file : m_meta_files) {
+        meta_file->seal();
+    }
+    m_meta_files.clear();
 
     if (m_prefetcher != nullptr) {
-        m_prefetcher->replay();
+        m_prefetcher->replay(ret);
     }
 
     return ret;
@@ -367,6 +409,7 @@ ERROR_EXIT:
     if (m_exception == "") {
         m_exception = "failed to create overlaybd device";
     }
+    m_meta_files.clear();
     for (int i = 0; i < lowers.size(); i++) {
         if (files[i] != NULL)
             delete files[i];
@@ -440,6 +483,7 @@ int ImageFile::init_image_file() {
     bool has_error = false;
     auto lowers = conf.lowers();
     auto concurrency = image_service.global_conf.prefetchConfig().concurrency();
+    auto lead_window_ms = image_service.global_conf.prefetchConfig().leadWindowMs();
 
     if (conf.accelerationLayer() && !conf.recordTracePath().empty()) {
         LOG_ERROR("Cannot record trace while acceleration layer exists");
@@ -453,7 +497,7 @@ int ImageFile::init_image_file() {
         std::string trace_file = accel_layer + "/trace";
         if (Prefetcher::detect_mode(trace_file) ==
             Prefetcher::Mode::Replay) {
-            m_prefetcher = new_prefetcher(trace_file, concurrency);
+            m_prefetcher = new_prefetcher(trace_file, concurrency, lead_window_ms);
         }
 
     } else if (!conf.recordTracePath().empty()) {
@@ -462,10 +506,14 @@ int ImageFile::init_image_file() {
             LOG_ERROR("Prefetch: incorrect mode ` for prefetching", mode);
             goto ERROR_EXIT;
         }
-        m_prefetcher = new_prefetcher(conf.recordTracePath(), concurrency);
+        m_prefetcher = new_prefetcher(conf.recordTracePath(), concurrency, lead_window_ms,
+                                      conf.recordTraceLBA());
         if (mode == Prefetcher::Mode::Record) {
             record_no_download = true;
         }
+
+    } else if (!conf.prefetchFiles().empty()) {
+        m_prefetcher = new_file_prefetcher(conf.prefetchFiles(), concurrency);
     }
 
     upper.CopyFrom(conf.upper(), upper.GetAllocator());
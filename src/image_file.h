@@ -29,6 +29,7 @@
 #include "bk_download.h"
 #include "config.h"
 #include "image_service.h"
+#include "layer_meta.h"
 #include "prefetch.h"
 #include <photon/common/alog.h>
 #include <photon/fs/filesystem.h>
@@ -57,6 +58,10 @@ public:
         m_status = -1;
         if (dl_thread_jh != nullptr)
             photon::thread_join(dl_thread_jh);
+        for (auto demand : m_demands) {
+            image_service.global_fs.demand_fs->unwatch(demand);
+            delete demand;
+        }
         delete m_prefetcher;
         if (m_file) {
             m_file->close();
@@ -82,7 +87,11 @@ public:
     }
 
     ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
-        return m_file->preadv(iov, iovcnt, offset);
+        auto ret = m_file->preadv(iov, iovcnt, offset);
+        if (ret > 0 && m_prefetcher != nullptr && m_prefetcher->record_lba()) {
+            m_prefetcher->record(Prefetcher::TraceOp::READ, Prefetcher::LBA_LAYER, ret, offset);
+        }
+        return ret;
     }
 
     int fdatasync() override {
@@ -108,10 +117,23 @@ public:
         return m_file;
     }
 
+    // reads of the image may be served by multiple vCPUs at once only if none
+    // of them touches state of a single vCPU, i.e. the index of an upper layer,
+    // the trace being recorded, or the switch to blobs downloaded in background
+    bool concurrent_readable() {
+        return read_only &&
+               (m_prefetcher == nullptr || m_prefetcher->get_mode() != Prefetcher::Mode::Record) &&
+               !(conf.HasMember("download") && conf.download().enable());
+    }
+
 private:
     Prefetcher *m_prefetcher = nullptr;
     ImageConfigNS::ImageConfig conf;
     std::list<BKDL::BkDownload *> dl_list;
+    BKDL::ForegroundStat fg_stat; // of remote blobs being downloaded
+    std::vector<BKDL::DemandTracker *> m_demands;
+    // layers opened remotely, whose metadata is persisted once all are opened
+    std::vector<ILayerMetaFile *> m_meta_files;
     photon::join_handle *dl_thread_jh = nullptr;
     ImageService &image_service;
 
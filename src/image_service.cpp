@@ -16,9 +16,11 @@
 #include "image_service.h"
 #include "config.h"
 #include "image_file.h"
+#include "bk_download.h"
 #include <photon/common/alog.h>
 #include <photon/common/alog-stdstring.h>
 #include <photon/common/io-alloc.h>
+#include <photon/fs/aligned-file.h>
 #include <photon/fs/localfs.h>
 #include <photon/fs/path.h>
 #include <photon/net/curl.h>
@@ -316,7 +318,8 @@ int ImageService::init() {
     refill_size = global_conf.cacheConfig().refillSize();
     block_size = global_conf.cacheConfig().blockSize();
 
-    if (cache_type != "file" && cache_type != "ocf" && cache_type != "download") {
+    if (cache_type != "file" && cache_type != "ocf" && cache_type != "download" &&
+        cache_type != "dedup") {
         LOG_ERROR_RETURN(0, -1, "unknown cache type: `", cache_type);
     }
     LOG_INFO("cache config: ", VALUE(cache_type), VALUE(cache_dir),
@@ -344,8 +347,24 @@ int ImageService::init() {
         if (global_fs.underlay_registryfs == nullptr) {
             LOG_ERROR_RETURN(0, -1, "create registryfs failed.");
         }
+        auto registry_conf = global_conf.registryFsConfig();
+        ((RegistryFS *)global_fs.underlay_registryfs)
+            ->setRangeSplit(registry_conf.splitSize(), registry_conf.splitConcurrency());
+        ((RegistryFS *)global_fs.underlay_registryfs)
+            ->setRangeCoalesce(registry_conf.coalesceWindowUs(), registry_conf.coalesceGap(),
+                               registry_conf.coalesceMaxSize());
+        ((RegistryFS *)global_fs.underlay_registryfs)
+            ->setHedge(registry_conf.hedgePercentile(), registry_conf.hedgeMinDelayUs());
+        RegistryRetryPolicy retry_policy;
+        retry_policy.backoff_base_us = registry_conf.retryBackoffBaseUs();
+        retry_policy.backoff_max_us = registry_conf.retryBackoffMaxUs();
+        retry_policy.budget_percent = registry_conf.retryBudgetPercent();
+        retry_policy.breaker_failures = registry_conf.breakerFailures();
+        retry_policy.breaker_cooldown_us = registry_conf.breakerCooldownMs() * 1000UL;
+        ((RegistryFS *)global_fs.underlay_registryfs)->setRetryPolicy(retry_policy);
         if (global_conf.exporterConfig().enable()) {
             metrics.reset(new OverlayBDMetric());
+            metrics->set_registryfs((RegistryFS *)global_fs.underlay_registryfs);
             global_fs.srcfs = new MetricFS(global_fs.underlay_registryfs, &metrics->download);
             exporter = new ExporterServer(global_conf, metrics.get());
             if (!exporter->ready)
@@ -353,14 +372,54 @@ int ImageService::init() {
         } else {
             global_fs.srcfs = global_fs.underlay_registryfs;
         }
+        global_fs.demand_fs = new BKDL::DemandFS(global_fs.srcfs);
 
-        if (global_conf.enableThread() == true && cache_type == "file") {
-            LOG_ERROR_RETURN(0, -1, "multi-thread has not been valid for file cache");
+        if (global_conf.enableThread() == true && (cache_type == "file" || cache_type == "dedup")) {
+            LOG_ERROR_RETURN(0, -1, "multi-thread has not been valid for ` cache", cache_type);
         }
 
-        global_fs.io_alloc = new IOAlloc;
-
-        if (cache_type == "file") {
+        bool direct_io = global_conf.cacheConfig().directIO();
+        if (direct_io && cache_type != "file") {
+            LOG_WARN("directIO only takes effect for file cache, ignored");
+            direct_io = false;
+        }
+        // buffers for refill are written to cache media directly, keep them
+        // aligned so that O_DIRECT writes need no bounce buffer
+        global_fs.io_alloc = direct_io ? new AlignedAlloc(4096) : new IOAlloc;
+
+        auto tiers = global_conf.cacheConfig().tiers();
+        if (cache_type == "file" && tiers.size() == 1) {
+            delete global_fs.srcfs;
+            LOG_ERROR_RETURN(EINVAL, -1,
+                             "cacheConfig.tiers needs 2 or more tiers, set cacheDir and "
+                             "cacheSizeGB for a single one");
+        }
+        if (cache_type != "file" && !tiers.empty()) {
+            LOG_WARN("cacheConfig.tiers only takes effect for file cache, ignored");
+        }
+        if (cache_type == "file" && tiers.size() > 1) {
+            std::vector<IFileSystem *> media_fs;
+            std::vector<uint64_t> capacity_GB;
+            for (auto &tier : tiers) {
+                if (!create_dir(tier.cacheDir().c_str()))
+                    return -1;
+                auto fs = new_localfs_adaptor(tier.cacheDir().c_str());
+                if (fs == nullptr) {
+                    for (auto m : media_fs)
+                        delete m;
+                    LOG_ERROR_RETURN(0, -1, "new_localfs_adaptor for ` failed", tier.cacheDir());
+                }
+                LOG_INFO("cache tier: ", VALUE(tier.cacheDir()), VALUE(tier.cacheSizeGB()));
+                media_fs.push_back(fs);
+                capacity_GB.push_back(tier.cacheSizeGB());
+            }
+            // tiered cache will delete all media fs automatically when destructed
+            global_fs.cached_fs = FileSystem::new_tiered_file_cached_fs(
+                global_fs.demand_fs, media_fs.data(), capacity_GB.data(), media_fs.size(),
+                refill_size, global_conf.cacheConfig().promoteHits(), 10000000,
+                (uint64_t)1048576 * 4096, global_fs.io_alloc, cache_fn_trans_sha256, direct_io,
+                global_conf.cacheConfig().compression().c_str());
+        } else if (cache_type == "file") {
             auto registry_cache_fs = new_localfs_adaptor(cache_dir.c_str());
             if (registry_cache_fs == nullptr) {
                 delete global_fs.srcfs;
@@ -368,8 +427,9 @@ int ImageService::init() {
             }
             // file cache will delete its src_fs automatically when destructed
             global_fs.cached_fs = FileSystem::new_full_file_cached_fs(
-                global_fs.srcfs, registry_cache_fs, refill_size, cache_size_GB, 10000000,
-                (uint64_t)1048576 * 4096, global_fs.io_alloc, cache_fn_trans_sha256);
+                global_fs.demand_fs, registry_cache_fs, refill_size, cache_size_GB, 10000000,
+                (uint64_t)1048576 * 4096, global_fs.io_alloc, cache_fn_trans_sha256, direct_io,
+                global_conf.cacheConfig().compression().c_str());
 
         } else if (cache_type == "ocf") {
             auto namespace_dir = std::string(cache_dir + "/namespace");
@@ -397,10 +457,22 @@ int ImageService::init() {
             }
             global_fs.media_file = media_file;
 
-            global_fs.cached_fs = FileSystem::new_ocf_cached_fs(global_fs.srcfs, namespace_fs, block_size, refill_size,
-                                                                media_file, reload_media, global_fs.io_alloc);
+            global_fs.cached_fs = FileSystem::new_ocf_cached_fs(global_fs.demand_fs, namespace_fs, block_size, refill_size,
+                                                                media_file, reload_media, global_fs.io_alloc,
+                                                                global_conf.cacheConfig().ioQueues());
         } else if (cache_type == "download") {
-            global_fs.cached_fs = FileSystem::new_download_cached_fs(global_fs.srcfs, 4096, refill_size, global_fs.io_alloc);
+            global_fs.cached_fs = FileSystem::new_download_cached_fs(
+                global_fs.demand_fs, 4096, refill_size, global_fs.io_alloc,
+                global_conf.cacheConfig().fillConcurrency());
+        } else if (cache_type == "dedup") {
+            auto chunk_cache_fs = new_localfs_adaptor(cache_dir.c_str());
+            if (chunk_cache_fs == nullptr) {
+                LOG_ERROR_RETURN(0, -1, "new_localfs_adaptor for ` failed", cache_dir.c_str());
+            }
+            // dedup cache will delete its media fs automatically when destructed
+            global_fs.cached_fs = FileSystem::new_dedup_cached_fs(
+                global_fs.demand_fs, chunk_cache_fs, refill_size, cache_size_GB, global_fs.io_alloc,
+                cache_fn_trans_sha256);
         } else {
             LOG_ERROR_RETURN(0, -1, "cache type invalid");
         }
@@ -409,6 +481,10 @@ int ImageService::init() {
         }
 
         if (global_conf.exporterConfig().enable()) {
+            if (cache_type == "file" || cache_type == "dedup") {
+                auto pool = ((FileSystem::ICachedFileSystem *)global_fs.cached_fs)->get_pool();
+                metrics->set_cache_pool(pool);
+            }
             global_fs.cached_fs = new MetricFS(global_fs.cached_fs, &metrics->pread);
         }
 
@@ -491,6 +567,7 @@ ImageService::~ImageService() {
     delete global_fs.namespace_fs;
     delete global_fs.cached_fs;
     delete global_fs.gzcache_fs;
+    delete global_fs.demand_fs;
     delete global_fs.srcfs;
     delete global_fs.io_alloc;
     delete exporter;
@@ -25,11 +25,16 @@
 
 using namespace photon::fs;
 
+namespace BKDL {
+class DemandFS;
+}
 
 struct GlobalFs {
     IFileSystem *underlay_registryfs = nullptr;
     IFileSystem *remote_fs = nullptr;
     IFileSystem *srcfs = nullptr;
+    // srcfs of registry cache, counting the foreground reads reaching registry
+    BKDL::DemandFS *demand_fs = nullptr;
     IFileSystem *cached_fs = nullptr;
     Cache::GzipCachedFs *gzcache_fs = nullptr;
 
@@ -0,0 +1,257 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "layer_meta.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/common/iovector.h>
+#include <photon/common/utility.h>
+#include <photon/fs/localfs.h>
+#include <photon/fs/virtual-file.h>
+#include <photon/thread/thread.h>
+
+using namespace photon::fs;
+
+// Meta file layout, rewritten as a whole on seal:
+//   MetaHeader
+//   MetaRecord, followed by `length` bytes of the blob at `offset`
+//   ...
+struct MetaHeader {
+    static const uint64_t MAGIC = 0x4154454D44424C4FULL; // "OLBDMETA"
+    static const uint32_t VERSION = 1;
+    uint64_t magic = MAGIC;
+    uint32_t version = VERSION;
+    uint32_t nrecords = 0;
+    uint64_t size = 0;
+};
+
+struct MetaRecord {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// reads larger than this are data rather than metadata
+static const size_t kMaxMetaRead = 64UL * 1024 * 1024;
+
+class LayerMetaFile : public ILayerMetaFile {
+public:
+    std::string m_meta_path;
+    RemoteOpener m_opener;
+    IFile *m_remote = nullptr;
+    photon::mutex m_open_mutex;
+    uint64_t m_size = 0;
+    // blob offset -> content
+    std::map<off_t, std::string> m_ranges;
+    bool m_dirty = false;
+    bool m_sealed = false;
+
+    LayerMetaFile(const std::string &meta_path, RemoteOpener opener)
+        : m_meta_path(meta_path), m_opener(opener) {
+    }
+
+    ~LayerMetaFile() {
+        delete m_remote;
+    }
+
+    int load() {
+        auto file = open_localfile_adaptor(m_meta_path.c_str(), O_RDONLY, 0644, 0);
+        if (file == nullptr)
+            return -1;
+        DEFER(delete file);
+        struct stat st;
+        MetaHeader header;
+        if (file->fstat(&st) < 0 || file->pread(&header, sizeof(header), 0) != sizeof(header) ||
+            header.magic != MetaHeader::MAGIC || header.version != MetaHeader::VERSION) {
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid layer meta file `", m_meta_path);
+        }
+        off_t pos = sizeof(header);
+        for (uint32_t i = 0; i < header.nrecords; i++) {
+            MetaRecord rec;
+            if (file->pread(&rec, sizeof(rec), pos) != sizeof(rec) ||
+                pos + (off_t)sizeof(rec) + (off_t)rec.length > st.st_size) {
+                m_ranges.clear();
+                LOG_ERROR_RETURN(EINVAL, -1, "truncated layer meta file `", m_meta_path);
+            }
+            pos += sizeof(rec);
+            std::string data(rec.length, 0);
+            if (file->pread(&data[0], rec.length, pos) != (ssize_t)rec.length) {
+                m_ranges.clear();
+                LOG_ERRNO_RETURN(0, -1, "failed to read layer meta file `", m_meta_path);
+            }
+            pos += rec.length;
+            m_ranges[rec.offset] = std::move(data);
+        }
+        m_size = header.size;
+        LOG_INFO("layer meta loaded from `, size: `, ranges: `", m_meta_path, m_size,
+                 m_ranges.size());
+        return 0;
+    }
+
+    IFile *remote() {
+        if (m_remote)
+            return m_remote;
+        photon::scoped_lock lock(m_open_mutex);
+        if (m_remote == nullptr) {
+            m_remote = m_opener();
+            if (m_remote == nullptr)
+                LOG_ERRNO_RETURN(0, nullptr, "failed to open remote blob of `", m_meta_path);
+        }
+        return m_remote;
+    }
+
+    int open_remote() {
+        if (remote() == nullptr)
+            return -1;
+        struct stat st;
+        if (m_remote->fstat(&st) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to stat remote blob of `", m_meta_path);
+        m_size = st.st_size;
+        return 0;
+    }
+
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        iovector_view view((struct iovec *)iov, iovcnt);
+        auto count = view.sum();
+        if (!m_sealed && offset < (off_t)m_size) {
+            count = std::min(count, (size_t)(m_size - offset));
+            // served if a persisted range covers it
+            auto it = m_ranges.upper_bound(offset);
+            if (it != m_ranges.begin() &&
+                (--it)->first + (off_t)it->second.size() >= offset + (off_t)count) {
+                auto src = it->second.data() + (offset - it->first);
+                size_t left = count;
+                for (int i = 0; i < iovcnt && left > 0; i++) {
+                    auto n = std::min(left, iov[i].iov_len);
+                    memcpy(iov[i].iov_base, src, n);
+                    src += n;
+                    left -= n;
+                }
+                return count;
+            }
+        }
+        if (remote() == nullptr)
+            return -1;
+        auto ret = m_remote->preadv(iov, iovcnt, offset);
+        if (ret > 0 && !m_sealed && (size_t)ret <= kMaxMetaRead) {
+            std::string data(ret, 0);
+            auto dst = &data[0];
+            size_t left = ret;
+            for (int i = 0; i < iovcnt && left > 0; i++) {
+                auto n = std::min(left, iov[i].iov_len);
+                memcpy(dst, iov[i].iov_base, n);
+                dst += n;
+                left -= n;
+            }
+            m_ranges[offset] = std::move(data);
+            m_dirty = true;
+        }
+        return ret;
+    }
+
+    ssize_t pread(void *buf, size_t count, off_t offset) override {
+        struct iovec iov { buf, count };
+        return preadv(&iov, 1, offset);
+    }
+
+    int seal() override {
+        if (m_sealed)
+            return 0;
+        m_sealed = true;
+        DEFER(m_ranges.clear());
+        if (!m_dirty)
+            return 0;
+        auto tmp = m_meta_path + ".tmp";
+        auto file = open_localfile_adaptor(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644, 0);
+        if (file == nullptr)
+            LOG_ERRNO_RETURN(0, -1, "failed to create layer meta file `", tmp);
+        DEFER(delete file);
+        MetaHeader header;
+        header.nrecords = m_ranges.size();
+        header.size = m_size;
+        off_t pos = 0;
+        if (file->pwrite(&header, sizeof(header), pos) != sizeof(header))
+            LOG_ERRNO_RETURN(0, -1, "failed to write layer meta file `", tmp);
+        pos += sizeof(header);
+        for (auto &r : m_ranges) {
+            MetaRecord rec{(uint64_t)r.first, r.second.size()};
+            if (file->pwrite(&rec, sizeof(rec), pos) != sizeof(rec) ||
+                file->pwrite(r.second.data(), rec.length, pos + sizeof(rec)) !=
+                    (ssize_t)rec.length)
+                LOG_ERRNO_RETURN(0, -1, "failed to write layer meta file `", tmp);
+            pos += sizeof(rec) + rec.length;
+        }
+        if (file->fdatasync() < 0 || ::rename(tmp.c_str(), m_meta_path.c_str()) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to persist layer meta file `", m_meta_path);
+        LOG_INFO("layer meta persisted to `, ranges: `, bytes: `", m_meta_path, m_ranges.size(),
+                 pos);
+        return 0;
+    }
+
+    int fstat(struct stat *buf) override {
+        if (m_remote)
+            return m_remote->fstat(buf);
+        memset(buf, 0, sizeof(*buf));
+        buf->st_mode = S_IFREG | S_IREAD;
+        buf->st_size = m_size;
+        return 0;
+    }
+
+    int vioctl(int request, va_list args) override {
+        if (remote() == nullptr)
+            return -1;
+        return m_remote->vioctl(request, args);
+    }
+
+    IFileSystem *filesystem() override {
+        return nullptr;
+    }
+
+    int close() override {
+        return 0;
+    }
+
+    UNIMPLEMENTED(ssize_t read(void *buf, size_t count) override);
+    UNIMPLEMENTED(ssize_t readv(const struct iovec *iov, int iovcnt) override);
+    UNIMPLEMENTED(ssize_t write(const void *buf, size_t count) override);
+    UNIMPLEMENTED(ssize_t writev(const struct iovec *iov, int iovcnt) override);
+    UNIMPLEMENTED(ssize_t pwrite(const void *buf, size_t count, off_t offset) override);
+    UNIMPLEMENTED(ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override);
+    UNIMPLEMENTED(off_t lseek(off_t offset, int whence) override);
+    UNIMPLEMENTED(int fsync() override);
+    UNIMPLEMENTED(int fdatasync() override);
+    UNIMPLEMENTED(int fchmod(mode_t mode) override);
+    UNIMPLEMENTED(int fchown(uid_t owner, gid_t group) override);
+    UNIMPLEMENTED(int ftruncate(off_t length) override);
+};
+
+ILayerMetaFile *open_layer_meta_file(const std::string &meta_path, RemoteOpener opener) {
+    auto file = new LayerMetaFile(meta_path, opener);
+    if (::access(meta_path.c_str(), F_OK) == 0 && file->load() == 0)
+        return file;
+    if (file->open_remote() < 0) {
+        ERRNO eno;
+        delete file;
+        errno = eno.no;
+        return nullptr;
+    }
+    return file;
+}
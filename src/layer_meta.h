@@ -0,0 +1,40 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include <functional>
+#include <string>
+#include <photon/fs/filesystem.h>
+
+static std::string LAYER_META_FILE_NAME = "overlaybd.meta";
+
+// Persist what's read from a remote blob while opening the layer, i.e. the tar
+// header, zfile header, trailer and jump table, and LSMT index, together with
+// the blob size, in a local file of the layer dir. A layer whose metadata is
+// persisted is reopened without any request to the registry, the remote blob
+// is opened on the first read out of the persisted ranges.
+class ILayerMetaFile : public photon::fs::IFile {
+public:
+    // the layer is opened, persist the ranges read so far if there's any new,
+    // and release them from memory
+    virtual int seal() = 0;
+};
+
+using RemoteOpener = std::function<photon::fs::IFile *()>;
+
+// `opener` is called at once if there's no metadata persisted in `meta_path`,
+// nullptr is returned if it fails, with errno kept
+ILayerMetaFile *open_layer_meta_file(const std::string &meta_path, RemoteOpener opener);
@@ -24,6 +24,7 @@
 #include <photon/photon.h>
 #include <photon/thread/thread.h>
 #include <photon/thread/thread-pool.h>
+#include <photon/thread/workerpool.h>
 
 #include <libtcmu.h>
 #include <libtcmu_common.h>
@@ -43,6 +44,8 @@ struct obd_dev {
     uint32_t aio_pending_wakeups;
     uint32_t inflight;
     std::thread *work;
+    // worker vcpus reading for the device, in addition to its own
+    photon::WorkPool *pool = nullptr;
     photon::semaphore start, end;
 };
 
@@ -117,6 +120,19 @@ again:
     goto again;
 }
 
+// Reads are done on the worker vcpus of the device if there are any, while the
+// command is still completed on the device vcpu, the only one driving tcmulib.
+static ssize_t dev_read(obd_dev *odev, struct tcmulib_cmd *cmd, off_t offset) {
+    auto read = [&]() {
+        return sure({odev->file, &ImageFile::preadv}, cmd->iovec, cmd->iov_cnt, offset);
+    };
+    if (odev->pool == nullptr)
+        return read();
+    ssize_t ret = -1;
+    odev->pool->call([&]() { ret = read(); });
+    return ret;
+}
+
 void cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
     obd_dev *odev = (obd_dev *)tcmu_dev_get_private(dev);
     ImageFile *file = odev->file;
@@ -165,8 +181,7 @@ void cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
     case READ_12:
     case READ_16:
         length = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
-        ret = sure({file, &ImageFile::preadv}, cmd->iovec, cmd->iov_cnt,
-                   tcmu_cdb_to_byte(dev, cmd->cdb));
+        ret = dev_read(odev, cmd, tcmu_cdb_to_byte(dev, cmd->cdb));
         if (ret == length) {
             tcmulib_command_complete(dev, cmd, TCMU_STS_OK);
         } else {
@@ -326,6 +341,20 @@ static int dev_open(struct tcmu_device *dev) {
         LOG_ERROR_RETURN(0, -EPERM, "create image file failed");
     }
 
+    auto &conf = imgservice->global_conf;
+    if (conf.enableThread() && conf.threadsPerDevice() > 1) {
+        // the cache pools other than ocf keep their LRU and range locks per vCPU
+        auto cache_type = conf.cacheConfig().cacheType().empty() ? conf.cacheType()
+                                                                 : conf.cacheConfig().cacheType();
+        if (cache_type != "ocf" || !file->concurrent_readable()) {
+            delete file;
+            LOG_ERROR_RETURN(0, -EINVAL,
+                             "threadsPerDevice ` needs cacheType ocf and an image with no upper "
+                             "layer, trace recording nor background download, got cacheType `",
+                             conf.threadsPerDevice(), cache_type);
+        }
+    }
+
     obd_dev *odev = new obd_dev;
     odev->aio_pending_wakeups = 0;
     odev->inflight = 0;
@@ -343,6 +372,12 @@ static int dev_open(struct tcmu_device *dev) {
             photon::init(photon::INIT_EVENT_EPOLL, photon::INIT_IO_LIBCURL);
             DEFER(photon::fini());
 
+            auto nthreads = imgservice->global_conf.threadsPerDevice();
+            if (nthreads > 1) {
+                // each worker runs up to 32 reads at a time, like the device loop
+                odev->pool = new photon::WorkPool(nthreads - 1, photon::INIT_EVENT_EPOLL,
+                                                  photon::INIT_IO_LIBCURL, 32);
+            }
             odev->loop = new TCMUDevLoop(dev);
             odev->loop->run();
             LOG_INFO("obd device running");
@@ -350,6 +385,7 @@ static int dev_open(struct tcmu_device *dev) {
 
             odev->end.wait(1);
             delete odev->loop;
+            delete odev->pool;
             LOG_INFO("obd device exit");
         };
 
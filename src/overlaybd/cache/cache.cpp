@@ -21,6 +21,7 @@
 #include "frontend/cached_file.h"
 #include "pool_store.h"
 #include "full_file_cache/cache_pool.h"
+#include "full_file_cache/tiered_pool.h"
 
 namespace FileSystem {
 using namespace photon::fs;
@@ -62,7 +63,8 @@ ssize_t ICacheStore::pwritev_mutable(struct iovec *iov, int iovcnt, off_t offset
 ICachedFileSystem *new_full_file_cached_fs(IFileSystem *srcFs, IFileSystem *mediaFs,
                                            uint64_t refillUnit, uint64_t capacityInGB,
                                            uint64_t periodInUs, uint64_t diskAvailInBytes,
-                                           IOAlloc *allocator, Fn_trans_func name_trans) {
+                                           IOAlloc *allocator, Fn_trans_func name_trans,
+                                           bool directIO, const char *compression) {
     if (refillUnit % 4096 != 0) {
         LOG_ERROR_RETURN(EINVAL, nullptr, "refill Unit need to be aligned to 4KB")
     }
@@ -71,11 +73,57 @@ ICachedFileSystem *new_full_file_cached_fs(IFileSystem *srcFs, IFileSystem *medi
     }
     Cache::FileCachePool *pool = nullptr;
     pool =
-        new ::Cache::FileCachePool(mediaFs, capacityInGB, periodInUs, diskAvailInBytes, refillUnit, name_trans);
+        new ::Cache::FileCachePool(mediaFs, capacityInGB, periodInUs, diskAvailInBytes, refillUnit,
+                                   name_trans, directIO);
+    if (compression && *compression && pool->enableCompression(compression) != 0) {
+        delete pool;
+        return nullptr;
+    }
     pool->Init();
     return new_cached_fs(srcFs, pool, 4096, refillUnit, allocator);
 }
 
+ICachedFileSystem *new_tiered_file_cached_fs(IFileSystem *srcFs, IFileSystem **mediaFs,
+                                             const uint64_t *capacityInGB, int nTiers,
+                                             uint64_t refillUnit, uint32_t promoteHits,
+                                             uint64_t periodInUs, uint64_t diskAvailInBytes,
+                                             IOAlloc *allocator, Fn_trans_func name_trans,
+                                             bool directIO, const char *compression) {
+    if (refillUnit % 4096 != 0) {
+        LOG_ERROR_RETURN(EINVAL, nullptr, "refill Unit need to be aligned to 4KB")
+    }
+    if (nTiers < 2) {
+        LOG_ERROR_RETURN(EINVAL, nullptr, "at least 2 tiers are required, got `", nTiers);
+    }
+    if (!allocator) {
+        allocator = new IOAlloc;
+    }
+    // build from the bottom, each upper tier stacks on the pool below it
+    auto bottom = new ::Cache::FileCachePool(mediaFs[nTiers - 1], capacityInGB[nTiers - 1],
+                                             periodInUs, diskAvailInBytes, refillUnit,
+                                             nullptr, directIO);
+    bool compress = compression && *compression;
+    if (compress && bottom->enableCompression(compression) != 0) {
+        delete bottom;
+        return nullptr;
+    }
+    bottom->Init();
+    ICachePool *pool = bottom;
+    for (int i = nTiers - 2; i >= 0; i--) {
+        auto fast = new ::Cache::FastTierPool(mediaFs[i], capacityInGB[i], periodInUs,
+                                              diskAvailInBytes, refillUnit, nullptr, directIO);
+        if (compress && fast->enableCompression(compression) != 0) {
+            delete fast;
+            delete pool;
+            return nullptr;
+        }
+        fast->Init();
+        pool = new ::Cache::TieredCachePool(fast, pool, refillUnit, promoteHits,
+                                            i == 0 ? name_trans : nullptr);
+    }
+    return new_cached_fs(srcFs, pool, 4096, refillUnit, allocator);
+}
+
 ICacheStore *ICachePool::open(std::string_view filename, int flags, mode_t mode) {
     ICacheStore *cache_store = nullptr;
     auto it = m_stores.find(filename);
@@ -103,27 +103,66 @@ extern "C" {
 ICachedFileSystem *new_cached_fs(photon::fs::IFileSystem *src, ICachePool *pool, uint64_t pageSize,
                                  uint64_t refillUnit, IOAlloc *allocator);
 
-/** Full file cache will automatically delete its media_fs when destructed */
+/**
+ * Full file cache will automatically delete its media_fs when destructed
+ * @param directIO open media files with O_DIRECT, so cached data bypasses page cache.
+ *        Pass an aligned allocator to avoid extra copies of refilled data.
+ * @param compression "lz4" or "zstd" to keep refill units compressed in media,
+ *        nullptr or "" to store them as is.
+ */
 ICachedFileSystem *new_full_file_cached_fs(photon::fs::IFileSystem *srcFs,
                                            photon::fs::IFileSystem *media_fs,
                                            uint64_t refillUnit, uint64_t capacityInGB,
                                            uint64_t periodInUs, uint64_t diskAvailInBytes,
                                            IOAlloc *allocator,
-                                           Fn_trans_func name_trans = ICachePool::same_name_trans);
+                                           Fn_trans_func name_trans = ICachePool::same_name_trans,
+                                           bool directIO = false, const char *compression = nullptr);
+
+/**
+ * Stack of full file caches, mediaFs[0] is the fastest tier and mediaFs[nTiers - 1] the
+ * largest one. Refills go to the bottom tier, a refill unit is promoted one tier up after
+ * `promoteHits` reads, and files evicted from an upper tier are demoted instead of dropped.
+ * All media_fs will be deleted when destructed.
+ */
+ICachedFileSystem *new_tiered_file_cached_fs(photon::fs::IFileSystem *srcFs,
+                                             photon::fs::IFileSystem **mediaFs,
+                                             const uint64_t *capacityInGB, int nTiers,
+                                             uint64_t refillUnit, uint32_t promoteHits,
+                                             uint64_t periodInUs, uint64_t diskAvailInBytes,
+                                             IOAlloc *allocator,
+                                             Fn_trans_func name_trans = ICachePool::same_name_trans,
+                                             bool directIO = false,
+                                             const char *compression = nullptr);
 
 /**
  * @param blk_size The proper size for cache metadata and IO efficiency.
  *        Large writes to cache media will be split into blk_size. Reads are not affected.
  * @param prefetch_unit Controls the expand prefetch size from src file. 0 means to disable this
  * feature.
+ * @param io_queues # of OCF io queues, each served by its own vCPU when more than 1.
  */
 photon::fs::IFileSystem *new_ocf_cached_fs(photon::fs::IFileSystem *src_fs,
                                            photon::fs::IFileSystem *namespace_fs, size_t blk_size,
                                            size_t prefetch_unit, photon::fs::IFile *media_file,
-                                           bool reload_media, IOAlloc *io_alloc);
+                                           bool reload_media, IOAlloc *io_alloc,
+                                           int io_queues = 1);
 
+/**
+ * @param fill_concurrency # of background workers completing the local copy, 0 to fill
+ *        on demand only.
+ */
 photon::fs::IFileSystem *new_download_cached_fs(photon::fs::IFileSystem *src_fs, size_t blk_size,
-                                                size_t refill_size, IOAlloc *io_alloc);
+                                                size_t refill_size, IOAlloc *io_alloc,
+                                                int fill_concurrency = 0);
+
+/**
+ * Content-addressed cache, blobs are split into chunks of refillUnit and identical
+ * chunks are stored only once in media_fs. media_fs will be deleted when destructed.
+ */
+ICachedFileSystem *new_dedup_cached_fs(photon::fs::IFileSystem *srcFs,
+                                       photon::fs::IFileSystem *media_fs, uint64_t refillUnit,
+                                       uint64_t capacityInGB, IOAlloc *allocator,
+                                       Fn_trans_func name_trans = ICachePool::same_name_trans);
 } // extern "C"
 
 } // namespace FileSystem
@@ -0,0 +1,762 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "../cache.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <openssl/sha.h>
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/common/enumerable.h>
+#include <photon/common/iovector.h>
+#include <photon/common/string-keyed.h>
+#include <photon/common/utility.h>
+#include <photon/fs/filesystem.h>
+#include <photon/fs/path.h>
+#include <photon/thread/thread.h>
+#include "../policy/lru.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01 /* default is extend size */
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02 /* de-allocates range */
+#endif
+
+/*
+ * Content-addressed cache pool.
+ *
+ * Blobs are split into fixed chunks of `refillUnit` bytes (the last one may be shorter).
+ * Each chunk is identified by its sha256 and stored only once in a slot of the pack file
+ * `/chunks.pack`, no matter how many blobs contain it. Every blob owns a chunk map
+ * `/maps/<name>`, which is an array of ChunkRef indexed by chunk number.
+ *
+ * Chunk refcounts and free slots are not persisted, they are rebuilt from the chunk maps
+ * in Init(). New chunk data is synced before the map entries referencing it are written,
+ * and a slot is released only after the map entries dropping it are synced, so a crash
+ * leaves at most some unreferenced slots, which are reclaimed on next Init(). Maps that
+ * fail to load are removed, and chunks claiming the same slot are verified against
+ * their digest on load.
+ *
+ * Eviction works on blobs in lru order, a slot is released when its refcount drops to 0.
+ */
+namespace Cache {
+
+using namespace FileSystem;
+using namespace photon::fs;
+
+static const uint64_t kGB = 1024 * 1024 * 1024;
+static const uint32_t kEvictRatio = 10; // evict 10% capacity when pack is full,
+                                        // and keep usage below 90% on evict(0)
+static const char *kPackName = "/chunks.pack";
+static const char *kMapDir = "/maps/";
+
+struct ChunkRef {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    uint32_t slot;
+    uint32_t length; // 0 means not cached
+};
+static_assert(sizeof(ChunkRef) == 40, "ChunkRef size mismatch");
+
+struct ChunkEntry {
+    uint32_t slot;
+    uint32_t length;
+    uint32_t refcnt;
+};
+
+class DedupCachePool;
+
+struct BlobEntry {
+    std::string name;
+    IFile *map_file = nullptr; // opened while blob is opened
+    std::vector<ChunkRef> refs;
+    uint32_t lru_iter = 0;
+    int open_count = 0;
+    uint64_t hit_bytes = 0;
+    uint64_t miss_bytes = 0;
+    uint64_t refill_count = 0;
+    uint64_t refill_bytes = 0;
+    photon::rwlock rw_lock;
+    // set while a writer holds rw_lock, such a blob is never evicted to make
+    // room, or two writers evicting each other's blob would deadlock
+    bool writing = false;
+};
+
+// walks through an iovec array, cutting it into consecutive pieces
+struct IOVCursor {
+    const struct iovec *iov;
+    int iovcnt;
+    int idx = 0;
+    size_t off = 0;
+
+    IOVCursor(const struct iovec *iov, int iovcnt) : iov(iov), iovcnt(iovcnt) {
+    }
+
+    size_t take(size_t len, std::vector<struct iovec> &out) {
+        out.clear();
+        size_t got = 0;
+        while (got < len && idx < iovcnt) {
+            auto n = std::min(len - got, iov[idx].iov_len - off);
+            out.push_back({(char *)iov[idx].iov_base + off, n});
+            got += n;
+            off += n;
+            if (off == iov[idx].iov_len) {
+                idx++;
+                off = 0;
+            }
+        }
+        return got;
+    }
+};
+
+class DedupCacheStore : public ICacheStore {
+public:
+    DedupCacheStore(DedupCachePool *pool, BlobEntry *blob) : m_pool(pool), m_blob(blob) {
+    }
+    ~DedupCacheStore();
+
+    try_preadv_result try_preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
+    ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override;
+    int stat(CacheStat *stat) override;
+    int evict(off_t offset, size_t count = -1) override;
+    int ftruncate(off_t length) override;
+    std::pair<off_t, size_t> queryRefillRange(off_t offset, size_t size) override;
+    int fstat(struct stat *buf) override;
+
+private:
+    DedupCachePool *m_pool;
+    BlobEntry *m_blob;
+    off_t m_size = 0;
+};
+
+class DedupCachePool : public ICachePool {
+public:
+    DedupCachePool(IFileSystem *media_fs, uint64_t capacity_GB, uint64_t refill_unit,
+                   Fn_trans_func name_trans)
+        : m_media_fs(media_fs), m_refill_unit(refill_unit),
+          m_max_slots(capacity_GB * kGB / refill_unit) {
+        if (name_trans != nullptr)
+            m_name_trans = name_trans;
+    }
+
+    ~DedupCachePool() {
+        for (auto &it : m_blobs) {
+            safe_delete(it.second->map_file);
+        }
+        delete m_pack;
+        delete m_media_fs;
+    }
+
+    int Init() {
+        m_pack = m_media_fs->open(kPackName, O_RDWR | O_CREAT, 0644);
+        if (m_pack == nullptr)
+            LOG_ERRNO_RETURN(0, -1, "failed to open chunk pack `", kPackName);
+        if (photon::fs::mkdir_recursive(kMapDir, m_media_fs) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to create chunk map dir `", kMapDir);
+
+        std::vector<std::string> corrupted;
+        for (auto file : enumerable(photon::fs::Walker(m_media_fs, kMapDir))) {
+            if (load_blob(file) < 0)
+                corrupted.emplace_back(file);
+        }
+        for (auto &file : corrupted) {
+            LOG_WARN("remove chunk map failed to load `", file);
+            m_media_fs->unlink(file.c_str());
+        }
+        drop_colliding_chunks();
+        // slots not referenced by any map are free
+        std::vector<bool> used(m_nslots, false);
+        for (auto &it : m_chunks)
+            used[it.second.slot] = true;
+        for (uint32_t i = 0; i < m_nslots; i++) {
+            if (!used[i]) {
+                m_free_slots.push_back(i);
+                m_pack->fallocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                  (off_t)i * m_refill_unit, m_refill_unit);
+            }
+        }
+        LOG_INFO("dedup cache loaded, blobs: `, chunks: `, slots: `, logical: `, physical: `",
+                 m_blobs.size(), m_chunks.size(), m_nslots, m_logical_bytes, m_physical_bytes);
+        return 0;
+    }
+
+    ICacheStore *do_open(std::string_view pathname, int flags, mode_t mode) override {
+        auto name = blob_name(pathname);
+        auto blob = get_blob(name);
+        if (blob->map_file == nullptr) {
+            auto map_path = map_path_of(name);
+            auto dir = photon::fs::Path(map_path.c_str()).dirname();
+            if (photon::fs::mkdir_recursive(dir, m_media_fs) < 0)
+                LOG_ERRNO_RETURN(0, nullptr, "mkdir failed, path : `", map_path);
+            blob->map_file = m_media_fs->open(map_path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (blob->map_file == nullptr)
+                LOG_ERRNO_RETURN(0, nullptr, "failed to open chunk map `", map_path);
+        }
+        blob->open_count++;
+        m_lru.access(blob->lru_iter);
+        return new DedupCacheStore(this, blob);
+    }
+
+    int stat(CacheStat *stat, std::string_view pathname = std::string_view(nullptr, 0)) override {
+        if (stat == nullptr)
+            LOG_ERROR_RETURN(EINVAL, -1, "stat is nullptr");
+        if (pathname.empty() || pathname == "/") {
+            stat->refill_unit = m_refill_unit;
+            stat->total_size = m_max_slots;
+            stat->used_size = m_chunks.size();
+            stat->hit_bytes = m_hit_bytes;
+            stat->miss_bytes = m_miss_bytes;
+            stat->refill_count = m_refill_count;
+            stat->refill_bytes = m_refill_bytes;
+            stat->dedup_bytes = m_logical_bytes - m_physical_bytes;
+            return 0;
+        }
+        auto it = m_blobs.find(blob_name(pathname));
+        if (it == m_blobs.end())
+            LOG_ERROR_RETURN(ENOENT, -1, "blob is not cached, name : `", pathname);
+        fill_stat(it->second.get(), stat);
+        return 0;
+    }
+
+    int evict(std::string_view filename) override {
+        auto it = m_blobs.find(blob_name(filename));
+        if (it == m_blobs.end())
+            LOG_ERROR_RETURN(ENOENT, -1, "blob is not cached, name : `", filename);
+        evict_blob(it->second.get());
+        LOG_INFO("evict dedup cache blob `", filename);
+        return 0;
+    }
+
+    // evict `size` bytes if not 0, then down to the water mark
+    int evict(size_t size = 0) override {
+        if (size > 0) {
+            auto freed = evict_lru(size, nullptr);
+            LOG_INFO("evict dedup cache by size, expect : `, actual : `", size, freed);
+        }
+        auto water_mark = m_max_slots * m_refill_unit * (100 - kEvictRatio) / 100;
+        if (m_physical_bytes > water_mark)
+            evict_lru(m_physical_bytes - water_mark, nullptr);
+        return 0;
+    }
+
+    uint64_t refill_unit() const {
+        return m_refill_unit;
+    }
+
+    void fill_stat(BlobEntry *blob, CacheStat *stat) {
+        stat->refill_unit = m_refill_unit;
+        stat->total_size = blob->refs.size();
+        stat->used_size = 0;
+        stat->dedup_bytes = 0;
+        for (auto &ref : blob->refs) {
+            if (ref.length == 0)
+                continue;
+            stat->used_size++;
+            auto it = m_chunks.find(key_of(ref));
+            if (it != m_chunks.end() && it->second.refcnt > 1)
+                stat->dedup_bytes += ref.length;
+        }
+        stat->hit_bytes = blob->hit_bytes;
+        stat->miss_bytes = blob->miss_bytes;
+        stat->refill_count = blob->refill_count;
+        stat->refill_bytes = blob->refill_bytes;
+    }
+
+    void close_blob(BlobEntry *blob) {
+        if (--blob->open_count == 0)
+            safe_delete(blob->map_file);
+    }
+
+    void add_hit(BlobEntry *blob, uint64_t bytes) {
+        blob->hit_bytes += bytes;
+        m_hit_bytes += bytes;
+        m_lru.access(blob->lru_iter);
+    }
+
+    void add_miss(BlobEntry *blob, uint64_t bytes) {
+        blob->miss_bytes += bytes;
+        m_miss_bytes += bytes;
+    }
+
+    int resize_blob(BlobEntry *blob, off_t length) {
+        size_t nchunks = (length + m_refill_unit - 1) / m_refill_unit;
+        std::vector<ChunkRef> dropped;
+        for (size_t i = nchunks; i < blob->refs.size(); i++)
+            dropped.push_back(blob->refs[i]);
+        blob->refs.resize(nchunks, ChunkRef{{0}, 0, 0});
+        auto ret = blob->map_file->ftruncate(nchunks * sizeof(ChunkRef));
+        release_refs(blob->map_file, dropped);
+        return ret;
+    }
+
+    ssize_t read_chunks(BlobEntry *blob, const struct iovec *iov, int iovcnt, off_t offset) {
+        photon::scoped_rwlock rl(blob->rw_lock, photon::RLOCK);
+        iovector_view view((struct iovec *)iov, iovcnt);
+        size_t count = view.sum();
+        IOVCursor cursor(iov, iovcnt);
+        std::vector<struct iovec> piece;
+        size_t done = 0;
+        while (done < count) {
+            auto idx = (offset + done) / m_refill_unit;
+            if (idx >= blob->refs.size())
+                break;
+            auto &ref = blob->refs[idx];
+            auto inner = (offset + done) % m_refill_unit;
+            if (ref.length <= inner)
+                LOG_ERROR_RETURN(ENOENT, -1, "chunk ` of ` is not cached", idx, blob->name);
+            auto len = cursor.take(std::min(count - done, (size_t)ref.length - inner), piece);
+            auto ret = m_pack->preadv(piece.data(), piece.size(),
+                                      (off_t)ref.slot * m_refill_unit + inner);
+            if (ret != (ssize_t)len)
+                LOG_ERRNO_RETURN(0, -1, "failed to read chunk pack, slot : `", ref.slot);
+            done += len;
+        }
+        return done;
+    }
+
+    // `offset` must be aligned to refill unit, and so is `count` except for the tail chunk.
+    ssize_t write_chunks(BlobEntry *blob, const struct iovec *iov, int iovcnt, off_t offset) {
+        iovector_view view((struct iovec *)iov, iovcnt);
+        size_t count = view.sum();
+        if (offset % m_refill_unit != 0)
+            LOG_ERROR_RETURN(EINVAL, -1, "offset is not aligned to refill unit, offset : `",
+                             offset);
+        photon::scoped_rwlock wl(blob->rw_lock, photon::WLOCK);
+        blob->writing = true;
+        DEFER(blob->writing = false);
+        IOVCursor cursor(iov, iovcnt);
+        std::vector<struct iovec> piece;
+        std::vector<ChunkRef> replaced;
+        bool new_data = false;
+        size_t done = 0;
+        auto first = offset / m_refill_unit;
+        while (done < count) {
+            auto idx = first + done / m_refill_unit;
+            if (idx >= blob->refs.size())
+                break;
+            auto len = cursor.take(std::min(count - done, (size_t)m_refill_unit), piece);
+            if (len < m_refill_unit && idx + 1 != blob->refs.size()) {
+                LOG_ERROR_RETURN(EINVAL, -1, "partial chunk write, offset : `, count : `", offset,
+                                 count);
+            }
+            // on failures below, chunks replaced are kept referenced as they may be still
+            // in the map persisted, and are reclaimed on next Init()
+            if (write_chunk(blob, idx, piece, len, new_data, replaced) < 0)
+                return -1;
+            done += len;
+        }
+        // chunk data must be durable before any map entry points to it
+        if (new_data && m_pack->fdatasync() < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to sync chunk pack");
+        if (done > 0) {
+            auto last = first + (done - 1) / m_refill_unit;
+            auto ret = blob->map_file->pwrite(&blob->refs[first],
+                                              (last - first + 1) * sizeof(ChunkRef),
+                                              first * sizeof(ChunkRef));
+            if (ret != (ssize_t)((last - first + 1) * sizeof(ChunkRef)))
+                LOG_ERRNO_RETURN(0, -1, "failed to write chunk map of `", blob->name);
+            release_refs(blob->map_file, replaced);
+            blob->refill_count++;
+            blob->refill_bytes += done;
+            m_refill_count++;
+            m_refill_bytes += done;
+            m_lru.access(blob->lru_iter);
+        }
+        return done;
+    }
+
+    void evict_range(BlobEntry *blob, off_t offset, size_t count) {
+        photon::scoped_rwlock wl(blob->rw_lock, photon::WLOCK);
+        auto first = (offset + m_refill_unit - 1) / m_refill_unit;
+        auto last = (count == (size_t)-1) ? blob->refs.size()
+                                          : (size_t)(offset + count) / m_refill_unit;
+        // the map is opened to drop the entries even if the blob is closed
+        auto map_file = blob->map_file;
+        if (map_file == nullptr)
+            map_file = m_media_fs->open(map_path_of(blob->name).c_str(), O_RDWR);
+        DEFER(if (map_file != blob->map_file) delete map_file);
+        std::vector<ChunkRef> dropped;
+        for (auto i = first; i < last && i < blob->refs.size(); i++) {
+            if (blob->refs[i].length == 0)
+                continue;
+            dropped.push_back(blob->refs[i]);
+            blob->refs[i] = ChunkRef{{0}, 0, 0};
+            if (map_file)
+                map_file->pwrite(&blob->refs[i], sizeof(ChunkRef), i * sizeof(ChunkRef));
+        }
+        release_refs(map_file, dropped);
+    }
+
+protected:
+    IFileSystem *m_media_fs; // owned
+    IFile *m_pack = nullptr;
+    uint64_t m_refill_unit;
+    uint64_t m_max_slots;
+    uint32_t m_nslots = 0; // slots ever allocated in pack file
+    std::vector<uint32_t> m_free_slots;
+    std::unordered_map<std::string, ChunkEntry> m_chunks; // sha256 -> chunk
+    map_string_key<std::unique_ptr<BlobEntry>> m_blobs;
+    FileSystem::LRU<BlobEntry *, uint32_t> m_lru;
+    Fn_trans_func m_name_trans = &same_name_trans;
+
+    uint64_t m_logical_bytes = 0;
+    uint64_t m_physical_bytes = 0;
+    uint64_t m_hit_bytes = 0;
+    uint64_t m_miss_bytes = 0;
+    uint64_t m_refill_count = 0;
+    uint64_t m_refill_bytes = 0;
+
+    static std::string key_of(const ChunkRef &ref) {
+        return std::string((const char *)ref.digest, sizeof(ref.digest));
+    }
+
+    // names always start with '/', as they are restored from map paths
+    std::string blob_name(std::string_view pathname) {
+        auto name = m_name_trans(pathname);
+        if (name.empty() || name[0] != '/')
+            name.insert(0, "/");
+        return name;
+    }
+
+    std::string map_path_of(const std::string &name) {
+        std::string path = kMapDir;
+        path.append(name[0] == '/' ? name.substr(1) : name);
+        return path;
+    }
+
+    BlobEntry *get_blob(const std::string &name) {
+        auto it = m_blobs.find(name);
+        if (it != m_blobs.end())
+            return it->second.get();
+        std::unique_ptr<BlobEntry> entry(new BlobEntry);
+        entry->name = name;
+        auto blob = entry.get();
+        blob->lru_iter = m_lru.push_front(blob);
+        m_blobs.emplace(name, std::move(entry));
+        return blob;
+    }
+
+    // a map is loaded as a whole or not at all
+    int load_blob(std::string_view path) {
+        std::string name(path);
+        auto pos = name.find(kMapDir);
+        if (pos != std::string::npos)
+            name = name.substr(pos + strlen(kMapDir) - 1);
+        auto file = m_media_fs->open(std::string(path).c_str(), O_RDONLY);
+        if (file == nullptr)
+            LOG_ERRNO_RETURN(0, -1, "failed to open chunk map `", path);
+        DEFER(delete file);
+        struct stat st = {};
+        if (file->fstat(&st) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to stat chunk map `", path);
+        if (st.st_size % sizeof(ChunkRef) != 0)
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid size of chunk map `, size : `", path, st.st_size);
+        std::vector<ChunkRef> refs(st.st_size / sizeof(ChunkRef));
+        auto size = refs.size() * sizeof(ChunkRef);
+        if (file->pread(refs.data(), size, 0) != (ssize_t)size)
+            LOG_ERRNO_RETURN(0, -1, "failed to read chunk map `", path);
+        for (auto &ref : refs) {
+            if (ref.length > m_refill_unit)
+                LOG_ERROR_RETURN(EINVAL, -1, "invalid chunk length ` in chunk map `", ref.length,
+                                 path);
+        }
+        auto blob = get_blob(name);
+        blob->refs = std::move(refs);
+        for (auto &ref : blob->refs) {
+            if (ref.length == 0)
+                continue;
+            auto key = key_of(ref);
+            auto it = m_chunks.find(key);
+            if (it == m_chunks.end()) {
+                m_chunks.emplace(key, ChunkEntry{ref.slot, ref.length, 1});
+                m_physical_bytes += ref.length;
+                m_nslots = std::max(m_nslots, ref.slot + 1);
+            } else if (it->second.slot != ref.slot) {
+                // written by a crashed refill, reuse the existing slot
+                ref.slot = it->second.slot;
+                it->second.refcnt++;
+            } else {
+                it->second.refcnt++;
+            }
+            m_logical_bytes += ref.length;
+        }
+        return 0;
+    }
+
+    bool verify_chunk(const std::string &key, const ChunkEntry &chunk) {
+        std::unique_ptr<unsigned char[]> buf(new unsigned char[chunk.length]);
+        if (m_pack->pread(buf.get(), chunk.length, (off_t)chunk.slot * m_refill_unit) !=
+            (ssize_t)chunk.length)
+            return false;
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        SHA256(buf.get(), chunk.length, digest);
+        return memcmp(digest, key.data(), SHA256_DIGEST_LENGTH) == 0;
+    }
+
+    // different chunks claiming the same slot are left by a crash between reusing the slot
+    // and syncing the maps, keep only the one whose digest matches the slot data
+    void drop_colliding_chunks() {
+        std::unordered_map<uint32_t, std::vector<std::string>> claims;
+        for (auto &it : m_chunks)
+            claims[it.second.slot].push_back(it.first);
+        std::unordered_set<std::string> bad;
+        for (auto &c : claims) {
+            if (c.second.size() < 2)
+                continue;
+            for (auto &key : c.second) {
+                if (!verify_chunk(key, m_chunks[key]))
+                    bad.insert(key);
+            }
+        }
+        if (bad.empty())
+            return;
+        for (auto &it : m_blobs) {
+            auto blob = it.second.get();
+            bool dirty = false;
+            for (auto &ref : blob->refs) {
+                if (ref.length != 0 && bad.count(key_of(ref))) {
+                    m_logical_bytes -= ref.length;
+                    ref = ChunkRef{{0}, 0, 0};
+                    dirty = true;
+                }
+            }
+            if (!dirty)
+                continue;
+            auto file = m_media_fs->open(map_path_of(blob->name).c_str(), O_RDWR);
+            if (file == nullptr) {
+                LOG_ERROR("failed to open chunk map of `, error : `", blob->name, ERRNO());
+                continue;
+            }
+            DEFER(delete file);
+            auto size = blob->refs.size() * sizeof(ChunkRef);
+            if (file->pwrite(blob->refs.data(), size, 0) != (ssize_t)size ||
+                file->fdatasync() < 0)
+                LOG_ERROR("failed to rewrite chunk map of `, error : `", blob->name, ERRNO());
+        }
+        for (auto &key : bad) {
+            m_physical_bytes -= m_chunks[key].length;
+            m_chunks.erase(key);
+        }
+        LOG_WARN("dropped ` chunks colliding in slots", bad.size());
+    }
+
+    // slots of `refs` are released once `map_file` dropping them is synced
+    void release_refs(IFile *map_file, std::vector<ChunkRef> &refs) {
+        if (refs.empty())
+            return;
+        if (map_file && map_file->fdatasync() < 0) {
+            // keep the slots referenced, they are reclaimed on next Init() if not used
+            LOG_ERRNO_RETURN(0, , "failed to sync chunk map, ` chunks leaked", refs.size());
+        }
+        for (auto &ref : refs)
+            put_ref(ref);
+        refs.clear();
+    }
+
+    void put_ref(const ChunkRef &ref) {
+        if (ref.length == 0)
+            return;
+        m_logical_bytes -= ref.length;
+        auto it = m_chunks.find(key_of(ref));
+        if (it == m_chunks.end() || --it->second.refcnt > 0)
+            return;
+        m_physical_bytes -= it->second.length;
+        free_slot(it->second.slot);
+        m_chunks.erase(it);
+    }
+
+    void free_slot(uint32_t slot) {
+        m_pack->fallocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          (off_t)slot * m_refill_unit, m_refill_unit);
+        m_free_slots.push_back(slot);
+    }
+
+    int64_t alloc_slot(BlobEntry *writer) {
+        if (m_free_slots.empty() && m_nslots >= m_max_slots)
+            evict_lru(m_max_slots * m_refill_unit * kEvictRatio / 100, writer);
+        if (!m_free_slots.empty()) {
+            auto slot = m_free_slots.back();
+            m_free_slots.pop_back();
+            return slot;
+        }
+        if (m_nslots < m_max_slots)
+            return m_nslots++;
+        LOG_ERROR_RETURN(ENOSPC, -1, "no free slot in dedup cache");
+    }
+
+    // the replaced ref of chunk `idx` is appended to `replaced`, to be released later
+    int write_chunk(BlobEntry *blob, size_t idx, std::vector<struct iovec> &piece, size_t len,
+                    bool &new_data, std::vector<ChunkRef> &replaced) {
+        ChunkRef ref{{0}, 0, (uint32_t)len};
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        for (auto &v : piece)
+            SHA256_Update(&ctx, v.iov_base, v.iov_len);
+        SHA256_Final(ref.digest, &ctx);
+        auto key = key_of(ref);
+
+        auto &old = blob->refs[idx];
+        if (old.length != 0 && memcmp(old.digest, ref.digest, sizeof(ref.digest)) == 0)
+            return 0;
+
+        auto it = m_chunks.find(key);
+        if (it == m_chunks.end()) {
+            auto slot = alloc_slot(blob);
+            if (slot < 0)
+                return -1;
+            auto ret = m_pack->pwritev(piece.data(), piece.size(), slot * m_refill_unit);
+            if (ret != (ssize_t)len) {
+                free_slot(slot);
+                LOG_ERRNO_RETURN(0, -1, "failed to write chunk pack, slot : `", slot);
+            }
+            // the same chunk may be filled by another blob while writing
+            it = m_chunks.find(key);
+            if (it == m_chunks.end()) {
+                it = m_chunks.emplace(key, ChunkEntry{(uint32_t)slot, (uint32_t)len, 0}).first;
+                m_physical_bytes += len;
+                new_data = true;
+            } else {
+                free_slot(slot);
+            }
+        }
+        it->second.refcnt++;
+        m_logical_bytes += len;
+        ref.slot = it->second.slot;
+        if (blob->refs[idx].length != 0)
+            replaced.push_back(blob->refs[idx]);
+        blob->refs[idx] = ref;
+        return 0;
+    }
+
+    void evict_blob(BlobEntry *blob) {
+        evict_range(blob, 0, -1);
+        if (blob->open_count > 0) {
+            m_lru.access(blob->lru_iter);
+            return;
+        }
+        auto name = blob->name;
+        m_media_fs->unlink(map_path_of(name).c_str());
+        m_lru.remove(blob->lru_iter);
+        m_blobs.erase(name);
+    }
+
+    // evict blobs from the tail of lru until at least `bytes` physical bytes are released,
+    // `except` and any other blob being written are never evicted.
+    uint64_t evict_lru(uint64_t bytes, BlobEntry *except) {
+        auto start = m_physical_bytes;
+        auto n = m_lru.size();
+        while (start - m_physical_bytes < bytes && n-- > 0 && !m_lru.empty()) {
+            auto blob = m_lru.back();
+            if (blob == except || blob->writing) {
+                m_lru.access(blob->lru_iter);
+                continue;
+            }
+            evict_blob(blob);
+        }
+        return start - m_physical_bytes;
+    }
+};
+
+DedupCacheStore::~DedupCacheStore() {
+    m_pool->close_blob(m_blob);
+}
+
+ICacheStore::try_preadv_result DedupCacheStore::try_preadv(const struct iovec *iov, int iovcnt,
+                                                           off_t offset) {
+    auto rst = ICacheStore::try_preadv(iov, iovcnt, offset);
+    if (rst.refill_size == 0) {
+        if (rst.size > 0)
+            m_pool->add_hit(m_blob, rst.size);
+    } else {
+        m_pool->add_miss(m_blob, rst.iov_sum);
+    }
+    return rst;
+}
+
+ssize_t DedupCacheStore::preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+    return m_pool->read_chunks(m_blob, iov, iovcnt, offset);
+}
+
+ssize_t DedupCacheStore::pwritev(const struct iovec *iov, int iovcnt, off_t offset) {
+    return m_pool->write_chunks(m_blob, iov, iovcnt, offset);
+}
+
+int DedupCacheStore::stat(CacheStat *stat) {
+    if (stat == nullptr)
+        LOG_ERROR_RETURN(EINVAL, -1, "stat is nullptr");
+    m_pool->fill_stat(m_blob, stat);
+    return 0;
+}
+
+int DedupCacheStore::evict(off_t offset, size_t count) {
+    m_pool->evict_range(m_blob, offset, count);
+    return 0;
+}
+
+int DedupCacheStore::ftruncate(off_t length) {
+    m_size = length;
+    return m_pool->resize_blob(m_blob, length);
+}
+
+std::pair<off_t, size_t> DedupCacheStore::queryRefillRange(off_t offset, size_t size) {
+    auto &refs = m_blob->refs;
+    auto unit = m_pool->refill_unit();
+    size_t first = offset / unit;
+    size_t last = std::min((offset + size + unit - 1) / unit, refs.size());
+    size_t hole_start = last, hole_end = first;
+    for (auto i = first; i < last; i++) {
+        if (refs[i].length == 0) {
+            hole_start = std::min(hole_start, i);
+            hole_end = i + 1;
+        }
+    }
+    if (hole_start >= hole_end)
+        return std::make_pair(0, 0);
+    return std::make_pair(hole_start * unit, (hole_end - hole_start) * unit);
+}
+
+int DedupCacheStore::fstat(struct stat *buf) {
+    memset(buf, 0, sizeof(*buf));
+    buf->st_mode = S_IFREG | S_IREAD;
+    buf->st_size = m_size;
+    return 0;
+}
+
+} // namespace Cache
+
+namespace FileSystem {
+using namespace photon::fs;
+
+ICachedFileSystem *new_dedup_cached_fs(IFileSystem *srcFs, IFileSystem *mediaFs,
+                                       uint64_t refillUnit, uint64_t capacityInGB,
+                                       IOAlloc *allocator, Fn_trans_func name_trans) {
+    if (refillUnit % 4096 != 0) {
+        LOG_ERROR_RETURN(EINVAL, nullptr, "refill Unit need to be aligned to 4KB")
+    }
+    auto pool = new ::Cache::DedupCachePool(mediaFs, capacityInGB, refillUnit, name_trans);
+    if (pool->Init() < 0) {
+        delete pool;
+        return nullptr;
+    }
+    return new_cached_fs(srcFs, pool, 4096, refillUnit, allocator);
+}
+} // namespace FileSystem
@@ -0,0 +1,239 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/common/io-alloc.h>
+#include <photon/common/utility.h>
+#include <photon/fs/localfs.h>
+
+#include "../../cache.h"
+#include "../../pool_store.h"
+
+namespace Cache {
+
+using namespace FileSystem;
+using namespace photon::fs;
+
+static const uint64_t kRefillSize = 1024 * 1024;
+
+// Cleanup and recreate the test dir
+inline void SetupTestDir(const std::string &dir) {
+    std::string cmd = std::string("rm -r ") + dir;
+    system(cmd.c_str());
+    cmd = std::string("mkdir -p ") + dir;
+    system(cmd.c_str());
+}
+
+class DedupCacheTest : public ::testing::Test {
+protected:
+    std::string root = "/tmp/obdcache/dedup_test/";
+    std::string srcRoot = "/tmp/obdcache/dedup_src/";
+    IFileSystem *srcFs = nullptr;
+    IOAlloc *allocator = nullptr;
+    std::mt19937 gen{1234};
+
+    void SetUp() override {
+        SetupTestDir(root);
+        SetupTestDir(srcRoot + "testDir");
+        srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+        allocator = new AlignedAlloc(4 * 1024);
+    }
+
+    void TearDown() override {
+        delete srcFs;
+        delete allocator;
+    }
+
+    std::vector<char> random_data(size_t size) {
+        std::vector<char> data(size);
+        for (auto &c : data)
+            c = (char)gen();
+        return data;
+    }
+
+    void write_src(const char *path, const std::vector<char> &data) {
+        auto file = srcFs->open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ASSERT_NE(nullptr, file);
+        EXPECT_EQ((ssize_t)data.size(), file->pwrite(data.data(), data.size(), 0));
+        delete file;
+    }
+
+    ICachedFileSystem *new_fs(uint64_t capacityInGB = 1) {
+        auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+        return new_dedup_cached_fs(srcFs, mediaFs, kRefillSize, capacityInGB, allocator);
+    }
+
+    void verify_file(ICachedFileSystem *fs, const char *path, const std::vector<char> &data) {
+        auto file = fs->open(path, 0, 0644);
+        ASSERT_NE(nullptr, file);
+        DEFER(delete file);
+        std::vector<char> buf(data.size());
+        EXPECT_EQ((ssize_t)data.size(), file->pread(buf.data(), buf.size(), 0));
+        EXPECT_EQ(0, memcmp(data.data(), buf.data(), data.size()));
+    }
+};
+
+TEST_F(DedupCacheTest, DedupAcrossBlobs) {
+    auto data = random_data(4 * kRefillSize);
+    write_src("/testDir/file_1", data);
+    write_src("/testDir/file_2", data);
+    auto fs = new_fs();
+    ASSERT_NE(nullptr, fs);
+    DEFER(delete fs);
+    verify_file(fs, "/testDir/file_1", data);
+    verify_file(fs, "/testDir/file_2", data);
+
+    CacheStat total;
+    EXPECT_EQ(0, fs->get_pool()->stat(&total));
+    EXPECT_EQ(4u, total.used_size);
+    EXPECT_EQ(data.size(), total.dedup_bytes);
+    CacheStat stat;
+    EXPECT_EQ(0, fs->get_pool()->stat(&stat, "/testDir/file_2"));
+    EXPECT_EQ(4u, stat.used_size);
+    EXPECT_EQ(data.size(), stat.dedup_bytes);
+}
+
+TEST_F(DedupCacheTest, TailChunk) {
+    auto data = random_data(2 * kRefillSize + 12345);
+    write_src("/testDir/file_1", data);
+    auto fs = new_fs();
+    ASSERT_NE(nullptr, fs);
+    DEFER(delete fs);
+    verify_file(fs, "/testDir/file_1", data);
+
+    auto file = fs->open("/testDir/file_1", 0, 0644);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+    std::vector<char> buf(4096);
+    off_t offset = data.size() - 1000;
+    EXPECT_EQ(1000, file->pread(buf.data(), buf.size(), offset));
+    EXPECT_EQ(0, memcmp(data.data() + offset, buf.data(), 1000));
+
+    CacheStat stat;
+    EXPECT_EQ(0, fs->get_pool()->stat(&stat, "/testDir/file_1"));
+    EXPECT_EQ(3u, stat.total_size);
+    EXPECT_EQ(3u, stat.used_size);
+    EXPECT_LT(0u, stat.hit_bytes);
+}
+
+TEST_F(DedupCacheTest, EvictSharedChunks) {
+    auto data = random_data(4 * kRefillSize);
+    write_src("/testDir/file_1", data);
+    write_src("/testDir/file_2", data);
+    auto fs = new_fs();
+    ASSERT_NE(nullptr, fs);
+    DEFER(delete fs);
+    auto pool = fs->get_pool();
+    verify_file(fs, "/testDir/file_1", data);
+    verify_file(fs, "/testDir/file_2", data);
+
+    // chunks still referenced by file_2 are kept
+    EXPECT_EQ(0, pool->evict("/testDir/file_1"));
+    CacheStat total;
+    EXPECT_EQ(0, pool->stat(&total));
+    EXPECT_EQ(4u, total.used_size);
+    EXPECT_EQ(0u, total.dedup_bytes);
+    auto refills = total.refill_count;
+    verify_file(fs, "/testDir/file_2", data);
+    EXPECT_EQ(0, pool->stat(&total));
+    EXPECT_EQ(refills, total.refill_count);
+
+    EXPECT_EQ(0, pool->evict("/testDir/file_2"));
+    EXPECT_EQ(0, pool->stat(&total));
+    EXPECT_EQ(0u, total.used_size);
+
+    // below the water mark, nothing to evict
+    verify_file(fs, "/testDir/file_1", data);
+    EXPECT_EQ(0, pool->evict((size_t)0));
+    EXPECT_EQ(0, pool->stat(&total));
+    EXPECT_EQ(4u, total.used_size);
+}
+
+TEST_F(DedupCacheTest, Reload) {
+    auto data = random_data(3 * kRefillSize + 100);
+    write_src("/testDir/file_1", data);
+    {
+        auto fs = new_fs();
+        ASSERT_NE(nullptr, fs);
+        verify_file(fs, "/testDir/file_1", data);
+        delete fs;
+    }
+    // a map of invalid size is removed on load
+    auto bad_map = root + "maps/testDir/bad";
+    {
+        auto file = open_localfile_adaptor(bad_map.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ASSERT_NE(nullptr, file);
+        EXPECT_EQ(7, file->pwrite("corrupt", 7, 0));
+        delete file;
+    }
+
+    auto fs = new_fs();
+    ASSERT_NE(nullptr, fs);
+    DEFER(delete fs);
+    EXPECT_NE(0, ::access(bad_map.c_str(), F_OK));
+    CacheStat total;
+    EXPECT_EQ(0, fs->get_pool()->stat(&total));
+    EXPECT_EQ(4u, total.used_size);
+    verify_file(fs, "/testDir/file_1", data);
+    EXPECT_EQ(0, fs->get_pool()->stat(&total));
+    EXPECT_EQ(0u, total.refill_count);
+    EXPECT_LT(0u, total.hit_bytes);
+}
+
+TEST_F(DedupCacheTest, NoSpace) {
+    auto data = random_data(2 * kRefillSize);
+    write_src("/testDir/file_1", data);
+    // no slot at all, reads are served from source
+    auto fs = new_fs(0);
+    ASSERT_NE(nullptr, fs);
+    DEFER(delete fs);
+    verify_file(fs, "/testDir/file_1", data);
+    CacheStat total;
+    EXPECT_EQ(0, fs->get_pool()->stat(&total));
+    EXPECT_EQ(0u, total.used_size);
+
+    auto file = static_cast<ICachedFile *>(fs->open("/testDir/file_1", 0, 0644));
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+    struct iovec iov { (void *)data.data(), kRefillSize };
+    errno = 0;
+    EXPECT_EQ(-1, file->get_store()->pwritev(&iov, 1, 0));
+    EXPECT_EQ(ENOSPC, errno);
+}
+
+} //  namespace Cache
+
+int main(int argc, char **argv) {
+    log_output_level = 0;
+    ::testing::InitGoogleTest(&argc, argv);
+
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    DEFER(photon::fini());
+    int ret = RUN_ALL_TESTS();
+    return ret;
+}
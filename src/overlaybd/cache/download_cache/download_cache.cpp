@@ -14,7 +14,10 @@
    limitations under the License.
 */
 #include "../cache.h"
+#include <algorithm>
+#include <deque>
 #include <string>
+#include <vector>
 #include <photon/common/alog.h>
 #include <photon/common/alog-audit.h>
 #include <photon/common/alog-stdstring.h>
@@ -25,6 +28,7 @@
 #include <photon/fs/forwardfs.h>
 #include <photon/fs/fiemap.h>
 #include <photon/thread/thread.h>
+#include <photon/thread/thread11.h>
 #include <photon/common/io-alloc.h>
 #include <photon/common/expirecontainer.h>
 #include <photon/common/range-lock.h>
@@ -38,6 +42,7 @@ using namespace FileSystem;
 using namespace photon::fs;
 
 class DownloadCacheFs;
+class DownloadCacheFile;
 
 class DownloadCacheStore : public ForwardFile_Ownership {
 public:
@@ -70,6 +75,14 @@ public:
         m_range_lock.unlock(offset, length);
     }
 
+    // the store is shared by files on the vCPUs of different devices, the
+    // following are guarded by users_mutex
+    photon::mutex users_mutex;
+    // the file whose background workers are completing this local file
+    DownloadCacheFile *filler = nullptr;
+    // files ready on this local file, the filling is handed over among them
+    std::vector<DownloadCacheFile *> users;
+
 private:
     RangeLock m_range_lock;
     DownloadCacheFs *m_fs;
@@ -98,6 +111,22 @@ public:
     UNIMPLEMENTED(int close() override);
 
 private:
+    // fetch [offset, offset + count) from source into local file, range lock must be held
+    ssize_t fetch(uint64_t offset, uint64_t count);
+    void set_ready();
+
+    // Background filler, completes the local file with concurrent ranged fetches.
+    // Ranges following demand misses are filled first, then the whole file
+    // sequentially. Demand reads join in-flight fetches by the range lock.
+    // the workers of a file run on its own vCPU, a file taking over the filling
+    // is signaled, and starts them from its standby thread
+    void start_filler();
+    void stop_filler();
+    void standby();
+    void fill_worker();
+    void add_hot(off_t offset);
+    off_t next_fill_unit();
+
     std::string m_local_path;
     photon::fs::IFile *m_file = nullptr;
     DownloadCacheStore *m_local_file = nullptr;
@@ -105,13 +134,27 @@ private:
     bool ready = false;
     std::string m_name;
     DownloadCacheFs *m_fs;
+
+    struct HotRange {
+        off_t offset;
+        uint32_t units; // # of units left in this run
+    };
+    std::deque<HotRange> m_hot;
+    off_t m_fill_cursor = 0;
+    bool m_fill_stop = false;
+    bool m_fill_done = false;
+    std::vector<photon::join_handle *> m_fillers;
+    photon::semaphore m_handover;
+    bool m_closing = false;
+    photon::join_handle *m_standby = nullptr;
 };
 
 class DownloadCacheFs : public IFileSystem {
 public:
-    DownloadCacheFs(IFileSystem *fs, size_t bs, size_t rs, IOAlloc *io_alloc)
+    DownloadCacheFs(IFileSystem *fs, size_t bs, size_t rs, IOAlloc *io_alloc,
+                    int fill_concurrency)
         : m_src_fs(fs), block_size(bs), refill_size(rs), io_alloc(io_alloc),
-          m_file_pool(1 * 1000 * 1000) {
+          fill_concurrency(fill_concurrency), m_file_pool(1 * 1000 * 1000) {
         LOG_INFO("new DownloadCacheFs");
     }
     ~DownloadCacheFs() {
@@ -155,13 +198,38 @@ public:
     size_t block_size;
     size_t refill_size;
     IOAlloc *io_alloc;
+    int fill_concurrency;
     ObjectCache<std::string, DownloadCacheStore *> m_file_pool;
 
 private:
     photon::fs::IFileSystem *m_src_fs;
 };
 
+// # of units filled sequentially after a demand miss, before other regions
+static const uint32_t kHotRunUnits = 16;
+// give up filling after so many consecutive failures
+static const int kMaxFillFailures = 8;
+// # of hot runs queued at most, the oldest ones are dropped
+static const size_t kMaxHotRuns = 64;
+
 DownloadCacheFile::~DownloadCacheFile() {
+    bool handover = !m_fillers.empty() && !m_fill_done;
+    stop_filler();
+    if (m_local_file != nullptr && ready) {
+        photon::scoped_lock lock(m_local_file->users_mutex);
+        auto &users = m_local_file->users;
+        users.erase(std::remove(users.begin(), users.end(), this), users.end());
+        // the workers belong to this file, let another one on the same local file go on,
+        // signaled under the lock so that it's not gone meanwhile
+        if (handover && !users.empty()) {
+            users.front()->m_handover.signal(1);
+        }
+    }
+    if (m_standby) {
+        m_closing = true;
+        m_handover.signal(1);
+        photon::thread_join(m_standby);
+    }
     safe_delete(m_file);
     m_fs->m_file_pool.release(m_local_path);
 }
@@ -204,40 +272,172 @@ again:
         r_count = m_size - r_offset;
     }
 
-    IOVector buffer(*m_fs->io_alloc);
-
     auto lr = m_local_file->try_lock_wait(r_offset, r_count);
     if (lr < 0) {
         goto again;
     }
     DEFER({ m_local_file->unlock(r_offset, r_count); });
 
-    auto alloc = buffer.push_back(r_count);
-    if (alloc < r_count) {
-        LOG_ERROR("memory allocate failed, refill size:`, alloc:`", r_count, alloc);
+    if (fetch(r_offset, r_count) < 0) {
+        if (errno != ENOMEM) {
+            return -1;
+        }
         SCOPE_AUDIT("download", AU_FILEOP(m_name, offset, ret));
         ret = m_file->preadv(iov, iovcnt, offset);
         return ret;
     }
+    add_hot(r_offset + r_count);
+
+    return m_local_file->preadv(iov, iovcnt, offset);
+}
+
+ssize_t DownloadCacheFile::fetch(uint64_t offset, uint64_t count) {
+    IOVector buffer(*m_fs->io_alloc);
+    auto alloc = buffer.push_back(count);
+    if (alloc < count) {
+        LOG_ERROR_RETURN(ENOMEM, -1, "memory allocate failed, refill size:`, alloc:`", count,
+                         alloc);
+    }
 
     ssize_t read = 0;
     {
-        SCOPE_AUDIT("download", AU_FILEOP(m_name, r_offset, read));
-        read = m_file->preadv(buffer.iovec(), buffer.iovcnt(), r_offset);
+        SCOPE_AUDIT("download", AU_FILEOP(m_name, offset, read));
+        read = m_file->preadv(buffer.iovec(), buffer.iovcnt(), offset);
     }
 
-    if (read != (ssize_t)r_count) {
+    if (read != (ssize_t)count) {
         LOG_ERRNO_RETURN(0, -1, "src file read failed, read: `, expect: `, size: `, offset: `",
-                         read, r_count, m_size, r_offset);
+                         read, count, m_size, offset);
     }
 
-    auto write = m_local_file->pwritev(buffer.iovec(), buffer.iovcnt(), r_offset);
-    if (write != (ssize_t)r_count) {
+    auto write = m_local_file->pwritev(buffer.iovec(), buffer.iovcnt(), offset);
+    if (write != (ssize_t)count) {
         LOG_ERRNO_RETURN(0, -1, "local file write failed, write: `, expect: `, size: `, offset: `",
-                         write, r_count, m_size, r_offset);
+                         write, count, m_size, offset);
     }
+    return count;
+}
 
-    return m_local_file->preadv(iov, iovcnt, offset);
+void DownloadCacheFile::set_ready() {
+    m_local_file->ftruncate(m_size);
+    ready = true;
+    if (m_fs->fill_concurrency <= 0) {
+        return;
+    }
+    {
+        photon::scoped_lock lock(m_local_file->users_mutex);
+        m_local_file->users.push_back(this);
+    }
+    auto th = photon::thread_create11(&DownloadCacheFile::standby, this);
+    m_standby = photon::thread_enable_join(th);
+    start_filler();
+}
+
+void DownloadCacheFile::standby() {
+    while (true) {
+        m_handover.wait(1);
+        if (m_closing) {
+            return;
+        }
+        start_filler();
+    }
+}
+
+void DownloadCacheFile::start_filler() {
+    {
+        photon::scoped_lock lock(m_local_file->users_mutex);
+        if (m_local_file->filler != nullptr) {
+            return;
+        }
+        m_local_file->filler = this;
+    }
+    for (int i = 0; i < m_fs->fill_concurrency; i++) {
+        auto th = photon::thread_create11(&DownloadCacheFile::fill_worker, this);
+        m_fillers.push_back(photon::thread_enable_join(th));
+    }
+    LOG_INFO("background fill started, ` workers, size `, path `", m_fillers.size(), m_size,
+             m_local_path);
+}
+
+void DownloadCacheFile::stop_filler() {
+    if (m_fillers.empty()) {
+        return;
+    }
+    m_fill_stop = true;
+    for (auto th : m_fillers) {
+        photon::thread_join(th);
+    }
+    m_fillers.clear();
+    photon::scoped_lock lock(m_local_file->users_mutex);
+    m_local_file->filler = nullptr;
+}
+
+void DownloadCacheFile::add_hot(off_t offset) {
+    if (m_fillers.empty() || offset >= (off_t)m_size) {
+        return;
+    }
+    // the latest miss goes first
+    m_hot.push_front({offset, kHotRunUnits});
+    if (m_hot.size() > kMaxHotRuns) {
+        m_hot.pop_back();
+    }
+}
+
+off_t DownloadCacheFile::next_fill_unit() {
+    auto unit = m_fs->refill_size;
+    while (!m_hot.empty()) {
+        auto &hot = m_hot.front();
+        auto offset = align_down(hot.offset, unit);
+        hot.offset = offset + unit;
+        if (--hot.units == 0 || hot.offset >= (off_t)m_size) {
+            m_hot.pop_front();
+        }
+        if (offset < (off_t)m_size) {
+            return offset;
+        }
+    }
+    if (m_fill_cursor < (off_t)m_size) {
+        auto offset = m_fill_cursor;
+        m_fill_cursor += unit;
+        return offset;
+    }
+    return -1;
+}
+
+void DownloadCacheFile::fill_worker() {
+    int failures = 0;
+    while (!m_fill_stop) {
+        auto offset = next_fill_unit();
+        if (offset < 0) {
+            m_fill_done = true;
+            break;
+        }
+        auto count = std::min((uint64_t)m_fs->refill_size, (uint64_t)(m_size - offset));
+        m_local_file->lock(offset, count);
+        DEFER(m_local_file->unlock(offset, count));
+        auto q = m_local_file->query_refill_range(offset, count);
+        if (q.second == 0) {
+            continue;
+        }
+        if (fetch(offset, count) < 0) {
+            if (++failures >= kMaxFillFailures) {
+                LOG_ERROR_RETURN(0, , "background fill aborted, path `", m_local_path);
+            }
+            // retry later, after the hot runs queued but before the sequential pass,
+            // or by rewinding the sequential pass if too many are queued
+            if (m_hot.size() < kMaxHotRuns) {
+                m_hot.push_back({offset, 1});
+            } else {
+                m_fill_cursor = std::min(m_fill_cursor, offset);
+            }
+            photon::thread_usleep(1000 * 1000);
+            continue;
+        }
+        failures = 0;
+    }
+    if (!m_fill_stop) {
+        LOG_INFO("background fill worker finished, path `", m_local_path);
+    }
 }
 
 int DownloadCacheFile::fstat(struct stat *buf) {
@@ -262,8 +462,7 @@ int DownloadCacheFile::vioctl(int request, va_list args) {
         });
 
         if (m_local_file != nullptr && m_size > 0) {
-            m_local_file->ftruncate(m_size);
-            ready = true;
+            set_ready();
         }
         return 0;
     } else if (request == SET_SIZE) {
@@ -273,8 +472,7 @@ int DownloadCacheFile::vioctl(int request, va_list args) {
         }
         m_size = va_arg(args, size_t);
         if (m_local_file != nullptr) {
-            m_local_file->ftruncate(m_size);
-            ready = true;
+            set_ready();
         }
         return 0;
     } else {
@@ -363,10 +561,11 @@ namespace FileSystem {
 using namespace photon::fs;
 
 IFileSystem *new_download_cached_fs(photon::fs::IFileSystem *src_fs, size_t blk_size,
-                                    size_t refill_size, IOAlloc *io_alloc) {
+                                    size_t refill_size, IOAlloc *io_alloc, int fill_concurrency) {
     if (io_alloc == nullptr) {
         io_alloc = new IOAlloc;
     }
-    return new ::Cache::DownloadCacheFs(src_fs, blk_size, refill_size, io_alloc);
+    return new ::Cache::DownloadCacheFs(src_fs, blk_size, refill_size, io_alloc,
+                                        fill_concurrency);
 }
 } // namespace FileSystem
@@ -0,0 +1,130 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/common/utility.h>
+#include <photon/fs/localfs.h>
+#include <photon/thread/thread.h>
+
+#include "../../cache.h"
+
+#define SET_LOCAL_DIR 118
+#define SET_SIZE 119
+
+using namespace photon::fs;
+
+static const size_t kRefillSize = 1024 * 1024;
+static const size_t kFileSize = 16 * kRefillSize;
+
+class DownloadCacheTest : public ::testing::Test {
+protected:
+    std::string srcRoot = "/tmp/obdcache/download_src/";
+    std::string layerDir = "/tmp/obdcache/download_layer";
+    IFileSystem *srcFs = nullptr;
+    IFileSystem *fs = nullptr;
+    std::vector<char> data;
+
+    void SetUp() override {
+        system(("rm -rf " + srcRoot + " " + layerDir).c_str());
+        system(("mkdir -p " + srcRoot + " " + layerDir).c_str());
+        std::mt19937 gen(1234);
+        data.resize(kFileSize);
+        for (auto &c : data)
+            c = (char)gen();
+        srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+        auto file = srcFs->open("/blob", O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ASSERT_NE(nullptr, file);
+        EXPECT_EQ((ssize_t)kFileSize, file->pwrite(data.data(), kFileSize, 0));
+        delete file;
+        fs = FileSystem::new_download_cached_fs(srcFs, 4096, kRefillSize, nullptr, 2);
+    }
+
+    void TearDown() override {
+        delete fs;
+        delete srcFs;
+    }
+
+    IFile *open_blob() {
+        auto file = fs->open("/blob", O_RDONLY);
+        if (file == nullptr)
+            return nullptr;
+        file->ioctl(SET_LOCAL_DIR, layerDir);
+        file->ioctl(SET_SIZE, kFileSize);
+        return file;
+    }
+
+    // wait for the local copy to be complete, by its content
+    bool wait_filled(uint64_t timeout_us) {
+        auto local = open_localfile_adaptor((layerDir + "/.download").c_str(), O_RDONLY, 0644, 0);
+        if (local == nullptr)
+            return false;
+        DEFER(delete local);
+        std::vector<char> buf(kFileSize);
+        auto deadline = photon::now + timeout_us;
+        while (photon::now < deadline) {
+            if (local->pread(buf.data(), kFileSize, 0) == (ssize_t)kFileSize &&
+                memcmp(buf.data(), data.data(), kFileSize) == 0)
+                return true;
+            photon::thread_usleep(10 * 1000);
+        }
+        return false;
+    }
+};
+
+TEST_F(DownloadCacheTest, BackgroundFill) {
+    auto file = open_blob();
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+    // a demand read is served at once, the rest is filled in background
+    std::vector<char> buf(4096);
+    off_t offset = kFileSize / 2 + 100;
+    EXPECT_EQ(4096, file->pread(buf.data(), buf.size(), offset));
+    EXPECT_EQ(0, memcmp(buf.data(), data.data() + offset, buf.size()));
+    EXPECT_TRUE(wait_filled(10UL * 1000 * 1000));
+}
+
+TEST_F(DownloadCacheTest, Handover) {
+    auto first = open_blob();
+    ASSERT_NE(nullptr, first);
+    auto second = open_blob();
+    ASSERT_NE(nullptr, second);
+    DEFER(delete second);
+    // the filler is closed before filling anything, the other file goes on
+    delete first;
+    EXPECT_TRUE(wait_filled(10UL * 1000 * 1000));
+    std::vector<char> buf(kRefillSize);
+    EXPECT_EQ((ssize_t)kRefillSize, second->pread(buf.data(), buf.size(), kFileSize - kRefillSize));
+    EXPECT_EQ(0, memcmp(buf.data(), data.data() + kFileSize - kRefillSize, buf.size()));
+}
+
+int main(int argc, char **argv) {
+    log_output_level = 1;
+    ::testing::InitGoogleTest(&argc, argv);
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    DEFER(photon::fini());
+    return RUN_ALL_TESTS();
+}
@@ -16,11 +16,13 @@
 #include "cached_file.h"
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <algorithm>
 #include <photon/common/alog-audit.h>
 #include <photon/common/alog-stdstring.h>
 #include <photon/common/alog.h>
 #include <photon/common/iovector.h>
 #include <photon/common/utility.h>
+#include <photon/fs/fiemap.h>
 #include <photon/fs/range-split.h>
 #include "../pool_store.h"
 
@@ -275,9 +277,40 @@ ssize_t CachedFile::pwritev(const struct iovec *iov, int iovcnt, off_t offset) {
     return write;
 }
 
+// cached extents in [fm_start, fm_start + fm_length), physical offset is not meaningful
 int CachedFile::fiemap(struct fiemap *map) {
-    errno = ENOSYS;
-    return -1;
+    map->fm_mapped_extents = 0;
+    off_t start = map->fm_start;
+    off_t end = std::min(static_cast<off_t>(map->fm_start + map->fm_length), size_);
+    if (start >= end) {
+        return 0;
+    }
+    auto q = cache_store_->queryRefillRange(start, end - start);
+    if (q.first < 0) {
+        LOG_ERRNO_RETURN(0, -1, "query refill range failed, offset : `, size : `", start,
+                         end - start);
+    }
+    auto add_extent = [&](off_t offset, off_t extent_end) {
+        if (offset >= extent_end) {
+            return;
+        }
+        if (map->fm_mapped_extents < map->fm_extent_count) {
+            auto &extent = map->fm_extents[map->fm_mapped_extents];
+            extent.fe_logical = offset;
+            extent.fe_physical = offset;
+            extent.fe_length = extent_end - offset;
+            extent.fe_flags = 0;
+        }
+        map->fm_mapped_extents++;
+    };
+    if (q.second == 0) {
+        add_extent(start, end);
+    } else {
+        // the refill range covers all holes, so what's around it is cached
+        add_extent(start, std::min(q.first, end));
+        add_extent(q.first + q.second, end);
+    }
+    return 0;
 }
 
 int CachedFile::query(off_t offset, size_t count) {
@@ -23,8 +23,12 @@
 #include <photon/common/alog-stdstring.h>
 #include <photon/common/alog.h>
 #include <photon/common/enumerable.h>
+#include <photon/common/estring.h>
+#include <photon/fs/aligned-file.h>
 #include <photon/fs/path.h>
 #include "cache_store.h"
+#include "compressed_store.h"
+#include "../../zfile/compressor.h"
 
 namespace Cache {
 
@@ -33,12 +37,16 @@ using namespace FileSystem;
 const uint64_t kGB = 1024 * 1024 * 1024;
 const uint64_t kMaxFreeSpace = 50 * kGB;
 const int64_t kEvictionMark = 5ll * kGB;
+// compressed media files are kept apart from plain ones, so that switching
+// the option never serves one format as the other
+const std::string kCompressedSuffix = ".z";
 
 FileCachePool::FileCachePool(photon::fs::IFileSystem *mediaFs, uint64_t capacityInGB, uint64_t periodInUs,
-                             uint64_t diskAvailInBytes, uint64_t refillUnit, Fn_trans_func name_trans)
+                             uint64_t diskAvailInBytes, uint64_t refillUnit, Fn_trans_func name_trans,
+                             bool directIO)
     : mediaFs_(mediaFs), capacityInGB_(capacityInGB), periodInUs_(periodInUs),
-      diskAvailInBytes_(diskAvailInBytes), refillUnit_(refillUnit), totalUsed_(0), timer_(nullptr),
-      running_(false), exit_(false), isFull_(false) {
+      diskAvailInBytes_(diskAvailInBytes), refillUnit_(refillUnit), totalUsed_(0),
+      directIO_(directIO), timer_(nullptr), running_(false), exit_(false), isFull_(false) {
     int64_t capacityInBytes = capacityInGB_ * kGB;
     waterMark_ = calcWaterMark(capacityInBytes, kMaxFreeSpace);
     // keep this relation : waterMark < riskMark < capacity
@@ -47,6 +55,9 @@ FileCachePool::FileCachePool(photon::fs::IFileSystem *mediaFs, uint64_t capacity
     if (name_trans != nullptr) {
         file_name_trans = name_trans;
     }
+    if (directIO_) {
+        ioAlloc_.reset(new AlignedAlloc(kDirectIOAlign));
+    }
 }
 
 FileCachePool::~FileCachePool() {
@@ -57,6 +68,7 @@ FileCachePool::~FileCachePool() {
         }
         delete timer_;
     }
+    delete compressor_;
     delete mediaFs_;
 }
 
@@ -65,8 +77,37 @@ void FileCachePool::Init() {
     timer_ = new photon::Timer(periodInUs_, {this, FileCachePool::timerHandler});
 }
 
+int FileCachePool::enableCompression(std::string_view algo) {
+    ZFile::CompressOptions opt;
+    opt.block_size = refillUnit_;
+    if (algo == "lz4") {
+        opt.algo = ZFile::CompressOptions::LZ4;
+    } else if (algo == "zstd") {
+        opt.algo = ZFile::CompressOptions::ZSTD;
+    } else {
+        LOG_ERROR_RETURN(EINVAL, -1, "unknown compression algorithm : `", algo);
+    }
+    ZFile::CompressArgs args(opt);
+    delete compressor_;
+    compressor_ = ZFile::create_compressor(&args);
+    if (compressor_ == nullptr) {
+        LOG_ERRNO_RETURN(0, -1, "create compressor failed, algorithm : `", algo);
+    }
+    // not less than the bound of both lz4 and zstd
+    compressBound_ = refillUnit_ + refillUnit_ / 128 + 1024;
+    return 0;
+}
+
+std::string FileCachePool::mediaName(std::string_view pathname) {
+    auto name = file_name_trans(pathname);
+    if (compressor_ && !estring_view(name).ends_with(kCompressedSuffix)) {
+        name += kCompressedSuffix;
+    }
+    return name;
+}
+
 ICacheStore *FileCachePool::do_open(std::string_view pathname, int flags, mode_t mode) {
-    auto filename = file_name_trans(pathname);
+    auto filename = mediaName(pathname);
     auto localFile = openMedia(filename, flags, mode);
     if (!localFile) {
         return nullptr;
@@ -83,6 +124,10 @@ ICacheStore *FileCachePool::do_open(std::string_view pathname, int flags, mode_t
         find->second->openCount++;
     }
 
+    if (compressor_) {
+        return new CompressedFileCacheStore(this, localFile, refillUnit_, find, compressor_,
+                                            compressBound_);
+    }
     return new FileCacheStore(this, localFile, refillUnit_, find);
 }
 
@@ -97,27 +142,86 @@ photon::fs::IFile *FileCachePool::openMedia(std::string_view name, int flags, in
         LOG_ERRNO_RETURN(0, nullptr, "mkdir failed, path : `", name);
     }
 
+    if (directIO_) {
+        flags |= O_DIRECT;
+    }
     auto localFile = mediaFs_->open(name.data(), flags, mode);
     if (nullptr == localFile) {
         LOG_ERRNO_RETURN(0, nullptr, "cache store open failed, pathname : `, flags : `, mode : `",
                          name, flags, mode);
     }
+    if (directIO_) {
+        auto alignedFile =
+            photon::fs::new_aligned_file_adaptor(localFile, kDirectIOAlign, true, true, ioAlloc_.get());
+        if (nullptr == alignedFile) {
+            delete localFile;
+            LOG_ERRNO_RETURN(0, nullptr, "new_aligned_file_adaptor failed, pathname : `", name);
+        }
+        localFile = alignedFile;
+    }
     return localFile;
 }
 
 int FileCachePool::stat(CacheStat *stat, std::string_view pathname) {
-    errno = ENOSYS;
-    return -1;
+    if (stat == nullptr) {
+        LOG_ERROR_RETURN(EINVAL, -1, "stat is nullptr");
+    }
+    stat->refill_unit = refillUnit_;
+    if (pathname.empty() || pathname == "/") {
+        stat->total_size = capacityInGB_ * kGB / refillUnit_;
+        stat->used_size = totalUsed_ / refillUnit_;
+        stat->hit_bytes = hitBytes_;
+        stat->miss_bytes = missBytes_;
+        stat->refill_count = refillCount_;
+        stat->refill_bytes = refillBytes_;
+        return 0;
+    }
+
+    auto filename = mediaName(pathname);
+    auto iter = fileIndex_.find(filename);
+    if (iter == fileIndex_.end()) {
+        LOG_ERROR_RETURN(ENOENT, -1, "file is not cached, name : `", pathname);
+    }
+    struct stat st = {};
+    if (mediaFs_->stat(filename.c_str(), &st)) {
+        LOG_ERRNO_RETURN(0, -1, "stat failed, name : `", filename);
+    }
+    stat->total_size = (st.st_size + refillUnit_ - 1) / refillUnit_;
+    fillStat(iter, stat);
+    return 0;
 }
 
 int FileCachePool::evict(std::string_view filename) {
-    errno = ENOSYS;
-    return -1;
+    // evictFile() yields, and may erase the entry the timer is evicting
+    if (running_) {
+        LOG_ERROR_RETURN(EBUSY, -1, "eviction is in progress");
+    }
+    running_ = true;
+    DEFER(running_ = false;);
+    auto name = mediaName(filename);
+    auto iter = fileIndex_.find(name);
+    if (iter == fileIndex_.end()) {
+        LOG_ERROR_RETURN(ENOENT, -1, "file is not cached, name : `", filename);
+    }
+    if (!evictFile(iter)) {
+        return -1;
+    }
+    LOG_INFO("evict cache file `", filename);
+    return 0;
 }
 
 int FileCachePool::evict(size_t size) {
-    errno = ENOSYS;
-    return -1;
+    if (running_) {
+        LOG_ERROR_RETURN(EBUSY, -1, "eviction is in progress");
+    }
+    running_ = true;
+    DEFER(running_ = false;);
+    if (size > 0) {
+        auto evicted = evictLru(static_cast<int64_t>(size));
+        LOG_INFO("evict cache by size, expect : `, actual : `", size, evicted);
+    }
+    eviction();
+    return 0;
 }
 
 bool FileCachePool::isFull() {
@@ -157,6 +261,34 @@ uint64_t FileCachePool::updateSpace(FileNameMap::iterator iter, uint64_t size) {
     return diff;
 }
 
+void FileCachePool::addHit(FileNameMap::iterator iter, uint64_t bytes) {
+    iter->second->hitBytes += bytes;
+    hitBytes_ += bytes;
+}
+
+void FileCachePool::addMiss(FileNameMap::iterator iter, uint64_t bytes) {
+    iter->second->missBytes += bytes;
+    missBytes_ += bytes;
+}
+
+void FileCachePool::addRefill(FileNameMap::iterator iter, uint64_t bytes) {
+    auto lruEntry = iter->second.get();
+    lruEntry->refillCount++;
+    lruEntry->refillBytes += bytes;
+    refillCount_++;
+    refillBytes_ += bytes;
+}
+
+void FileCachePool::fillStat(FileNameMap::iterator iter, CacheStat *stat) {
+    auto lruEntry = iter->second.get();
+    stat->refill_unit = refillUnit_;
+    stat->used_size = (lruEntry->size + refillUnit_ - 1) / refillUnit_;
+    stat->hit_bytes = lruEntry->hitBytes;
+    stat->miss_bytes = lruEntry->missBytes;
+    stat->refill_count = lruEntry->refillCount;
+    stat->refill_bytes = lruEntry->refillBytes;
+}
+
 uint64_t FileCachePool::timerHandler(void *data) {
     auto cur = static_cast<FileCachePool *>(data);
     if (cur->running_) {
@@ -199,10 +331,13 @@ void FileCachePool::eviction() {
     }
 
     isFull_ = true;
+    evictLru(actualEvict);
+}
 
-    while (actualEvict > 0 && !lru_.empty() && !exit_) {
+int64_t FileCachePool::evictLru(int64_t bytes) {
+    int64_t evicted = 0;
+    while (evicted < bytes && !lru_.empty() && !exit_) {
         auto fileIter = lru_.back();
-        const auto &fileName = fileIter->first;
         auto lruEntry = fileIter->second.get();
         auto fileSize = lruEntry->size;
         if (lruEntry->openCount == 0) {
@@ -219,22 +354,31 @@ void FileCachePool::eviction() {
             continue;
         }
 
-        {
-            photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::WLOCK);
-            err = mediaFs_->truncate(fileName.data(), 0);
-        }
-
-        if (err && errno != ENOENT) {
-            LOG_ERROR("truncate(0) failed, name : `, ret : `, error code : `", fileName, err,
-                      ERRNO());
-            continue;
-        } else {
-            fileSize = lruEntry->size;
-            afterFtrucate(fileIter);
-            actualEvict -= fileSize;
+        if (evictFile(fileIter)) {
+            evicted += fileSize;
         }
         photon::thread_usleep(kDeleteDelayInUs);
     }
+    return evicted;
+}
+
+bool FileCachePool::evictFile(FileNameMap::iterator iter) {
+    const auto &fileName = iter->first;
+    auto lruEntry = iter->second.get();
+    int err;
+    beforeEvict(iter);
+    {
+        photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::WLOCK);
+        err = mediaFs_->truncate(fileName.data(), 0);
+        lruEntry->truncateGen++;
+    }
+
+    if (err && errno != ENOENT) {
+        LOG_ERROR("truncate(0) failed, name : `, ret : `, error code : `", fileName, err,
+                  ERRNO());
+        return false;
+    }
+    return afterFtrucate(iter);
 }
 
 uint64_t FileCachePool::calcWaterMark(uint64_t capacity, uint64_t maxFreeSpace) {
@@ -24,6 +24,7 @@
 #include <photon/thread/thread.h>
 #include <photon/thread/timer.h>
 #include <photon/common/string-keyed.h>
+#include <photon/common/io-alloc.h>
 #include "../policy/lru.h"
 #include "../pool_store.h"
 
@@ -34,21 +35,30 @@ namespace photon {
     };
 }; // photon
 
+namespace ZFile {
+class ICompressor;
+}
+
 namespace Cache {
 
 
 class FileCachePool : public FileSystem::ICachePool {
 public:
     FileCachePool(photon::fs::IFileSystem *mediaFs, uint64_t capacityInGB, uint64_t periodInUs,
-                  uint64_t diskAvailInBytes, uint64_t refillUnit, Fn_trans_func name_trans = nullptr);
+                  uint64_t diskAvailInBytes, uint64_t refillUnit, Fn_trans_func name_trans = nullptr,
+                  bool directIO = false);
     ~FileCachePool();
 
     static const uint64_t kDiskBlockSize = 512; // stat(2)
     static const uint64_t kDeleteDelayInUs = 1000;
     static const uint32_t kWaterMarkRatio = 90;
+    static const uint32_t kDirectIOAlign = 4096;
 
     void Init();
 
+    // store refill units compressed with `algo` ("lz4" or "zstd"), must be called before Init()
+    int enableCompression(std::string_view algo);
+
     //  pathname must begin with '/'
     FileSystem::ICacheStore *do_open(std::string_view pathname, int flags, mode_t mode) override;
 
@@ -65,6 +75,12 @@ public:
         uint32_t lruIter;
         int openCount;
         uint64_t size;
+        uint64_t hitBytes = 0;
+        uint64_t missBytes = 0;
+        uint64_t refillCount = 0;
+        uint64_t refillBytes = 0;
+        // bumped each time the media file is truncated by eviction
+        uint64_t truncateGen = 0;
         photon::rwlock rw_lock_;
     };
 
@@ -75,16 +91,31 @@ public:
     typedef map_string_key<std::unique_ptr<LruEntry>> FileNameMap;
 
     bool isFull();
+    bool isDirectIO() {
+        return directIO_;
+    }
     void removeOpenFile(FileNameMap::iterator iter);
     void forceRecycle();
     void updateLru(FileNameMap::iterator iter);
     uint64_t updateSpace(FileNameMap::iterator iter, uint64_t size);
 
+    void addHit(FileNameMap::iterator iter, uint64_t bytes);
+    void addMiss(FileNameMap::iterator iter, uint64_t bytes);
+    void addRefill(FileNameMap::iterator iter, uint64_t bytes);
+    // fill the per-file part of `stat` (everything except total_size)
+    void fillStat(FileNameMap::iterator iter, FileSystem::CacheStat *stat);
+
 protected:
     photon::fs::IFile *openMedia(std::string_view name, int flags, int mode);
+    // name of the media file of `pathname`
+    std::string mediaName(std::string_view pathname);
 
     static uint64_t timerHandler(void *data);
     virtual void eviction();
+    // evict files from the tail of lru until at least `bytes` were released,
+    // returns the bytes actually released
+    int64_t evictLru(int64_t bytes);
+    bool evictFile(FileNameMap::iterator iter);
     uint64_t calcWaterMark(uint64_t capacity, uint64_t maxFreeSpace);
 
     photon::fs::IFileSystem *mediaFs_; //  owned by current class
@@ -93,9 +124,22 @@ protected:
     uint64_t diskAvailInBytes_;
     size_t refillUnit_;
     int64_t totalUsed_;
+    uint64_t hitBytes_ = 0;
+    uint64_t missBytes_ = 0;
+    uint64_t refillCount_ = 0;
+    uint64_t refillBytes_ = 0;
     int64_t riskMark_;
     uint64_t waterMark_;
 
+    // media files are opened with O_DIRECT, and accessed through an aligned
+    // file adaptor with buffers from ioAlloc_, so that cached data doesn't
+    // occupy page cache
+    bool directIO_;
+    std::unique_ptr<IOAlloc> ioAlloc_;
+
+    ZFile::ICompressor *compressor_ = nullptr; //  owned by current class
+    size_t compressBound_ = 0;
+
     photon::Timer *timer_;
     bool running_;
     bool exit_;
@@ -103,6 +147,9 @@ protected:
     bool isFull_;
 
     virtual bool afterFtrucate(FileNameMap::iterator iter);
+    // called before the content of a file is dropped by eviction
+    virtual void beforeEvict(FileNameMap::iterator iter) {
+    }
 
     int traverseDir(const std::string &root);
     virtual int insertFile(std::string_view file);
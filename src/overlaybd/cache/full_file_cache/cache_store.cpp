@@ -42,6 +42,18 @@ FileCacheStore::~FileCacheStore() {
     cachePool_->removeOpenFile(iterator_);
 }
 
+FileCacheStore::try_preadv_result FileCacheStore::try_preadv(const struct iovec *iov, int iovcnt,
+                                                             off_t offset) {
+    auto rst = ICacheStore::try_preadv(iov, iovcnt, offset);
+    if (rst.refill_size == 0) {
+        if (rst.size > 0)
+            cachePool_->addHit(iterator_, rst.size);
+    } else {
+        cachePool_->addMiss(iterator_, rst.iov_sum);
+    }
+    return rst;
+}
+
 ssize_t FileCacheStore::preadv(const struct iovec *iov, int iovcnt, off_t offset) {
     ssize_t ret;
     cachePool_->updateLru(iterator_);
@@ -55,7 +67,14 @@ ssize_t FileCacheStore::preadv(const struct iovec *iov, int iovcnt, off_t offset
 ssize_t FileCacheStore::do_pwritev(const struct iovec *iov, int iovcnt, off_t offset) {
     ssize_t ret;
     iovector_view view((iovec *)iov, iovcnt);
-    ScopedRangeLock lock(rangeLock_, offset, view.sum());
+    off_t lockLeft = offset;
+    off_t lockRight = offset + view.sum();
+    if (cachePool_->isDirectIO()) {
+        // unaligned edges are read-modify-written in whole blocks
+        lockLeft = align_down(lockLeft, FileCachePool::kDirectIOAlign);
+        lockRight = align_up(lockRight, FileCachePool::kDirectIOAlign);
+    }
+    ScopedRangeLock lock(rangeLock_, lockLeft, lockRight - lockLeft);
     SCOPE_AUDIT_THRESHOLD(10UL * 1000, "file:write", AU_FILEOP("", offset, ret));
     ret = localFile_->pwritev(iov, iovcnt, offset);
     return ret;
@@ -78,8 +97,13 @@ ssize_t FileCacheStore::pwritev(const struct iovec *iov, int iovcnt, off_t offse
         if (err) {
             LOG_ERRNO_RETURN(0, ret, "fstat failed")
         }
+        // the last block written by direct I/O may extend beyond end of file
+        if (fileSize_ >= 0 && st.st_size > fileSize_) {
+            localFile_->ftruncate(fileSize_);
+        }
         cachePool_->updateLru(iterator_);
         cachePool_->updateSpace(iterator_, kDiskBlockSize * st.st_blocks);
+        cachePool_->addRefill(iterator_, ret);
     }
     return ret;
 }
@@ -147,8 +171,16 @@ std::pair<off_t, size_t> FileCacheStore::queryRefillRange(off_t offset, size_t s
 }
 
 int FileCacheStore::stat(FileSystem::CacheStat *stat) {
-    errno = ENOSYS;
-    return -1;
+    if (stat == nullptr) {
+        LOG_ERROR_RETURN(EINVAL, -1, "stat is nullptr");
+    }
+    struct stat st = {};
+    if (localFile_->fstat(&st)) {
+        LOG_ERRNO_RETURN(0, -1, "fstat failed");
+    }
+    cachePool_->fillStat(iterator_, stat);
+    stat->total_size = (st.st_size + refillUnit_ - 1) / refillUnit_;
+    return 0;
 }
 
 int FileCacheStore::evict(off_t offset, size_t count) {
@@ -176,6 +208,7 @@ bool FileCacheStore::cacheIsFull() {
 }
 
 int FileCacheStore::ftruncate(off_t length) {
+    fileSize_ = length;
     return localFile_->ftruncate(length);
 }
 
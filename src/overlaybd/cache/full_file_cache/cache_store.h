@@ -38,6 +38,8 @@ public:
                    FileIterator iterator);
     ~FileCacheStore();
 
+    try_preadv_result try_preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
+
     ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
 
     ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override;
@@ -72,6 +74,7 @@ protected:
     size_t refillUnit_;
     FileIterator iterator_;
     RangeLock rangeLock_;
+    off_t fileSize_ = -1; // set by ftruncate()
 
     ssize_t do_pwritev(const struct iovec *iov, int iovcnt, off_t offset);
 };
@@ -0,0 +1,271 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "compressed_store.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <photon/common/alog.h>
+#include <photon/common/iovector.h>
+#include <photon/common/utility.h>
+#include <photon/fs/filesystem.h>
+#include "../../zfile/compressor.h"
+
+namespace Cache {
+
+const int kBlockSize = 4 * 1024;
+
+// copy between a buffer and iov[] starting at `skip` bytes of the iov[]
+static void copy_iov(const struct iovec *iov, int iovcnt, size_t skip, char *buf, size_t len,
+                     bool toIov) {
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        auto n = std::min(len, iov[i].iov_len - skip);
+        auto base = (char *)iov[i].iov_base + skip;
+        if (toIov)
+            memcpy(base, buf, n);
+        else
+            memcpy(buf, base, n);
+        buf += n;
+        len -= n;
+        skip = 0;
+    }
+}
+
+CompressedFileCacheStore::CompressedFileCacheStore(FileSystem::ICachePool *cachePool,
+                                                   photon::fs::IFile *localFile, size_t refillUnit,
+                                                   FileIterator iterator,
+                                                   ZFile::ICompressor *compressor,
+                                                   size_t compressBound)
+    : FileCacheStore(cachePool, localFile, refillUnit, iterator), compressor_(compressor),
+      compressBound_(compressBound) {
+}
+
+int CompressedFileCacheStore::loadMap() {
+    auto size = unitLen_.size() * sizeof(uint32_t);
+    if (size == 0) {
+        return 0;
+    }
+    auto ret = localFile_->pread(unitLen_.data(), size, mapOffset_);
+    if (ret < 0) {
+        LOG_ERRNO_RETURN(0, -1, "read unit map failed");
+    }
+    // a map shorter than expected is left by crash, treat the rest as missing
+    if (static_cast<size_t>(ret) < size) {
+        memset((char *)unitLen_.data() + ret, 0, size - ret);
+    }
+    return 0;
+}
+
+int CompressedFileCacheStore::writeMap(size_t first, size_t n) {
+    auto size = n * sizeof(uint32_t);
+    auto ret = localFile_->pwrite(&unitLen_[first], size, mapOffset_ + first * sizeof(uint32_t));
+    if (ret != static_cast<ssize_t>(size)) {
+        LOG_ERRNO_RETURN(0, -1, "write unit map failed, unit : `", first);
+    }
+    return 0;
+}
+
+// the pool truncates media files of open stores to 0 on eviction, drop the
+// units then, and lay the media file out again
+void CompressedFileCacheStore::checkTruncated() {
+    auto lruEntry = iterator_->second.get();
+    if (lruEntry->truncateGen == truncateGen_) {
+        return;
+    }
+    truncateGen_ = lruEntry->truncateGen;
+    std::fill(unitLen_.begin(), unitLen_.end(), 0);
+    FileCacheStore::ftruncate(mapOffset_ + unitLen_.size() * sizeof(uint32_t));
+}
+
+int CompressedFileCacheStore::ftruncate(off_t length) {
+    truncateGen_ = iterator_->second->truncateGen;
+    logicalSize_ = length;
+    auto n = (length + refillUnit_ - 1) / refillUnit_;
+    mapOffset_ = n * refillUnit_;
+    unitLen_.assign(n, 0);
+    if (FileCacheStore::ftruncate(mapOffset_ + n * sizeof(uint32_t)) != 0) {
+        return -1;
+    }
+    return loadMap();
+}
+
+int CompressedFileCacheStore::fstat(struct stat *buf) {
+    if (FileCacheStore::fstat(buf) != 0) {
+        return -1;
+    }
+    buf->st_size = logicalSize_;
+    return 0;
+}
+
+int CompressedFileCacheStore::stat(FileSystem::CacheStat *stat) {
+    checkTruncated();
+    if (FileCacheStore::stat(stat) != 0) {
+        return -1;
+    }
+    stat->total_size = unitLen_.size();
+    return 0;
+}
+
+std::pair<off_t, size_t> CompressedFileCacheStore::queryRefillRange(off_t offset, size_t size) {
+    checkTruncated();
+    size_t first = offset / refillUnit_;
+    size_t last = std::min((offset + size + refillUnit_ - 1) / refillUnit_, unitLen_.size());
+    size_t holeStart = last, holeEnd = first;
+    for (auto i = first; i < last; i++) {
+        if (unitLen_[i] == 0) {
+            holeStart = std::min(holeStart, i);
+            holeEnd = i + 1;
+        }
+    }
+    if (holeStart >= holeEnd)
+        return std::make_pair(0, 0);
+    return std::make_pair(holeStart * refillUnit_, (holeEnd - holeStart) * refillUnit_);
+}
+
+ssize_t CompressedFileCacheStore::readUnit(size_t idx, char *unitBuf, char *zBuf) {
+    auto len = unitLen_[idx] & ~kRawFlag;
+    bool raw = unitLen_[idx] & kRawFlag;
+    size_t rawLen = std::min(static_cast<uint64_t>(refillUnit_),
+                             static_cast<uint64_t>(logicalSize_ - idx * refillUnit_));
+    struct iovec iov {
+        raw ? unitBuf : zBuf, len
+    };
+    auto ret = FileCacheStore::preadv(&iov, 1, idx * refillUnit_);
+    if (ret != static_cast<ssize_t>(len)) {
+        LOG_ERRNO_RETURN(0, -1, "read unit failed, unit : `, ret : `", idx, ret);
+    }
+    if (raw) {
+        return len;
+    }
+    auto dlen = compressor_->decompress((unsigned char *)zBuf, len, (unsigned char *)unitBuf,
+                                        refillUnit_);
+    if (dlen != static_cast<ssize_t>(rawLen)) {
+        LOG_ERROR_RETURN(EIO, -1, "decompress unit failed, unit : `, ret : `", idx, dlen);
+    }
+    return dlen;
+}
+
+ssize_t CompressedFileCacheStore::preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+    iovector_view view((iovec *)iov, iovcnt);
+    size_t count = view.sum();
+    if (offset >= logicalSize_) {
+        return 0;
+    }
+    count = std::min(count, static_cast<size_t>(logicalSize_ - offset));
+    checkTruncated();
+
+    void *unitBuf = nullptr, *zBuf = nullptr;
+    if (posix_memalign(&unitBuf, kBlockSize, refillUnit_) != 0 ||
+        posix_memalign(&zBuf, kBlockSize, compressBound_) != 0) {
+        free(unitBuf);
+        LOG_ERROR_RETURN(ENOMEM, -1, "failed to alloc decompression buffer");
+    }
+    DEFER({
+        free(unitBuf);
+        free(zBuf);
+    });
+
+    size_t tail = (offset + count) / refillUnit_;
+    if (count % refillUnit_ != 0 && tail < unitLen_.size() && tail + 1 != unitLen_.size()) {
+        LOG_ERROR_RETURN(EINVAL, -1, "partial unit write, offset : `, count : `", offset, count);
+    }
+
+    // units rewritten are dropped first, durably, before their slots are reused
+    size_t first = offset / refillUnit_;
+    size_t last = std::min((offset + count + refillUnit_ - 1) / refillUnit_, unitLen_.size());
+    if (first < last && std::any_of(unitLen_.begin() + first, unitLen_.begin() + last,
+                                    [](uint32_t entry) { return entry != 0; })) {
+        if (evict(first * refillUnit_, (last - first) * refillUnit_) != 0) {
+            return -1;
+        }
+    }
+
+    std::vector<uint32_t> entries;
+    size_t done = 0;
+    while (done < count) {
+        auto idx = (offset + done) / refillUnit_;
+        if (idx >= unitLen_.size()) {
+            break;
+        }
+        auto len = std::min(count - done, refillUnit_);
+        copy_iov(iov, iovcnt, done, (char *)unitBuf, len, false);
+
+        // keep it raw if compression doesn't save a single block
+        uint32_t entry;
+        struct iovec unitIov;
+        auto clen = compressor_->compress((unsigned char *)unitBuf, len, (unsigned char *)zBuf,
+                                          compressBound_);
+        if (clen > 0 && static_cast<size_t>(clen) + kBlockSize <= len) {
+            entry = clen;
+            unitIov = {zBuf, static_cast<size_t>(clen)};
+        } else {
+            entry = len | kRawFlag;
+            unitIov = {unitBuf, len};
+        }
+
+        auto ret = FileCacheStore::pwritev(&unitIov, 1, idx * refillUnit_);
+        if (ret != static_cast<ssize_t>(unitIov.iov_len)) {
+            if (entries.empty()) {
+                LOG_ERRNO_RETURN(0, -1, "write unit failed, unit : `", idx);
+            }
+            LOG_ERROR("write unit failed, unit : `", idx);
+            break;
+        }
+        entries.push_back(entry);
+        done += len;
+    }
+    if (entries.empty()) {
+        return done;
+    }
+
+    // the data must be on disk before the map makes the units visible
+    if (localFile_->fdatasync() != 0) {
+        LOG_ERRNO_RETURN(0, -1, "sync units failed, unit : `", first);
+    }
+    std::copy(entries.begin(), entries.end(), unitLen_.begin() + first);
+    if (writeMap(first, entries.size()) != 0) {
+        return -1;
+    }
+    return done;
+}
+
+int CompressedFileCacheStore::evict(off_t offset, size_t count) {
+    checkTruncated();
+    size_t first = (offset + refillUnit_ - 1) / refillUnit_;
+    size_t last = (static_cast<size_t>(-1) == count)
+                      ? unitLen_.size()
+                      : std::min((offset + count) / refillUnit_, unitLen_.size());
+    if (first >= last) {
+        return 0;
+    }
+    std::fill(unitLen_.begin() + first, unitLen_.begin() + last, 0);
+    // the units must be dropped from the map on disk before their data is punched
+    if (writeMap(first, last - first) != 0) {
+        return -1;
+    }
+    if (localFile_->fdatasync() != 0) {
+        LOG_ERRNO_RETURN(0, -1, "sync unit map failed, unit : `", first);
+    }
+    return FileCacheStore::evict(first * refillUnit_, (last - first) * refillUnit_);
+}
+
+} //  namespace Cache
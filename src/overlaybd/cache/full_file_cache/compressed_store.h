@@ -0,0 +1,76 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <vector>
+#include "cache_store.h"
+
+namespace ZFile {
+class ICompressor;
+}
+
+namespace Cache {
+
+// A FileCacheStore keeping every refill unit compressed.
+//
+// Media file layout:
+//   [0, align_up(size, refillUnit))   unit i is stored at i * refillUnit, only the
+//                                      compressed bytes are written, the rest of the
+//                                      slot stays a hole and takes no disk space
+//   [mapOffset, mapOffset + 4 * n)    per-unit length map, 0 means not cached,
+//                                      kRawFlag marks units stored uncompressed
+//
+// A unit becomes visible only after its data is synced and its map entry is
+// written, and is dropped from the map on disk before its slot is punched or
+// reused, so a crash in the middle of a refill leaves the unit missing rather
+// than corrupted.
+class CompressedFileCacheStore : public FileCacheStore {
+public:
+    static const uint32_t kRawFlag = 1u << 31;
+
+    CompressedFileCacheStore(FileSystem::ICachePool *cachePool, photon::fs::IFile *localFile,
+                             size_t refillUnit, FileIterator iterator,
+                             ZFile::ICompressor *compressor, size_t compressBound);
+
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
+
+    // offset must be aligned to refill unit, so does count except the last unit
+    ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override;
+
+    int stat(FileSystem::CacheStat *stat) override;
+    int evict(off_t offset, size_t count = -1) override;
+    int ftruncate(off_t length) override;
+
+    std::pair<off_t, size_t> queryRefillRange(off_t offset, size_t size) override;
+
+    int fstat(struct stat *buf) override;
+
+protected:
+    int loadMap();
+    void checkTruncated();
+    int writeMap(size_t first, size_t n);
+    ssize_t readUnit(size_t idx, char *unitBuf, char *zBuf);
+
+    ZFile::ICompressor *compressor_; // owned by cache pool
+    size_t compressBound_;
+    off_t logicalSize_ = 0;
+    off_t mapOffset_ = 0;
+    std::vector<uint32_t> unitLen_;
+    uint64_t truncateGen_ = 0;
+};
+
+} //  namespace Cache
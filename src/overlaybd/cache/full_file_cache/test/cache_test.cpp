@@ -21,6 +21,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <chrono>
 #include <cstring>
 #include <random>
 #include <algorithm>
@@ -34,6 +35,7 @@
 #include <photon/common/io-alloc.h>
 
 #include "../../cache.h"
+#include "../tiered_pool.h"
 #include "random_generator.h"
 
 namespace Cache {
@@ -376,6 +378,276 @@ TEST(RoCachedFs, CacheWithOutSrcFile) {
     EXPECT_EQ(-1, writeFile->pread(res.data(), len, len * 2));
 }
 
+TEST(RoCachedFs, StatAndEvict) {
+    std::string root("/tmp/obdcache/cache_test_stat/");
+    SetupTestDir(root);
+    std::string srcRoot("/tmp/obdcache/src_test_stat/");
+    SetupTestDir(srcRoot + "testDir");
+
+    auto srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+    DEFER(delete srcFs);
+    const size_t kFileSize = 4 * 1024 * 1024;
+    {
+        auto srcFile = srcFs->open("/testDir/file_1", O_RDWR | O_CREAT | O_TRUNC, 0644);
+        std::vector<char> data(kFileSize, 'x');
+        EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(data.data(), kFileSize, 0));
+        delete srcFile;
+    }
+
+    auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+    auto cacheAllocator = new AlignedAlloc(4 * 1024);
+    DEFER(delete cacheAllocator);
+    const uint64_t refillSize = 1024 * 1024;
+    auto roCachedFs = new_full_file_cached_fs(srcFs, mediaFs, refillSize, 512, 1000 * 1000 * 1,
+                                              128ul * 1024 * 1024, cacheAllocator);
+    DEFER(delete roCachedFs);
+    auto cachePool = roCachedFs->get_pool();
+
+    auto cachedFile = static_cast<ICachedFile *>(roCachedFs->open("/testDir/file_1", 0, 0644));
+    std::vector<char> buf(4096);
+    EXPECT_EQ(4096, cachedFile->pread(buf.data(), 4096, 0)); // miss
+    EXPECT_EQ(4096, cachedFile->pread(buf.data(), 4096, 0)); // hit
+
+    CacheStat stat;
+    EXPECT_EQ(0, cachedFile->get_store()->stat(&stat));
+    EXPECT_EQ(refillSize, stat.refill_unit);
+    EXPECT_EQ(kFileSize / refillSize, stat.total_size);
+    EXPECT_LE(1u, stat.used_size);
+    EXPECT_EQ(4096u, stat.hit_bytes);
+    EXPECT_EQ(4096u, stat.miss_bytes);
+    EXPECT_EQ(1u, stat.refill_count);
+    EXPECT_EQ(refillSize, stat.refill_bytes);
+
+    CacheStat total;
+    EXPECT_EQ(0, cachePool->stat(&total));
+    EXPECT_EQ(512ul * 1024 * 1024 * 1024 / refillSize, total.total_size);
+    EXPECT_EQ(4096u, total.hit_bytes);
+    EXPECT_EQ(1u, total.refill_count);
+    delete cachedFile;
+
+    EXPECT_EQ(0, cachePool->stat(&stat, "/testDir/file_1"));
+    EXPECT_EQ(4096u, stat.hit_bytes);
+    EXPECT_EQ(0, cachePool->evict("/testDir/file_1"));
+    EXPECT_EQ(-1, cachePool->stat(&stat, "/testDir/file_1"));
+    EXPECT_EQ(ENOENT, errno);
+    EXPECT_EQ(-1, cachePool->evict("/testDir/file_1"));
+
+    EXPECT_EQ(0, cachePool->stat(&total));
+    EXPECT_EQ(0u, total.used_size);
+    EXPECT_EQ(0, cachePool->evict((size_t)refillSize));
+}
+
+TEST(RoCachedFs, TieredPromote) {
+    std::string fastRoot("/tmp/obdcache/cache_test_fast/");
+    std::string slowRoot("/tmp/obdcache/cache_test_slow/");
+    SetupTestDir(fastRoot);
+    SetupTestDir(slowRoot);
+    std::string srcRoot("/tmp/obdcache/src_test_tiered/");
+    SetupTestDir(srcRoot + "testDir");
+
+    auto srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+    DEFER(delete srcFs);
+    const size_t kFileSize = 4 * 1024 * 1024;
+    {
+        auto srcFile = srcFs->open("/testDir/file_1", O_RDWR | O_CREAT | O_TRUNC, 0644);
+        std::vector<char> data(kFileSize, 'y');
+        EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(data.data(), kFileSize, 0));
+        delete srcFile;
+    }
+
+    photon::fs::IFileSystem *mediaFs[] = {
+        new_localfs_adaptor(fastRoot.c_str(), ioengine_psync),
+        new_localfs_adaptor(slowRoot.c_str(), ioengine_psync),
+    };
+    const uint64_t capacityInGB[] = {1, 512};
+    auto cacheAllocator = new AlignedAlloc(4 * 1024);
+    DEFER(delete cacheAllocator);
+    const uint64_t refillSize = 1024 * 1024;
+    auto roCachedFs = new_tiered_file_cached_fs(srcFs, mediaFs, capacityInGB, 2, refillSize, 2,
+                                                1000 * 1000 * 1, 128ul * 1024 * 1024,
+                                                cacheAllocator);
+    ASSERT_NE(nullptr, roCachedFs);
+    DEFER(delete roCachedFs);
+
+    auto blocksOf = [](const std::string &path) -> blkcnt_t {
+        struct stat st = {};
+        return ::stat(path.c_str(), &st) == 0 ? st.st_blocks : 0;
+    };
+    auto cachedFile = static_cast<ICachedFile *>(roCachedFs->open("/testDir/file_1", 0, 0644));
+    std::vector<char> buf(4096);
+    EXPECT_EQ(4096, cachedFile->pread(buf.data(), 4096, 0)); // refill into slow tier
+    EXPECT_LT(0, blocksOf(slowRoot + "testDir/file_1"));
+    EXPECT_EQ(0, blocksOf(fastRoot + "testDir/file_1"));
+    for (int i = 0; i < 3; i++) {
+        EXPECT_EQ(4096, cachedFile->pread(buf.data(), 4096, 0));
+        EXPECT_EQ('y', buf[4095]);
+    }
+    // promoted in background
+    for (int i = 0; i < 100 && blocksOf(fastRoot + "testDir/file_1") == 0; i++) {
+        photon::thread_usleep(10 * 1000);
+    }
+    EXPECT_LT(0, blocksOf(fastRoot + "testDir/file_1"));
+    EXPECT_EQ(4096, cachedFile->pread(buf.data(), 4096, 0)); // from fast tier
+    delete cachedFile;
+
+    auto cachePool = roCachedFs->get_pool();
+    CacheStat fileStat;
+    EXPECT_EQ(0, cachePool->stat(&fileStat, "/testDir/file_1"));
+    EXPECT_LE(4096ul, fileStat.miss_bytes);
+    EXPECT_LE(4ul * 4096, fileStat.hit_bytes);
+    CacheStat total;
+    EXPECT_EQ(0, cachePool->stat(&total));
+    EXPECT_EQ(513ul * 1024 * 1024 * 1024 / refillSize, total.total_size);
+    EXPECT_EQ(0, cachePool->evict("/testDir/file_1"));
+    EXPECT_EQ(0, blocksOf(fastRoot + "testDir/file_1"));
+    EXPECT_EQ(0, blocksOf(slowRoot + "testDir/file_1"));
+}
+
+TEST(RoCachedFs, TieredDemote) {
+    std::string fastRoot("/tmp/obdcache/cache_test_demote_fast/");
+    std::string slowRoot("/tmp/obdcache/cache_test_demote_slow/");
+    SetupTestDir(fastRoot);
+    SetupTestDir(slowRoot);
+    std::string srcRoot("/tmp/obdcache/src_test_demote/");
+    SetupTestDir(srcRoot + "testDir");
+
+    auto srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+    DEFER(delete srcFs);
+    const size_t kFileSize = 4 * 1024 * 1024;
+    std::vector<char> data(kFileSize);
+    std::mt19937 gen(4321);
+    for (auto &c : data)
+        c = (char)gen();
+    {
+        auto srcFile = srcFs->open("/testDir/file_1", O_RDWR | O_CREAT | O_TRUNC, 0644);
+        EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(data.data(), kFileSize, 0));
+        delete srcFile;
+    }
+
+    const uint64_t refillSize = 1024 * 1024;
+    auto fast = new FastTierPool(new_localfs_adaptor(fastRoot.c_str(), ioengine_psync), 1,
+                                 1000 * 1000 * 1, 128ul * 1024 * 1024, refillSize, nullptr);
+    fast->Init();
+    auto slow = new FileCachePool(new_localfs_adaptor(slowRoot.c_str(), ioengine_psync), 512,
+                                  1000 * 1000 * 1, 128ul * 1024 * 1024, refillSize, nullptr);
+    slow->Init();
+    auto tiered = new TieredCachePool(fast, slow, refillSize, 1);
+    auto cacheAllocator = new AlignedAlloc(4 * 1024);
+    DEFER(delete cacheAllocator);
+    auto roCachedFs = new_cached_fs(srcFs, tiered, 4096, refillSize, cacheAllocator);
+    ASSERT_NE(nullptr, roCachedFs);
+    DEFER(delete roCachedFs);
+
+    auto blocksOf = [](const std::string &path) -> blkcnt_t {
+        struct stat st = {};
+        return ::stat(path.c_str(), &st) == 0 ? st.st_blocks : 0;
+    };
+    auto cachedFile = roCachedFs->open("/testDir/file_1", 0, 0644);
+    ASSERT_NE(nullptr, cachedFile);
+    DEFER(delete cachedFile);
+    std::vector<char> buf(kFileSize);
+    EXPECT_EQ((ssize_t)kFileSize, cachedFile->pread(buf.data(), kFileSize, 0)); // refill
+    EXPECT_EQ((ssize_t)kFileSize, cachedFile->pread(buf.data(), kFileSize, 0)); // promote
+    for (int i = 0; i < 100 && blocksOf(fastRoot + "testDir/file_1") < (blkcnt_t)kFileSize / 512;
+         i++) {
+        photon::thread_usleep(10 * 1000);
+    }
+    EXPECT_LE((blkcnt_t)kFileSize / 512, blocksOf(fastRoot + "testDir/file_1"));
+
+    // drop the slow copy, then the fast tier runs out of space and demotes the file
+    EXPECT_EQ(0, slow->evict("/testDir/file_1"));
+    EXPECT_EQ(0, blocksOf(slowRoot + "testDir/file_1"));
+    EXPECT_EQ(0, fast->evict(kFileSize));
+    EXPECT_EQ(0, blocksOf(fastRoot + "testDir/file_1"));
+    EXPECT_LE((blkcnt_t)kFileSize / 512, blocksOf(slowRoot + "testDir/file_1"));
+
+    CacheStat stat;
+    EXPECT_EQ(0, tiered->stat(&stat));
+    auto refills = stat.refill_count;
+    memset(buf.data(), 0, kFileSize);
+    EXPECT_EQ((ssize_t)kFileSize, cachedFile->pread(buf.data(), kFileSize, 0));
+    EXPECT_EQ(0, memcmp(data.data(), buf.data(), kFileSize));
+    EXPECT_EQ(0, tiered->stat(&stat));
+    EXPECT_EQ(refills, stat.refill_count); // served by slow tier
+}
+
+TEST(RoCachedFs, Compressed) {
+    for (auto algo : {"lz4", "zstd"}) {
+        std::string root("/tmp/obdcache/cache_test_compressed/");
+        SetupTestDir(root);
+        std::string srcRoot("/tmp/obdcache/src_test_compressed/");
+        SetupTestDir(srcRoot + "testDir");
+
+        auto srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+        DEFER(delete srcFs);
+        // half compressible text, half random, with an unaligned tail
+        const size_t kFileSize = 8 * 1024 * 1024 + 12345;
+        std::vector<char> data(kFileSize);
+        std::mt19937 gen(1234);
+        for (size_t i = 0; i < kFileSize; i++) {
+            data[i] = (i / (1024 * 1024)) % 2 ? (char)gen() : "overlaybd"[i % 9];
+        }
+        {
+            auto srcFile = srcFs->open("/testDir/file_1", O_RDWR | O_CREAT | O_TRUNC, 0644);
+            EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(data.data(), kFileSize, 0));
+            delete srcFile;
+        }
+
+        auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+        auto cacheAllocator = new AlignedAlloc(4 * 1024);
+        DEFER(delete cacheAllocator);
+        const uint64_t refillSize = 256 * 1024;
+        auto roCachedFs = new_full_file_cached_fs(srcFs, mediaFs, refillSize, 512, 1000 * 1000 * 1,
+                                                  128ul * 1024 * 1024, cacheAllocator,
+                                                  ICachePool::same_name_trans, false, algo);
+        ASSERT_NE(nullptr, roCachedFs);
+        DEFER(delete roCachedFs);
+
+        auto cachedFile = roCachedFs->open("/testDir/file_1", 0, 0644);
+        std::vector<char> buf(kFileSize);
+        EXPECT_EQ((ssize_t)kFileSize, cachedFile->pread(buf.data(), kFileSize, 0));
+        EXPECT_EQ(0, memcmp(data.data(), buf.data(), kFileSize));
+
+        // hit latency of random 4K reads, photon::now doesn't advance without yielding
+        const int kReads = 1000;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kReads; i++) {
+            off_t offset = gen() % (kFileSize - 4096);
+            EXPECT_EQ(4096, cachedFile->pread(buf.data(), 4096, offset));
+            EXPECT_EQ(0, memcmp(data.data() + offset, buf.data(), 4096));
+        }
+        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count() /
+                       kReads;
+        struct stat st = {};
+        EXPECT_EQ(0, cachedFile->fstat(&st));
+        EXPECT_EQ((off_t)kFileSize, st.st_size);
+
+        // evicted by the pool while open, refilled on next read
+        auto cachePool = roCachedFs->get_pool();
+        CacheStat before, after;
+        EXPECT_EQ(0, cachePool->stat(&before));
+        EXPECT_EQ(0, cachePool->evict("/testDir/file_1"));
+        memset(buf.data(), 0, kFileSize);
+        EXPECT_EQ((ssize_t)kFileSize, cachedFile->pread(buf.data(), kFileSize, 0));
+        EXPECT_EQ(0, memcmp(data.data(), buf.data(), kFileSize));
+        EXPECT_EQ(0, cachePool->stat(&after));
+        EXPECT_LT(before.refill_count, after.refill_count);
+        EXPECT_EQ((ssize_t)kFileSize, cachedFile->pread(buf.data(), kFileSize, 0));
+        EXPECT_EQ(0, memcmp(data.data(), buf.data(), kFileSize));
+        EXPECT_EQ(0, cachePool->stat(&before));
+        EXPECT_EQ(after.refill_count, before.refill_count);
+        delete cachedFile;
+
+        EXPECT_EQ(0, ::stat((root + "testDir/file_1.z").c_str(), &st));
+        uint64_t used = st.st_blocks * 512;
+        EXPECT_LT(used, kFileSize * 3 / 4);
+        LOG_INFO("algorithm : `, media used : ` of `, effective capacity x`, hit latency : `us",
+                 algo, used, kFileSize, (double)kFileSize / used, latency);
+    }
+}
+
 } //  namespace Cache
 
 int main(int argc, char **argv) {
@@ -0,0 +1,307 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "tiered_pool.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <photon/common/alog-stdstring.h>
+#include <photon/common/alog.h>
+#include <photon/common/iovector.h>
+#include <photon/common/utility.h>
+
+namespace Cache {
+
+using namespace FileSystem;
+
+// units tracked for promotion of a file, before their hits are decayed
+static const size_t kMaxTrackedUnits = 4096;
+
+static bool is_resident(std::pair<off_t, size_t> q) {
+    // (-1, 0) is returned for failures
+    return q.first == 0 && q.second == 0;
+}
+
+void FastTierPool::beforeEvict(FileNameMap::iterator iter) {
+    if (tiered_)
+        tiered_->demote(iter->first);
+}
+
+TieredCachePool::TieredCachePool(FastTierPool *fast, ICachePool *slow, uint64_t refillUnit,
+                                 uint32_t promoteHits, Fn_trans_func name_trans)
+    : fast_(fast), slow_(slow), refillUnit_(refillUnit),
+      promoteHits_(std::max(promoteHits, 1U)) {
+    fast_->setLowerTier(this);
+    if (name_trans != nullptr) {
+        file_name_trans = name_trans;
+    }
+}
+
+TieredCachePool::~TieredCachePool() {
+    fast_->setLowerTier(nullptr);
+    delete fast_;
+    delete slow_;
+}
+
+ICacheStore *TieredCachePool::do_open(std::string_view pathname, int flags, mode_t mode) {
+    auto filename = file_name_trans(pathname);
+    auto fast = fast_->open(filename, flags, mode);
+    if (fast == nullptr) {
+        LOG_ERRNO_RETURN(0, nullptr, "open fast tier failed, name : `", filename);
+    }
+    auto slow = slow_->open(filename, flags, mode);
+    if (slow == nullptr) {
+        fast->release();
+        LOG_ERRNO_RETURN(0, nullptr, "open slow tier failed, name : `", filename);
+    }
+    return new TieredCacheStore(this, fast, slow);
+}
+
+int TieredCachePool::stat(CacheStat *stat, std::string_view pathname) {
+    if (stat == nullptr) {
+        LOG_ERROR_RETURN(EINVAL, -1, "stat is nullptr");
+    }
+    CacheStat fast, slow;
+    if (pathname.empty() || pathname == "/") {
+        if (fast_->stat(&fast) || slow_->stat(&slow)) {
+            return -1;
+        }
+        stat->total_size = fast.total_size + slow.total_size;
+        stat->used_size = fast.used_size + slow.used_size;
+        stat->hit_bytes = hitBytes_;
+        stat->miss_bytes = missBytes_;
+    } else {
+        auto filename = file_name_trans(pathname);
+        auto rf = fast_->stat(&fast, filename);
+        auto rs = slow_->stat(&slow, filename);
+        if (rf && rs) {
+            LOG_ERROR_RETURN(ENOENT, -1, "file is not cached, name : `", pathname);
+        }
+        // fast tier is mostly a subset of slow tier
+        stat->total_size = std::max(fast.total_size, slow.total_size);
+        stat->used_size = std::max(fast.used_size, slow.used_size);
+        stat->hit_bytes = fast.hit_bytes + slow.hit_bytes;
+        stat->miss_bytes = fast.miss_bytes + slow.miss_bytes;
+    }
+    stat->refill_unit = refillUnit_;
+    stat->refill_count = slow.refill_count;
+    stat->refill_bytes = slow.refill_bytes;
+    return 0;
+}
+
+int TieredCachePool::evict(std::string_view filename) {
+    auto name = file_name_trans(filename);
+    demoteEnabled_ = false;
+    DEFER(demoteEnabled_ = true);
+    auto rf = fast_->evict(name);
+    auto rs = slow_->evict(name);
+    return (rf && rs) ? -1 : 0;
+}
+
+int TieredCachePool::evict(size_t size) {
+    // space is reclaimed from the capacity tier, fast tier keeps
+    // demoting by its own watermark
+    return slow_->evict(size);
+}
+
+void TieredCachePool::demote(std::string_view name) {
+    if (!demoteEnabled_) {
+        return;
+    }
+    auto fast = fast_->open(name, O_RDWR, 0644);
+    if (fast == nullptr) {
+        return;
+    }
+    DEFER(fast->release());
+    struct stat st = {};
+    if (fast->fstat(&st) || st.st_size == 0) {
+        return;
+    }
+    auto slow = slow_->open(name, O_RDWR | O_CREAT, 0644);
+    if (slow == nullptr) {
+        LOG_ERRNO_RETURN(0, , "open slow tier failed, demotion skipped, name : `", name);
+    }
+    DEFER(slow->release());
+    struct stat sst = {};
+    if (slow->fstat(&sst) == 0 && sst.st_size < st.st_size) {
+        slow->ftruncate(st.st_size);
+    }
+
+    void *buf = nullptr;
+    if (posix_memalign(&buf, 4096, refillUnit_) != 0) {
+        LOG_ERROR_RETURN(ENOMEM, , "failed to alloc demotion buffer");
+    }
+    DEFER(free(buf));
+    uint64_t demoted = 0;
+    for (off_t offset = 0; offset < st.st_size; offset += refillUnit_) {
+        auto len = std::min(refillUnit_, static_cast<uint64_t>(st.st_size - offset));
+        if (!is_resident(fast->queryRefillRange(offset, len)) ||
+            is_resident(slow->queryRefillRange(offset, len))) {
+            continue;
+        }
+        if (fast->pread(buf, len, offset) != static_cast<ssize_t>(len) ||
+            slow->pwrite(buf, len, offset) != static_cast<ssize_t>(len)) {
+            LOG_ERRNO_RETURN(0, , "demotion interrupted, name : `, offset : `", name, offset);
+        }
+        demoted += len;
+    }
+    demoteBytes_ += demoted;
+    LOG_DEBUG("demote ` bytes of ` to slow tier", demoted, name);
+}
+
+TieredCacheStore::~TieredCacheStore() {
+    closing_ = true;
+    while (promoting_) {
+        promoteDone_.wait_no_lock();
+    }
+    fast_->release();
+    slow_->release();
+}
+
+ICacheStore::try_preadv_result TieredCacheStore::try_preadv(const struct iovec *iov, int iovcnt,
+                                                            off_t offset) {
+    auto rst = ICacheStore::try_preadv(iov, iovcnt, offset);
+    if (rst.refill_size == 0) {
+        if (rst.size > 0)
+            tieredPool_->addHit(rst.size);
+    } else {
+        tieredPool_->addMiss(rst.iov_sum);
+        // the miss of the file is accounted by the slow tier, where it's refilled
+        slow_->try_preadv(iov, iovcnt, offset);
+    }
+    return rst;
+}
+
+// reads go through try_preadv() of the tiers, so that hits are accounted per file
+ssize_t TieredCacheStore::preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+    iovector_view view((iovec *)iov, iovcnt);
+    auto size = view.sum();
+    if (is_resident(fast_->queryRefillRange(offset, size))) {
+        auto rst = fast_->try_preadv(iov, iovcnt, offset);
+        if (rst.refill_size == 0) {
+            return rst.size;
+        }
+        // evicted from fast tier meanwhile
+    }
+    auto rst = slow_->try_preadv(iov, iovcnt, offset);
+    auto ret = rst.refill_size == 0 ? rst.size : slow_->preadv(iov, iovcnt, offset);
+    if (ret > 0) {
+        promote(offset, ret);
+    }
+    return ret;
+}
+
+// count the hits, units ready are queued for the promoter thread
+void TieredCacheStore::promote(off_t offset, size_t size) {
+    auto unit = tieredPool_->refillUnit_;
+    for (auto i = offset / unit; i <= (offset + size - 1) / unit; i++) {
+        if (++slowHits_[i] >= tieredPool_->promoteHits_) {
+            promoteQueue_.push_back(i);
+            slowHits_.erase(i);
+        }
+    }
+    if (slowHits_.size() > kMaxTrackedUnits) {
+        decayHits();
+    }
+    if (promoteQueue_.empty() || promoting_ || closing_) {
+        return;
+    }
+    promoting_ = true;
+    photon::thread_create11(&TieredCacheStore::promoteWorker, this);
+}
+
+void TieredCacheStore::decayHits() {
+    for (auto it = slowHits_.begin(); it != slowHits_.end();) {
+        it->second >>= 1;
+        if (it->second == 0) {
+            it = slowHits_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void TieredCacheStore::promoteWorker() {
+    DEFER({
+        promoteQueue_.clear();
+        promoting_ = false;
+        promoteDone_.notify_all();
+    });
+    auto unit = tieredPool_->refillUnit_;
+    void *buf = nullptr;
+    if (posix_memalign(&buf, 4096, unit) != 0) {
+        return;
+    }
+    DEFER(free(buf));
+    while (!promoteQueue_.empty() && !closing_) {
+        off_t off = promoteQueue_.front() * unit;
+        promoteQueue_.pop_front();
+        if (off >= size_ || is_resident(fast_->queryRefillRange(off, 1))) {
+            continue;
+        }
+        auto len = std::min(unit, static_cast<uint64_t>(size_ - off));
+        // fast tier may be full, it's fine to stay in slow tier
+        if (slow_->pread(buf, len, off) != static_cast<ssize_t>(len) ||
+            fast_->pwrite(buf, len, off) != static_cast<ssize_t>(len)) {
+            continue;
+        }
+        tieredPool_->addPromote(len);
+    }
+}
+
+ssize_t TieredCacheStore::pwritev(const struct iovec *iov, int iovcnt, off_t offset) {
+    return slow_->pwritev(iov, iovcnt, offset);
+}
+
+int TieredCacheStore::stat(CacheStat *stat) {
+    CacheStat fast;
+    if (slow_->stat(stat) || fast_->stat(&fast)) {
+        return -1;
+    }
+    stat->used_size = std::max(stat->used_size, fast.used_size);
+    stat->hit_bytes += fast.hit_bytes;
+    stat->miss_bytes += fast.miss_bytes;
+    return 0;
+}
+
+int TieredCacheStore::evict(off_t offset, size_t count) {
+    auto rf = fast_->evict(offset, count);
+    auto rs = slow_->evict(offset, count);
+    return (rf || rs) ? -1 : 0;
+}
+
+int TieredCacheStore::ftruncate(off_t length) {
+    size_ = length;
+    if (fast_->ftruncate(length) || slow_->ftruncate(length)) {
+        return -1;
+    }
+    return 0;
+}
+
+std::pair<off_t, size_t> TieredCacheStore::queryRefillRange(off_t offset, size_t size) {
+    auto q = fast_->queryRefillRange(offset, size);
+    if (is_resident(q)) {
+        return q;
+    }
+    return slow_->queryRefillRange(offset, size);
+}
+
+int TieredCacheStore::fstat(struct stat *buf) {
+    return slow_->fstat(buf);
+}
+
+} //  namespace Cache
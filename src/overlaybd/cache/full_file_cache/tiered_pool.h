@@ -0,0 +1,132 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <deque>
+#include <unordered_map>
+#include <photon/thread/thread.h>
+#include "cache_pool.h"
+
+namespace Cache {
+
+class TieredCachePool;
+
+// The upper tier of a TieredCachePool, whose evicted files are demoted
+// into the lower tier instead of being dropped.
+class FastTierPool : public FileCachePool {
+public:
+    using FileCachePool::FileCachePool;
+
+    void setLowerTier(TieredCachePool *tiered) {
+        tiered_ = tiered;
+    }
+
+protected:
+    void beforeEvict(FileNameMap::iterator iter) override;
+
+    TieredCachePool *tiered_ = nullptr;
+};
+
+// A stack of two cache pools: a small fast tier over a large slow tier.
+// Refills always land in the slow tier. A refill unit is promoted to the
+// fast tier after it has been read `promoteHits` times from the slow tier,
+// by a background thread of the file, off the read path. A file evicted from
+// the fast tier is demoted back to the slow tier.
+// Deeper hierarchies are built by using a TieredCachePool as the slow tier.
+class TieredCachePool : public FileSystem::ICachePool {
+public:
+    // both tiers are owned by the TieredCachePool
+    TieredCachePool(FastTierPool *fast, FileSystem::ICachePool *slow, uint64_t refillUnit,
+                    uint32_t promoteHits, Fn_trans_func name_trans = nullptr);
+    ~TieredCachePool();
+
+    FileSystem::ICacheStore *do_open(std::string_view pathname, int flags, mode_t mode) override;
+
+    int stat(FileSystem::CacheStat *stat,
+             std::string_view pathname = std::string_view(nullptr, 0)) override;
+
+    int evict(std::string_view filename) override;
+    int evict(size_t size = 0) override;
+
+    // copy the content of `name` resident in fast tier but not in slow tier
+    void demote(std::string_view name);
+
+    void addHit(uint64_t bytes) {
+        hitBytes_ += bytes;
+    }
+    void addMiss(uint64_t bytes) {
+        missBytes_ += bytes;
+    }
+    void addPromote(uint64_t bytes) {
+        promoteBytes_ += bytes;
+    }
+
+protected:
+    friend class TieredCacheStore;
+
+    FastTierPool *fast_;
+    FileSystem::ICachePool *slow_;
+    uint64_t refillUnit_;
+    uint32_t promoteHits_;
+    Fn_trans_func file_name_trans = &same_name_trans;
+    bool demoteEnabled_ = true;
+    uint64_t hitBytes_ = 0;
+    uint64_t missBytes_ = 0;
+    uint64_t promoteBytes_ = 0;
+    uint64_t demoteBytes_ = 0;
+};
+
+class TieredCacheStore : public FileSystem::ICacheStore {
+public:
+    TieredCacheStore(TieredCachePool *pool, FileSystem::ICacheStore *fast,
+                     FileSystem::ICacheStore *slow)
+        : tieredPool_(pool), fast_(fast), slow_(slow) {
+    }
+    ~TieredCacheStore();
+
+    try_preadv_result try_preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
+    ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override;
+
+    int stat(FileSystem::CacheStat *stat) override;
+    int evict(off_t offset, size_t count = -1) override;
+    int ftruncate(off_t length) override;
+
+    std::pair<off_t, size_t> queryRefillRange(off_t offset, size_t size) override;
+
+    int fstat(struct stat *buf) override;
+
+protected:
+    void promote(off_t offset, size_t size);
+    void promoteWorker();
+    void decayHits();
+
+    TieredCachePool *tieredPool_;
+    FileSystem::ICacheStore *fast_;
+    FileSystem::ICacheStore *slow_;
+    off_t size_ = 0;
+    // refill unit index -> # of reads served by slow tier, halved once
+    // too many units are tracked
+    std::unordered_map<uint64_t, uint32_t> slowHits_;
+    // refill units waiting for promotion
+    std::deque<uint64_t> promoteQueue_;
+    bool promoting_ = false;
+    bool closing_ = false;
+    photon::condition_variable promoteDone_;
+};
+
+} //  namespace Cache
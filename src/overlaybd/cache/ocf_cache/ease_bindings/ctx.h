@@ -1,7 +1,9 @@
 #pragma once
 
 #include <sys/uio.h>
+#include <atomic>
 #include <string>
+#include <vector>
 
 #include <photon/thread/thread.h>
 #include <photon/fs/filesystem.h>
@@ -70,7 +72,17 @@ struct ease_ocf_config {
 
 struct ease_ocf_queue {
     ocf_queue_t mngt_queue;
-    ocf_queue_t io_queue;
+    std::vector<ocf_queue_t> io_queues;
+    std::atomic<uint32_t> next_io_queue{0};
+
+    /* Spread submissions over io queues. Completions are signaled back to the
+     * submitter by photon::semaphore, which is safe across vCPUs */
+    ocf_queue_t pick_io_queue() {
+        if (io_queues.size() == 1) {
+            return io_queues[0];
+        }
+        return io_queues[next_io_queue.fetch_add(1, std::memory_order_relaxed) % io_queues.size()];
+    }
 };
 
 /* Context config */
@@ -109,14 +109,17 @@ int ease_ocf_provider::start(bool reload_media) {
     }
     ocf_mngt_cache_set_mngt_queue(m_cache, m_queue->mngt_queue);
 
-    /* Create IO submission queue */
-    ret = ocf_queue_create(m_cache, &m_queue->io_queue, get_queue_ops());
-    if (ret != 0) {
-        LOG_ERROR("OCF: failed to create io queue");
-        return ret;
+    /* Create IO submission queues */
+    m_queue->io_queues.resize(m_io_queue_num);
+    for (auto &io_queue : m_queue->io_queues) {
+        ret = ocf_queue_create(m_cache, &io_queue, get_queue_ops());
+        if (ret != 0) {
+            LOG_ERROR("OCF: failed to create io queue");
+            return ret;
+        }
     }
 
-    init_queues(m_queue->mngt_queue, m_queue->io_queue);
+    init_queues(m_queue->mngt_queue, m_queue->io_queues);
 
     if (reload_media) {
         /* Reload cache instance */
@@ -153,8 +156,8 @@ int ease_ocf_provider::start(bool reload_media) {
         }
     }
     m_volume_params->enable_logging = true;
-    LOG_INFO("OCF: OCF cache is ready, blk_size `, prefetch_unit `", m_volume_params->blk_size,
-             m_prefetch_unit);
+    LOG_INFO("OCF: OCF cache is ready, blk_size `, prefetch_unit `, io_queues `",
+             m_volume_params->blk_size, m_prefetch_unit, m_io_queue_num);
     return 0;
 }
 
@@ -297,8 +300,9 @@ ssize_t ease_ocf_provider::ocf_pread(void *buf, size_t count, off_t offset, size
     ease_ocf_io_data data(iov.iovec(), iov.iovcnt(), iov.sum(), blk_addr, ctx, prefetch);
 
     /* Create io */
-    ocf_io *io = ocf_core_new_io(m_core, m_queue->io_queue, data.blk_addr + align.lower_bound,
-                                 (uint32_t)iov.sum(), OCF_READ, 0, 0);
+    ocf_io *io = ocf_core_new_io(m_core, m_queue->pick_io_queue(),
+                                 data.blk_addr + align.lower_bound, (uint32_t)iov.sum(), OCF_READ,
+                                 0, 0);
     if (io == nullptr) {
         LOG_ERRNO_RETURN(ENOMEM, -1, "OCF: failed to create new IO, count `, offset `, blk_addr `",
                          iov.sum(), align.lower_bound, blk_addr);
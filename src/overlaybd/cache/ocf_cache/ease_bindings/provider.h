@@ -9,8 +9,9 @@
 
 class ease_ocf_provider {
 public:
-    ease_ocf_provider(ease_ocf_volume_params *params, size_t prefetch_unit)
-        : m_volume_params(params), m_prefetch_unit(prefetch_unit) {
+    ease_ocf_provider(ease_ocf_volume_params *params, size_t prefetch_unit, int io_queues = 1)
+        : m_volume_params(params), m_prefetch_unit(prefetch_unit),
+          m_io_queue_num(io_queues > 0 ? io_queues : 1) {
     }
 
     int start(bool reload_media);
@@ -28,6 +29,10 @@ public:
         return m_prefetch_unit;
     }
 
+    int io_queue_num() const {
+        return m_io_queue_num;
+    }
+
     static const size_t SectorSize;
 
 private:
@@ -54,6 +59,8 @@ private:
 
     size_t m_prefetch_unit;
 
+    int m_io_queue_num;
+
     /*
      *       |                       |                       |                       |
      *       |                       |                       |                       |
@@ -1,9 +1,13 @@
 #include "queue.h"
 
+#include <algorithm>
 #include <photon/thread/thread-pool.h>
 #include <photon/thread/workerpool.h>
 #include <photon/photon.h>
 
+/* vCPUs serving all io queues */
+static const size_t IO_QUEUE_VCPUS = 4;
+
 static void *run(void *args) {
     auto queue = (ocf_queue_t)args;
     ocf_queue_run(queue);
@@ -37,12 +41,20 @@ private:
     photon::WorkPool* work_pool = nullptr;
 };
 
-int init_queues(ocf_queue_t mngt_queue, ocf_queue_t io_queue) {
+int init_queues(ocf_queue_t mngt_queue, const std::vector<ocf_queue_t> &io_queues) {
     auto mngt_queue_kicker = new QueueKicker(mngt_queue, 2, 0, 0, 64);
-    auto io_queue_kicker = new QueueKicker(io_queue, 4, photon::INIT_EVENT_EPOLL, photon::INIT_IO_LIBCURL, 64);
-
     ocf_queue_set_priv(mngt_queue, mngt_queue_kicker);
-    ocf_queue_set_priv(io_queue, io_queue_kicker);
+
+    /* Split the same vCPU budget over io queues whatever their number, so that
+     * configurations differ only in how submissions are spread. Every queue
+     * needs a vCPU of its own, so the budget is exceeded beyond it */
+    size_t n = io_queues.size();
+    for (size_t i = 0; i < n; i++) {
+        size_t vcpu_num = std::max<size_t>(1, IO_QUEUE_VCPUS / n + (i < IO_QUEUE_VCPUS % n));
+        auto io_queue_kicker = new QueueKicker(io_queues[i], vcpu_num, photon::INIT_EVENT_EPOLL,
+                                               photon::INIT_IO_LIBCURL, 64);
+        ocf_queue_set_priv(io_queues[i], io_queue_kicker);
+    }
     return 0;
 }
 
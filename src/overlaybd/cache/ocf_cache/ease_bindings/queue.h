@@ -1,9 +1,15 @@
 #pragma once
 
+#include <vector>
+
 extern "C" {
 #include <ocf/ocf.h>
 }
 
-int init_queues(ocf_queue_t mngt_queue, ocf_queue_t io_queue);
+/*
+ * A single io queue is served by a shared pool of vCPUs. With multiple io queues,
+ * every queue is served by its own vCPU, so that they could run in parallel.
+ */
+int init_queues(ocf_queue_t mngt_queue, const std::vector<ocf_queue_t> &io_queues);
 
 const ocf_queue_ops *get_queue_ops();
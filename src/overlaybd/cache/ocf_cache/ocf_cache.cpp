@@ -112,7 +112,7 @@ private:
 class OcfCachedFs : public IFileSystem {
 public:
     OcfCachedFs(IFileSystem *src_fs, size_t prefetch_unit, OcfNamespace *ocf_ns,
-                IFile *media_file, bool reload_media, IOAlloc *io_alloc);
+                IFile *media_file, bool reload_media, IOAlloc *io_alloc, int io_queues);
 
     ~OcfCachedFs();
 
@@ -165,6 +165,7 @@ private:
     IFile *m_media_file; // owned by external class
     bool m_reload_media;
     IOAlloc *m_io_alloc; // owned by external class
+    int m_io_queues;
 
     ObjectCache<std::string, OcfSrcFileCtx *> m_src_file_pool;
 
@@ -202,9 +203,10 @@ int OcfCachedFile::fadvise(off_t offset, off_t len, int advice) {
 
 OcfCachedFs::OcfCachedFs(IFileSystem *src_fs, size_t prefetch_unit,
                          OcfNamespace *ocf_ns, IFile *media_file, bool reload_media,
-                         IOAlloc *io_alloc)
+                         IOAlloc *io_alloc, int io_queues)
     : m_src_fs(src_fs), m_prefetch_unit(prefetch_unit), m_ocf_ns(ocf_ns), m_media_file(media_file),
-      m_reload_media(reload_media), m_io_alloc(io_alloc), m_src_file_pool(1 * 1000 * 1000) {
+      m_reload_media(reload_media), m_io_alloc(io_alloc), m_io_queues(io_queues),
+      m_src_file_pool(1 * 1000 * 1000) {
 }
 
 OcfCachedFs::~OcfCachedFs() {
@@ -227,7 +229,7 @@ int OcfCachedFs::init() {
     size_t media_size = buf.st_size;
     m_volume_params =
         new ease_ocf_volume_params{m_ocf_ns->block_size(), media_size, m_media_file, false};
-    m_provider = new ease_ocf_provider(m_volume_params, m_prefetch_unit);
+    m_provider = new ease_ocf_provider(m_volume_params, m_prefetch_unit, m_io_queues);
 
     return m_provider->start(m_reload_media);
 }
@@ -276,15 +278,15 @@ namespace FileSystem {
 
 IFileSystem *new_ocf_cached_fs(IFileSystem *src_fs, IFileSystem *namespace_fs, size_t blk_size,
                                size_t prefetch_unit, IFile *media_file, bool reload_media,
-                               IOAlloc *io_alloc) {
+                               IOAlloc *io_alloc, int io_queues) {
     auto ocf_ns = new_ocf_namespace_on_fs(blk_size, namespace_fs);
     if (ocf_ns->init() != 0) {
         delete ocf_ns;
         LOG_ERROR_RETURN(0, nullptr, "OCF: init namespace failed");
     }
 
-    auto fs =
-        new Cache::OcfCachedFs(src_fs, prefetch_unit, ocf_ns, media_file, reload_media, io_alloc);
+    auto fs = new Cache::OcfCachedFs(src_fs, prefetch_unit, ocf_ns, media_file, reload_media,
+                                     io_alloc, io_queues);
     if (fs->init() != 0) {
         delete fs;
         LOG_ERROR_RETURN(0, nullptr, "OCF: init cache fs failed");
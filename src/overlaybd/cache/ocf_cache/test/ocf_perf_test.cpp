@@ -1,5 +1,6 @@
 #include <fcntl.h>
 #include <unistd.h>
+#include <algorithm>
 #include <ctime>
 #include <vector>
 
@@ -25,6 +26,13 @@ DEFINE_uint64(media_file_size_gb, 1, "media file size in gb");
 DEFINE_int64(io_engine, 0, "0: psync, 1: libaio, 3: iouring");
 DEFINE_uint64(concurrency, 16, "read concurrency");
 DEFINE_uint64(ocf_prefetch_unit, 0, "prefetch unit in bytes");
+DEFINE_uint64(ocf_io_queues, 1, "num of ocf io queues, or the max one in queue scaling test");
+
+// Queue scaling test params
+DEFINE_bool(queue_scaling, false,
+            "run single file ocf test with 1, 2, 4 ... ocf_io_queues io queues in turn, "
+            "sharing the same vCPUs up to 4 queues");
+DEFINE_uint64(scaling_seconds, 10, "duration of each round in queue scaling test");
 
 // Single file test params
 DEFINE_bool(random_read, true, "random read or sequential read");
@@ -55,7 +63,8 @@ static void handle_qps() {
         photon::thread_yield();
     }
     ++qps;
-    if (FLAGS_total_requests != 0 && ++total_req >= FLAGS_total_requests) {
+    ++total_req;
+    if (FLAGS_total_requests != 0 && total_req >= FLAGS_total_requests) {
         stop_test = true;
     }
 }
@@ -171,8 +180,8 @@ static int work(T *cache_file, IOAlloc *io_alloc) {
 }
 
 static int single_file_ocf_cache(IOAlloc *io_alloc, photon::fs::IFileSystem *src_fs,
-                                 const std::string &root_dir) {
-    LOG_INFO("Start single file ocf cache test");
+                                 const std::string &root_dir, int io_queues) {
+    LOG_INFO("Start single file ocf cache test, io_queues `", io_queues);
     auto namespace_dir = root_dir + "/namespace/";
     if (::access(namespace_dir.c_str(), F_OK) != 0 && ::mkdir(namespace_dir.c_str(), 0755) != 0) {
         LOG_ERRNO_RETURN(0, -1, "failed to create namespace_dir");
@@ -197,9 +206,9 @@ static int single_file_ocf_cache(IOAlloc *io_alloc, photon::fs::IFileSystem *src
     }
     DEFER(delete media_file);
 
-    auto ocf_cached_fs =
-        FileSystem::new_ocf_cached_fs(src_fs, namespace_fs, FLAGS_page_size,
-                                      FLAGS_ocf_prefetch_unit, media_file, reload_media, io_alloc);
+    auto ocf_cached_fs = FileSystem::new_ocf_cached_fs(src_fs, namespace_fs, FLAGS_page_size,
+                                                       FLAGS_ocf_prefetch_unit, media_file,
+                                                       reload_media, io_alloc, io_queues);
     if (ocf_cached_fs == nullptr) {
         LOG_ERROR_RETURN(0, -1, "new_ocf_cached_fs error");
     }
@@ -263,7 +272,7 @@ static int single_file_test(IOAlloc *io_alloc) {
     int ret = 0;
 
     if (FLAGS_cache_type == "ocf") {
-        ret = single_file_ocf_cache(io_alloc, src_fs, root_dir);
+        ret = single_file_ocf_cache(io_alloc, src_fs, root_dir, FLAGS_ocf_io_queues);
     } else if (FLAGS_cache_type == "file") {
         ret = single_file_file_cache(io_alloc, src_fs, root_dir);
     }
@@ -274,6 +283,66 @@ static int single_file_test(IOAlloc *io_alloc) {
     return 0;
 }
 
+/* Queue scaling test */
+
+static void stop_after(uint64_t seconds) {
+    for (uint64_t i = 0; i < seconds && !stop_test; i++) {
+        photon::thread_sleep(1);
+    }
+    stop_test = true;
+}
+
+// 1, 2, 4 ... and ocf_io_queues at last
+static uint64_t next_queue_num(uint64_t n) {
+    if (n < FLAGS_ocf_io_queues && n * 2 > FLAGS_ocf_io_queues) {
+        return FLAGS_ocf_io_queues;
+    }
+    return n * 2;
+}
+
+static int queue_scaling_test(IOAlloc *io_alloc) {
+    if (FLAGS_cache_type != "ocf" || !FLAGS_dst_file.empty()) {
+        LOG_ERROR_RETURN(0, -1, "Queue scaling test only runs ocf cache without dst file");
+    }
+    auto root_dir = FLAGS_media_file.substr(0, FLAGS_media_file.rfind('/') + 1);
+
+    auto src_fs = photon::fs::new_localfs_adaptor("/", FLAGS_io_engine);
+    if (src_fs == nullptr) {
+        LOG_ERROR_RETURN(0, -1, "failed to create fs");
+    }
+    DEFER(delete src_fs);
+
+    // The first round also warms up the media, so that later rounds are comparable
+    std::vector<std::pair<uint64_t, double>> results;
+    for (uint64_t n = 1; n <= FLAGS_ocf_io_queues; n = next_queue_num(n)) {
+        stop_test = false;
+        qps = last_qps = 0;
+        total_req = 0;
+        auto qps_th = photon::thread_create11(show_qps_loop);
+        auto qps_join_hdl = photon::thread_enable_join(qps_th);
+        auto timer_th = photon::thread_create11(stop_after, FLAGS_scaling_seconds);
+        auto timer_join_hdl = photon::thread_enable_join(timer_th);
+
+        auto start = photon::now;
+        auto ret = single_file_ocf_cache(io_alloc, src_fs, root_dir, n);
+        auto elapsed = photon::now - start;
+        stop_test = true;
+        photon::thread_join(timer_join_hdl);
+        photon::thread_join(qps_join_hdl);
+        if (ret != 0) {
+            return -1;
+        }
+        results.emplace_back(n, total_req * 1000.0 * 1000 / std::max(elapsed, 1UL));
+        LOG_INFO("io_queues `, avg qps `", n, results.back().second);
+    }
+
+    for (auto &r : results) {
+        LOG_INFO("io_queues `, avg qps `, speedup `", r.first, r.second,
+                 r.second / std::max(results[0].second, 1.0));
+    }
+    return 0;
+}
+
 /* Multiple files test */
 
 struct fill_data_args {
@@ -426,9 +495,9 @@ static int multiple_files_test(IOAlloc *io_alloc) {
     }
     DEFER(delete media_file);
 
-    auto ocf_fs =
-        FileSystem::new_ocf_cached_fs(src_fs, namespace_fs, FLAGS_page_size,
-                                      FLAGS_ocf_prefetch_unit, media_file, reload_media, io_alloc);
+    auto ocf_fs = FileSystem::new_ocf_cached_fs(src_fs, namespace_fs, FLAGS_page_size,
+                                                FLAGS_ocf_prefetch_unit, media_file, reload_media,
+                                                io_alloc, FLAGS_ocf_io_queues);
     if (ocf_fs == nullptr) {
         LOG_ERROR_RETURN(0, -1, "error create ocf_fs");
     }
@@ -498,7 +567,9 @@ photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
     DEFER(delete pooled_allocator);
     IOAlloc io_alloc = pooled_allocator->get_io_alloc();
 
-    if (!FLAGS_multi_files_test) {
+    if (FLAGS_queue_scaling) {
+        queue_scaling_test(&io_alloc);
+    } else if (!FLAGS_multi_files_test) {
         single_file_test(&io_alloc);
     } else {
         multiple_files_test(&io_alloc);
@@ -31,9 +31,14 @@ namespace FileSystem {
 class ICacheStore;
 struct CacheStat {
     uint32_t struct_size = sizeof(CacheStat);
-    uint32_t refill_unit; // in bytes
-    uint32_t total_size;  // in refill_unit
-    uint32_t used_size;   // in refill_unit
+    uint32_t refill_unit = 0;  // in bytes
+    uint32_t total_size = 0;   // in refill_unit
+    uint32_t used_size = 0;    // in refill_unit
+    uint64_t hit_bytes = 0;    // bytes served from media
+    uint64_t miss_bytes = 0;   // bytes requested but not resident in media
+    uint64_t refill_count = 0; // # of refills written to media
+    uint64_t refill_bytes = 0; // bytes written to media by refills
+    uint64_t dedup_bytes = 0;  // logical bytes saved by sharing identical chunks
 };
 
 class ICachePool : public Object {
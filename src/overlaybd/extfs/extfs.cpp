@@ -14,6 +14,7 @@
    limitations under the License.
 */
 
+#include <algorithm>
 #include <utime.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -45,11 +46,11 @@
 static uint64_t total_read_cnt = 0;
 static uint64_t total_write_cnt = 0;
 
-ext2_filsys do_ext2fs_open(io_manager extfs_manager) {
+ext2_filsys do_ext2fs_open(io_manager extfs_manager, bool read_only) {
     ext2_filsys fs;
     errcode_t ret = ext2fs_open(
         "extfs",
-        EXT2_FLAG_RW,         // flags
+        read_only ? 0 : EXT2_FLAG_RW, // flags
         0,                    // superblock
         DEFAULT_BLOCK_SIZE,   // block_size
         extfs_manager,        // io manager
@@ -992,9 +993,15 @@ int do_ext2fs_fiemap(ext2_filsys fs, ext2_ino_t ino, struct photon::fs::fiemap*
     std::vector<std::pair<off_t, size_t>> blocks;
     errcode_t ret = ino_iter_blocks(fs, ino, blocks);
     if (ret) return parse_extfs_error(fs, ino, ret);
-    map->fm_mapped_extents = blocks.size();
+    // like the ioctl, only the first fm_extent_count extents are returned,
+    // and a count of 0 queries the number of extents
+    if (map->fm_extent_count == 0) {
+        map->fm_mapped_extents = blocks.size();
+        return 0;
+    }
+    map->fm_mapped_extents = std::min(blocks.size(), (size_t)map->fm_extent_count);
     photon::fs::fiemap_extent *ext_buf = &map->fm_extents[0];
-    for (uint32_t i = 0; i < blocks.size(); i++) {
+    for (uint32_t i = 0; i < map->fm_mapped_extents; i++) {
         LOG_DEBUG("find block ` `", blocks[i].first * fs->blocksize, blocks[i].second * fs->blocksize);
         ext_buf[i].fe_physical = blocks[i].first * fs->blocksize;
         ext_buf[i].fe_length = blocks[i].second * fs->blocksize;
@@ -1132,23 +1139,28 @@ class ExtFileSystem : public photon::fs::IFileSystem {
 public:
     ext2_filsys fs;
     IOManager *extfs_manager = nullptr;
-    ExtFileSystem(photon::fs::IFile *_image_file, bool buffer = true) : ino_cache(kMinimalInoLife) {
+    ExtFileSystem(photon::fs::IFile *_image_file, bool buffer = true, bool read_only = false)
+        : ino_cache(kMinimalInoLife) {
         if (buffer) {
             buffer_file = new_buffer_file(_image_file);
             extfs_manager = new_io_manager(buffer_file);
         } else {
             extfs_manager = new_io_manager(_image_file);
         }
-        fs = do_ext2fs_open(extfs_manager->get_io_manager());
+        fs = do_ext2fs_open(extfs_manager->get_io_manager(), read_only);
+        if (fs == nullptr)
+            return;
         memset(fs->reserved, 0, sizeof(fs->reserved));
         auto reserved = reinterpret_cast<std::uintptr_t *>(fs->reserved);
         reserved[0] = reinterpret_cast<std::uintptr_t>(this);
     }
     ~ExtFileSystem() {
         if (fs) {
-            ext2fs_flush(fs);
+            // nothing to write back to an image opened read-only
+            if (fs->flags & EXT2_FLAG_RW)
+                ext2fs_flush(fs);
             ext2fs_close(fs);
-            LOG_INFO("ext2fs flushed and closed");
+            LOG_INFO("ext2fs closed");
         }
         delete extfs_manager;
         delete buffer_file;
@@ -1320,9 +1332,13 @@ int ExtFile::flush_buffer() {
     return m_fs->flush_buffer();
 }
 
-photon::fs::IFileSystem *new_extfs(photon::fs::IFile *file, bool buffer) {
-    auto extfs = new ExtFileSystem(file, buffer);
-    return extfs->fs ? extfs : nullptr;
+photon::fs::IFileSystem *new_extfs(photon::fs::IFile *file, bool buffer, bool read_only) {
+    auto extfs = new ExtFileSystem(file, buffer, read_only);
+    if (extfs->fs == nullptr) {
+        delete extfs;
+        return nullptr;
+    }
+    return extfs;
 }
 
 ext2_ino_t string_to_inode(ext2_filsys fs, const char *str, int follow, bool release) {
@@ -27,7 +27,9 @@ public:
 };
 
 IOManager *new_io_manager(photon::fs::IFile *file);
-photon::fs::IFileSystem *new_extfs(photon::fs::IFile *file, bool buffer = true);
+// `read_only` opens without EXT2_FLAG_RW, nothing is written back to `file`
+photon::fs::IFileSystem *new_extfs(photon::fs::IFile *file, bool buffer = true,
+                                   bool read_only = false);
 
 // make extfs on an prezeroed IFile,
 // should be truncated to specified size in advance
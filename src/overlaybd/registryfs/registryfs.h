@@ -15,14 +15,61 @@
 */
 
 #pragma once
+#include <errno.h>
 #include <stdint.h>
 #include <string>
 #include <photon/common/callback.h>
 #include <photon/fs/filesystem.h>
 
+struct RegistryRetryPolicy {
+    // backoff before the n-th retry is drawn from [cap / 2, cap],
+    // cap = min(backoff_base_us * 2^n, backoff_max_us)
+    uint64_t backoff_base_us = 1000;
+    uint64_t backoff_max_us = 1000000;
+    // retries allowed in percent of successful requests, shared by all reads
+    uint32_t budget_percent = 10;
+    // consecutive failures of a host to open its circuit, 0 to disable
+    uint32_t breaker_failures = 5;
+    // the first cooldown of an open circuit, doubled on each failed probe
+    uint64_t breaker_cooldown_us = 1000000;
+};
+
 class RegistryFS : public photon::fs::IFileSystem {
 public:
     virtual int setAccelerateAddress(const char* addr = "") = 0;
+
+    // split reads larger than `split_size` into range requests issued
+    // `concurrency` at a time, 0 to disable
+    virtual int setRangeSplit(size_t split_size, int concurrency) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // merge reads of a blob arriving within `window_us`, no farther apart than
+    // `gap`, into one range request of at most `max_size`, 0 window to disable
+    virtual int setRangeCoalesce(uint64_t window_us, size_t gap, size_t max_size) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // send a duplicate range request if there's no response within the
+    // `percentile` of recent response latencies, at least `min_delay_us`,
+    // 0 percentile to disable
+    virtual int setHedge(uint32_t percentile, uint64_t min_delay_us) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    virtual int setRetryPolicy(const RegistryRetryPolicy &policy) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // # of hedged requests sent, and # of them finished before the original
+    virtual int getHedgeStat(uint64_t &hedged, uint64_t &wins) {
+        errno = ENOSYS;
+        return -1;
+    }
 };
 
 using PasswordCB = Delegate<std::pair<std::string, std::string>, const char *>;
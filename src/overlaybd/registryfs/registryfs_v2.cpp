@@ -19,6 +19,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <time.h>
+
+#include <algorithm>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <unordered_map>
@@ -36,6 +40,9 @@
 #include <photon/fs/virtual-file.h>
 #include <photon/net/http/client.h>
 #include <photon/net/utils.h>
+#include <photon/thread/thread.h>
+#include <photon/thread/thread11.h>
+#include <photon/thread/workerpool.h>
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
@@ -50,6 +57,13 @@ static const estring kAuthHeaderKey = "Authorization";
 static const estring kBearerAuthPrefix = "Bearer ";
 static const uint64_t kMinimalTokenLife = 30L * 1000 * 1000; // token lives atleast 30s
 static const uint64_t kMinimalAUrlLife = 300L * 1000 * 1000; // actual_url lives atleast 300s
+static const uint64_t kMaxAUrlRefreshAhead = 60L * 1000 * 1000; // refresh actual_url before expiry
+static const uint64_t kAUrlRefreshInterval = 1000L * 1000;     // check for refresh every 1s
+static const size_t kHedgeSamples = 256;     // response latencies kept for hedge delay
+static const size_t kHedgeMinSamples = 32;   // no hedging before enough samples
+static const size_t kHedgeUpdateEvery = 16;  // re-evaluate hedge delay every # samples
+static const double kRetryBudgetMax = 100;   // retries available in a burst
+static const uint64_t kMaxBreakerCooldown = 30UL * 1000 * 1000; // circuit stays open at most 30s
 static const uint64_t kMinimalMetaLife = 300L * 1000 * 1000; // actual_url lives atleast 300s
 
 using HTTP_OP = photon::net::http::Client::OperationOnStack<64 * 1024 - 1>;
@@ -77,6 +91,100 @@ enum class UrlMode {
 struct UrlInfo {
     UrlMode mode;
     estring info;
+    uint64_t lifetime = kMinimalAUrlLife;
+};
+
+// remaining life of a signed url, by `Expires=<unix time>` or by `X-Amz-Date`
+// and `X-Amz-Expires`, or `max_life` if it's not signed with an expiry
+static uint64_t signed_url_life(estring_view url, uint64_t max_life) {
+    auto pos = url.find('?');
+    if (pos == estring_view::npos)
+        return max_life;
+    int64_t expires = -1, amz_expires = -1;
+    time_t amz_date = -1;
+    for (auto kv : url.substr(pos + 1).split('&')) {
+        auto eq = kv.find('=');
+        if (eq == estring_view::npos)
+            continue;
+        auto key = kv.substr(0, eq);
+        auto val = std::string(kv.substr(eq + 1));
+        if (key == "Expires" || key == "expires") {
+            expires = strtoll(val.c_str(), nullptr, 10);
+        } else if (key == "X-Amz-Expires") {
+            amz_expires = strtoll(val.c_str(), nullptr, 10);
+        } else if (key == "X-Amz-Date") {
+            struct tm tm = {};
+            if (strptime(val.c_str(), "%Y%m%dT%H%M%SZ", &tm) != nullptr)
+                amz_date = timegm(&tm);
+        }
+    }
+    if (expires < 0 && amz_date >= 0 && amz_expires >= 0)
+        expires = amz_date + amz_expires;
+    if (expires < 0)
+        return max_life;
+    auto left = expires - (int64_t)time(nullptr);
+    if (left <= 0)
+        return 0;
+    return std::min(max_life, (uint64_t)left * 1000 * 1000);
+}
+
+static estring_view url_host(estring_view url) {
+    auto pos = url.find("://");
+    if (pos != estring_view::npos)
+        url = url.substr(pos + 3);
+    return url.substr(0, url.find('/'));
+}
+
+// requests to a host fail fast while its circuit is open, after `failures`
+// consecutive failures, then a single probe is let through after cooldown
+struct HostCircuit {
+    uint32_t failures = 0;
+    uint64_t open_until = 0;
+    uint64_t cooldown = 0;
+    bool probing = false;
+};
+
+// a resolved actual url, refreshed in background shortly before expiry while
+// it's in use, so that reads don't pay for the redirect probe and token
+struct UrlEntry {
+    std::shared_ptr<UrlInfo> info;
+    uint64_t expire = 0;
+    uint64_t last_used = 0;
+    bool loading = false;
+};
+
+// a reader waiting for a coalesced range request
+struct CoalescedReader {
+    const struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+    size_t count;
+    ssize_t ret = -1;
+    int eno = 0;
+    photon::semaphore done;
+
+    CoalescedReader(const struct iovec *iov, int iovcnt, off_t offset, size_t count)
+        : iov(iov), iovcnt(iovcnt), offset(offset), count(count) {
+    }
+};
+
+// pending range request of a blob, extended by readers joining in the window
+struct CoalescedRange {
+    off_t start, end;
+    std::vector<CoalescedReader *> readers;
+
+    bool can_merge(off_t offset, size_t count, size_t gap, size_t max_size) const {
+        off_t new_start = std::min(start, offset);
+        off_t new_end = std::max(end, (off_t)(offset + count));
+        return offset <= end + (off_t)gap && (off_t)(offset + count + gap) >= start &&
+               (size_t)(new_end - new_start) <= max_size;
+    }
+
+    void add(CoalescedReader *reader) {
+        start = std::min(start, reader->offset);
+        end = std::max(end, (off_t)(reader->offset + reader->count));
+        readers.push_back(reader);
+    }
 };
 
 class RegistryFSImpl_v2 : public RegistryFS {
@@ -112,21 +220,121 @@ public:
 
     RegistryFSImpl_v2(PasswordCB callback, const char *caFile, uint64_t timeout)
         : m_callback(callback), m_caFile(caFile), m_timeout(timeout),
-          m_meta_size(kMinimalMetaLife), m_scope_token(kMinimalTokenLife),
-          m_url_info(kMinimalAUrlLife) {
+          m_meta_size(kMinimalMetaLife), m_scope_token(kMinimalTokenLife) {
         m_client = new_http_client();
+        m_refresh_th = photon::thread_enable_join(
+            photon::thread_create11(&RegistryFSImpl_v2::refresh_url_info, this));
     }
 
     ~RegistryFSImpl_v2() {
+        m_stopping = true;
+        m_refresh_cond.notify_all();
+        photon::thread_join(m_refresh_th);
         delete m_client;
     }
 
-    long get_data(const estring &url, off_t offset, size_t count, uint64_t timeout, HTTP_OP &op) {
+    // resolve the actual url, an entry is used until it expires, even if
+    // a background refresh is in flight
+    std::shared_ptr<UrlInfo> acquire_url_info(const estring &url, uint64_t timeout, long &code) {
+        Timeout tmo(timeout);
+        photon::scoped_lock lock(m_url_mutex);
+        while (true) {
+            auto &entry = m_url_entries[url];
+            if (entry.info && photon::now < entry.expire) {
+                entry.last_used = photon::now;
+                return entry.info;
+            }
+            if (!entry.loading)
+                break;
+            if (m_url_cond.wait(lock, tmo.timeout()) < 0)
+                LOG_ERROR_RETURN(ETIMEDOUT, nullptr, "timed out waiting for actual url ", VALUE(url));
+        }
+        m_url_entries[url].loading = true;
+        lock.unlock();
+        std::shared_ptr<UrlInfo> info(resolve_url(url, tmo.timeout(), code));
+        lock.lock();
+        auto &entry = m_url_entries[url];
+        entry.loading = false;
+        if (info) {
+            entry.info = info;
+            entry.expire = photon::now + info->lifetime;
+            entry.last_used = photon::now;
+        }
+        m_url_cond.notify_all();
+        return info;
+    }
+
+    // drop a url which failed to serve, it's resolved again on next read
+    void invalidate_url_info(const estring &url) {
+        photon::scoped_lock lock(m_url_mutex);
+        auto it = m_url_entries.find(url);
+        if (it != m_url_entries.end() && !it->second.loading)
+            m_url_entries.erase(it);
+    }
+
+    void refresh_url_info() {
+        while (!m_stopping) {
+            m_refresh_cond.wait_no_lock(kAUrlRefreshInterval);
+            std::vector<std::string> due;
+            {
+                photon::scoped_lock lock(m_url_mutex);
+                for (auto it = m_url_entries.begin(); it != m_url_entries.end();) {
+                    auto &entry = it->second;
+                    if (entry.loading) {
+                        ++it;
+                        continue;
+                    }
+                    // urls not read during their last life are dropped
+                    if (!entry.info || (photon::now >= entry.expire &&
+                                        photon::now - entry.last_used > entry.info->lifetime)) {
+                        it = m_url_entries.erase(it);
+                        continue;
+                    }
+                    auto ahead = std::min(kMaxAUrlRefreshAhead, entry.info->lifetime / 5);
+                    if (photon::now - entry.last_used <= entry.info->lifetime &&
+                        photon::now + ahead >= entry.expire) {
+                        entry.loading = true;
+                        due.push_back(it->first);
+                    }
+                    ++it;
+                }
+            }
+            for (auto &url : due) {
+                long code = 0;
+                std::shared_ptr<UrlInfo> info(resolve_url(url, m_timeout, code));
+                photon::scoped_lock lock(m_url_mutex);
+                auto &entry = m_url_entries[url];
+                entry.loading = false;
+                if (info) {
+                    entry.info = info;
+                    entry.expire = photon::now + info->lifetime;
+                    LOG_DEBUG("actual url refreshed ", VALUE(url), VALUE(info->lifetime));
+                } else {
+                    LOG_WARN("failed to refresh actual url, keep the current one ", VALUE(url),
+                             VALUE(code));
+                }
+                m_url_cond.notify_all();
+            }
+        }
+    }
+
+    // get_actual_url() guarded by the circuit of registry host
+    UrlInfo *resolve_url(const estring &url, uint64_t timeout, long &code) {
+        auto host = url_host(url);
+        if (!circuit_allow(host))
+            LOG_ERROR_RETURN(EBUSY, nullptr, "circuit of registry is open ", VALUE(host));
+        auto info = get_actual_url(url, timeout, code);
+        // auth failures are not the registry's
+        circuit_report(host, info != nullptr || code == 401);
+        return info;
+    }
+
+    // `direct` bypasses the p2p accelerate address, used by hedged requests
+    long get_data(const estring &url, off_t offset, size_t count, uint64_t timeout, HTTP_OP &op,
+                  bool direct = false) {
         Timeout tmo(timeout);
         long ret = 0;
-        UrlInfo *actual_info = m_url_info.acquire(url, [&]() -> UrlInfo * {
-            return get_actual_url(url, tmo.timeout(), ret);
-        });
+        auto actual_info = acquire_url_info(url, tmo.timeout(), ret);
 
         if (actual_info == nullptr)
             return ret;
@@ -136,12 +344,16 @@ public:
             actual_url = &actual_info->info;
         // use p2p proxy
         estring accelerate_url;
-        if (m_accelerate.size() > 0) {
+        if (m_accelerate.size() > 0 && !direct) {
             accelerate_url = estring().appends(m_accelerate, "/", *actual_url);
             actual_url = &accelerate_url;
             LOG_DEBUG("p2p_url: `", *actual_url);
         }
 
+        auto host = url_host(*actual_url);
+        bool probe = false;
+        if (!circuit_allow(host, &probe))
+            LOG_ERROR_RETURN(EBUSY, ret, "circuit is open ", VALUE(host));
         op.req.reset(Verb::GET, *actual_url);
         // set token if needed
         if (actual_info->mode == UrlMode::Self && !actual_info->info.empty()) {
@@ -151,14 +363,26 @@ public:
         op.set_enable_proxy(m_client->has_proxy());
         op.retry = 0;
         op.timeout = tmo.timeout();
+        errno = 0;
         m_client->call(&op);
+        // interrupted by hedged_fetch() as the slower one, neither the host nor
+        // the url is to blame
+        if (errno == ECANCELED && op.status_code != 200 && op.status_code != 206) {
+            LOG_DEBUG("range request cancelled ", VALUE(url), VALUE(offset));
+            if (probe)
+                circuit_unprobe(host);
+            errno = ECANCELED;
+            return ret;
+        }
+        // no response, or the server is overloaded
+        circuit_report(host, op.status_code > 0 && op.status_code < 500 && op.status_code != 429);
 
         if (op.status_code == 200 || op.status_code == 206) {
-            m_url_info.release(url);
+            on_request_success();
             return ret;
         }
 
-        m_url_info.release(url, true);
+        invalidate_url_info(url);
         LOG_ERROR_RETURN(0, ret, "Failed to fetch data ", VALUE(url), VALUE(op.status_code), VALUE(ret));
     }
 
@@ -220,7 +444,8 @@ public:
             auto location = op.resp.headers["Location"];
             if (!scope.empty())
                 m_scope_token.release(scope);
-            return new UrlInfo{UrlMode::Redirect, location};
+            return new UrlInfo{UrlMode::Redirect, location,
+                               signed_url_life(location, kMinimalAUrlLife)};
         }
         if (op.status_code == 200) {
             UrlInfo *info = new UrlInfo{UrlMode::Self, ""};
@@ -242,6 +467,207 @@ public:
         return 0;
     }
 
+    virtual int setRangeSplit(size_t split_size, int concurrency) override {
+        m_split_size = split_size;
+        m_split_concurrency = concurrency > 0 ? concurrency : 1;
+        return 0;
+    }
+
+    size_t split_size() const {
+        return m_split_concurrency > 1 ? m_split_size : 0;
+    }
+
+    int split_concurrency() const {
+        return m_split_concurrency;
+    }
+
+    virtual int setRangeCoalesce(uint64_t window_us, size_t gap, size_t max_size) override {
+        m_coalesce_window = window_us;
+        m_coalesce_gap = gap;
+        m_coalesce_max = max_size;
+        return 0;
+    }
+
+    uint64_t coalesce_window() const {
+        return m_coalesce_max > 0 ? m_coalesce_window : 0;
+    }
+
+    virtual int setHedge(uint32_t percentile, uint64_t min_delay_us) override {
+        m_hedge_percentile = std::min(percentile, 100U);
+        m_hedge_min_delay = min_delay_us;
+        photon::scoped_lock lock(m_hedge_mutex);
+        m_hedge_delay = 0;
+        return 0;
+    }
+
+    virtual int getHedgeStat(uint64_t &hedged, uint64_t &wins) override {
+        photon::scoped_lock lock(m_hedge_mutex);
+        hedged = m_hedged;
+        wins = m_hedge_wins;
+        return 0;
+    }
+
+    virtual int setRetryPolicy(const RegistryRetryPolicy &policy) override {
+        m_retry_policy = policy;
+        m_retry_policy.backoff_base_us = std::max(policy.backoff_base_us, 1UL);
+        m_retry_policy.backoff_max_us =
+            std::max(policy.backoff_max_us, m_retry_policy.backoff_base_us);
+        return 0;
+    }
+
+    // a retry takes one token from the budget shared by all reads, and every
+    // successful request earns `budget_percent`% of a token back
+    bool acquire_retry() {
+        photon::scoped_lock lock(m_retry_mutex);
+        if (m_retry_tokens < 1)
+            return false;
+        m_retry_tokens -= 1;
+        return true;
+    }
+
+    void on_request_success() {
+        photon::scoped_lock lock(m_retry_mutex);
+        m_retry_tokens =
+            std::min(kRetryBudgetMax, m_retry_tokens + m_retry_policy.budget_percent / 100.0);
+    }
+
+    // exponential backoff with equal jitter, so that devices don't retry in lockstep
+    uint64_t retry_backoff(int attempt) {
+        auto cap = m_retry_policy.backoff_base_us << std::min(attempt, 20);
+        cap = std::min(cap, m_retry_policy.backoff_max_us);
+        return cap / 2 + rand() % (cap / 2 + 1);
+    }
+
+    // sleep before the `attempt`th retry, false if no retry is allowed
+    bool retry_wait(int attempt, Timeout &tmo) {
+        if (!acquire_retry()) {
+            LOG_WARN("retry budget exhausted");
+            return false;
+        }
+        photon::thread_usleep(std::min(retry_backoff(attempt), tmo.timeout()));
+        return photon::now < tmo.expire();
+    }
+
+    // `probe` is set if the request is the single one let through a circuit
+    // cooled down, whose result closes or reopens it
+    bool circuit_allow(estring_view host, bool *probe = nullptr) {
+        if (m_retry_policy.breaker_failures == 0)
+            return true;
+        photon::scoped_lock lock(m_retry_mutex);
+        auto &c = m_circuits[std::string(host)];
+        if (c.open_until == 0)
+            return true;
+        if (photon::now < c.open_until || c.probing)
+            return false;
+        c.probing = true;
+        if (probe)
+            *probe = true;
+        return true;
+    }
+
+    // the probe ends with no result, let the next request probe instead
+    void circuit_unprobe(estring_view host) {
+        photon::scoped_lock lock(m_retry_mutex);
+        auto it = m_circuits.find(std::string(host));
+        if (it != m_circuits.end())
+            it->second.probing = false;
+    }
+
+    void circuit_report(estring_view host, bool ok) {
+        if (m_retry_policy.breaker_failures == 0)
+            return;
+        photon::scoped_lock lock(m_retry_mutex);
+        auto &c = m_circuits[std::string(host)];
+        if (ok) {
+            if (c.open_until != 0)
+                LOG_INFO("circuit closed ", VALUE(host));
+            c = HostCircuit();
+            return;
+        }
+        c.failures++;
+        if (!c.probing && c.failures < m_retry_policy.breaker_failures)
+            return;
+        c.cooldown = c.cooldown == 0 ? m_retry_policy.breaker_cooldown_us
+                                     : std::min(c.cooldown * 2, kMaxBreakerCooldown);
+        c.open_until = photon::now + c.cooldown / 2 + rand() % (c.cooldown / 2 + 1);
+        c.probing = false;
+        LOG_WARN("circuit opened ", VALUE(host), VALUE(c.failures), VALUE(c.cooldown));
+    }
+
+    // 0 if hedging is disabled or not enough responses are observed
+    uint64_t hedge_delay() {
+        if (m_hedge_percentile == 0)
+            return 0;
+        photon::scoped_lock lock(m_hedge_mutex);
+        return m_hedge_delay;
+    }
+
+    // time to response headers of a ranged GET, the hedge delay is its percentile
+    void add_response_latency(uint64_t us) {
+        if (m_hedge_percentile == 0)
+            return;
+        photon::scoped_lock lock(m_hedge_mutex);
+        if (m_latency.size() < kHedgeSamples)
+            m_latency.push_back(us);
+        else
+            m_latency[m_latency_count % kHedgeSamples] = us;
+        m_latency_count++;
+        if (m_latency.size() < kHedgeMinSamples || m_latency_count % kHedgeUpdateEvery != 0)
+            return;
+        auto samples = m_latency;
+        auto nth = samples.begin() + (samples.size() - 1) * m_hedge_percentile / 100;
+        std::nth_element(samples.begin(), nth, samples.end());
+        m_hedge_delay = std::max(*nth, m_hedge_min_delay);
+    }
+
+    void add_hedge() {
+        photon::scoped_lock lock(m_hedge_mutex);
+        m_hedged++;
+    }
+
+    void add_hedge_win() {
+        photon::scoped_lock lock(m_hedge_mutex);
+        m_hedge_wins++;
+    }
+
+    // join the pending range request of `url` if possible, otherwise returns a new
+    // one, whose caller is responsible to issue, or nullptr to read on its own.
+    // A read is held for others to join only if another request of `url` is in
+    // flight, so a lone read is never delayed. Unless joined, the caller ends
+    // its request with end_request().
+    CoalescedRange *coalesce(const estring &url, CoalescedReader *reader, bool &joined) {
+        photon::scoped_lock lock(m_coalesce_mutex);
+        joined = false;
+        auto it = m_coalescing.find(url);
+        if (it != m_coalescing.end() && reader->count <= m_coalesce_max &&
+            it->second->can_merge(reader->offset, reader->count, m_coalesce_gap,
+                                  m_coalesce_max)) {
+            it->second->add(reader);
+            joined = true;
+            return nullptr;
+        }
+        auto inflight = m_inflight[url]++;
+        if (reader->count > m_coalesce_max || it != m_coalescing.end() || inflight == 0)
+            return nullptr;
+        auto range = new CoalescedRange{reader->offset, reader->offset, {}};
+        range->add(reader);
+        m_coalescing.emplace(url, range);
+        return range;
+    }
+
+    // no more readers could join after closed
+    void close_coalesce(const estring &url) {
+        photon::scoped_lock lock(m_coalesce_mutex);
+        m_coalescing.erase(url);
+    }
+
+    void end_request(const estring &url) {
+        photon::scoped_lock lock(m_coalesce_mutex);
+        auto it = m_inflight.find(url);
+        if (it != m_inflight.end() && --it->second == 0)
+            m_inflight.erase(it);
+    }
+
     photon::net::http::Client* get_client() {
         return m_client;
     }
@@ -271,9 +697,37 @@ protected:
     estring m_caFile;
     uint64_t m_timeout;
     photon::net::http::Client* m_client;
+    size_t m_split_size = 0;
+    int m_split_concurrency = 1;
+    uint64_t m_coalesce_window = 0;
+    size_t m_coalesce_gap = 0;
+    size_t m_coalesce_max = 0;
+    photon::mutex m_coalesce_mutex;
+    std::unordered_map<std::string, CoalescedRange *> m_coalescing;
+    // # of range requests in flight per url, issued by coalesced_preadv()
+    std::unordered_map<std::string, uint32_t> m_inflight;
+    uint32_t m_hedge_percentile = 0;
+    uint64_t m_hedge_min_delay = 0;
+    // latencies and hedge stats are updated by the vCPUs of all devices
+    photon::mutex m_hedge_mutex;
+    uint64_t m_hedge_delay = 0;
+    std::vector<uint64_t> m_latency;
+    uint64_t m_latency_count = 0;
+    uint64_t m_hedged = 0;
+    uint64_t m_hedge_wins = 0;
+    RegistryRetryPolicy m_retry_policy;
+    // the budget and circuits are shared by the vCPUs of all devices
+    photon::mutex m_retry_mutex;
+    double m_retry_tokens = kRetryBudgetMax;
+    std::unordered_map<std::string, HostCircuit> m_circuits;
     ObjectCache<estring, size_t *> m_meta_size;
     ObjectCache<estring, estring *> m_scope_token;
-    ObjectCache<estring, UrlInfo *> m_url_info;
+    photon::mutex m_url_mutex;
+    photon::condition_variable m_url_cond;
+    std::unordered_map<std::string, UrlEntry> m_url_entries;
+    bool m_stopping = false;
+    photon::condition_variable m_refresh_cond;
+    photon::join_handle *m_refresh_th = nullptr;
 
     int get_scope_auth(const estring &url, estring *authurl, estring *scope, uint64_t timeout,
                        bool push = false) {
@@ -391,40 +845,267 @@ public:
                 return -1;
             m_filesize = stat.st_size;
         }
-        auto filesize = m_filesize;
-        int retry = 3;
         Timeout tmo(m_timeout);
-
-    again:
         iovector_view view((struct iovec*)iov, iovcnt);
         auto count = view.sum();
-        if (count + offset > filesize)
-            count = filesize - offset;
-        LOG_DEBUG("pulling blob from registry: ", VALUE(m_url), VALUE(offset), VALUE(count));
+        if (count + offset > m_filesize)
+            count = m_filesize - offset;
+        auto split_size = m_fs->split_size();
+        if (split_size > 0 && count > split_size)
+            return split_preadv(iov, iovcnt, offset, count, split_size, tmo);
+        if (m_fs->coalesce_window() > 0)
+            return coalesced_preadv(iov, iovcnt, offset, count, tmo);
+        return range_preadv(iov, iovcnt, offset, count, tmo);
+    }
+
+    ssize_t coalesced_preadv(const struct iovec *iov, int iovcnt, off_t offset, size_t count,
+                             Timeout &tmo) {
+        CoalescedReader self(iov, iovcnt, offset, count);
+        bool joined;
+        auto range = m_fs->coalesce(m_url, &self, joined);
+        if (joined) {
+            self.done.wait(1);
+            if (self.ret < 0)
+                errno = self.eno;
+            return self.ret;
+        }
+        DEFER(m_fs->end_request(m_url));
+        if (range == nullptr)
+            return range_preadv(iov, iovcnt, offset, count, tmo);
+
+        // wait for nearby readers to join, then issue the merged range
+        photon::thread_usleep(m_fs->coalesce_window());
+        m_fs->close_coalesce(m_url);
+        DEFER(delete range);
+        if (range->readers.size() == 1)
+            return range_preadv(iov, iovcnt, offset, count, tmo);
+
+        auto len = range->end - range->start;
+        LOG_DEBUG("coalesced ` reads of ", range->readers.size(), VALUE(m_url),
+                  VALUE(range->start), VALUE(len));
+        void *buf = malloc(len);
+        ssize_t ret = -1;
+        int eno = ENOMEM;
+        if (buf != nullptr) {
+            struct iovec v { buf, (size_t)len };
+            ret = range_preadv(&v, 1, range->start, len, tmo);
+            eno = errno;
+        }
+        DEFER(free(buf));
+
+        // fan the response out to the readers
+        for (auto reader : range->readers) {
+            if (ret < 0) {
+                reader->ret = -1;
+                reader->eno = eno;
+            } else {
+                auto skip = reader->offset - range->start;
+                auto n = std::min((ssize_t)reader->count, std::max(ret - skip, (ssize_t)0));
+                auto src = (char *)buf + skip;
+                size_t left = n;
+                for (int i = 0; i < reader->iovcnt && left > 0; i++) {
+                    auto m = std::min(left, reader->iov[i].iov_len);
+                    memcpy(reader->iov[i].iov_base, src, m);
+                    src += m;
+                    left -= m;
+                }
+                reader->ret = n;
+            }
+            if (reader != &self)
+                reader->done.signal(1);
+        }
+        if (self.ret < 0)
+            errno = self.eno;
+        return self.ret;
+    }
 
+    struct RangeFetch {
+        const struct iovec *iov;
+        int iovcnt;
+        off_t offset;
+        size_t count;
+        uint64_t timeout;
+        bool direct = false;
+        photon::semaphore *done = nullptr;
+        long ret = 0;
+        int status = 0;
+        ssize_t nread = -1;
+        int eno = 0;
+        bool responded = false;
+        bool finished = false;
+
+        bool succeeded() const {
+            return finished && (status == 200 || status == 206) && nread >= 0;
+        }
+    };
+
+    void fetch(RangeFetch *f) {
         HTTP_OP op;
-        auto ret = m_fs->get_data(m_url, offset, count, tmo.timeout(), op);
-        if (op.status_code != 200 && op.status_code != 206) {
+        auto start = photon::now;
+        f->ret = m_fs->get_data(m_url, f->offset, f->count, f->timeout, op, f->direct);
+        f->status = op.status_code;
+        f->responded = true;
+        if (f->status == 200 || f->status == 206) {
+            m_fs->add_response_latency(photon::now - start);
+            f->nread = op.resp.readv(f->iov, f->iovcnt);
+        }
+        f->eno = errno;
+        f->finished = true;
+        if (f->done)
+            f->done->signal(1);
+    }
+
+    // if `f` has no response within the hedge delay, a duplicate request is
+    // sent, bypassing the p2p proxy if any, and the slower one is interrupted
+    void hedged_fetch(RangeFetch &f, uint64_t delay, Timeout &tmo) {
+        photon::semaphore done;
+        f.done = &done;
+        auto th = photon::thread_create11(&RegistryFileImpl_v2::fetch, this, &f);
+        auto jh = photon::thread_enable_join(th);
+        done.wait(1, std::min(delay, tmo.timeout()));
+        if (f.responded) {
+            photon::thread_join(jh);
+            return;
+        }
+
+        auto buf = malloc(f.count);
+        if (buf == nullptr) {
+            photon::thread_join(jh);
+            return;
+        }
+        DEFER(free(buf));
+        struct iovec v { buf, f.count };
+        RangeFetch h{&v, 1, f.offset, f.count, tmo.timeout(), true, &done};
+        m_fs->add_hedge();
+        LOG_DEBUG("hedge range request ", VALUE(m_url), VALUE(f.offset), VALUE(f.count),
+                  VALUE(delay));
+        auto hth = photon::thread_create11(&RegistryFileImpl_v2::fetch, this, &h);
+        auto hjh = photon::thread_enable_join(hth);
+        while (!f.succeeded() && !h.succeeded() && !(f.finished && h.finished)) {
+            if (done.wait(1, tmo.timeout()) < 0)
+                break;
+        }
+        bool hedge_won = !f.succeeded() && h.succeeded();
+        if (!f.finished)
+            photon::thread_interrupt(th, ECANCELED);
+        if (!h.finished)
+            photon::thread_interrupt(hth, ECANCELED);
+        photon::thread_join(jh);
+        photon::thread_join(hjh);
+        if (!hedge_won)
+            return;
+
+        m_fs->add_hedge_win();
+        auto src = (char *)buf;
+        size_t left = h.nread;
+        for (int i = 0; i < f.iovcnt && left > 0; i++) {
+            auto m = std::min(left, f.iov[i].iov_len);
+            memcpy(f.iov[i].iov_base, src, m);
+            src += m;
+            left -= m;
+        }
+        f.ret = h.ret;
+        f.status = h.status;
+        f.nread = h.nread;
+        f.eno = h.eno;
+    }
+
+    // a single ranged GET of [offset, offset + count) into iov
+    ssize_t range_preadv(const struct iovec *iov, int iovcnt, off_t offset, size_t count,
+                         Timeout &tmo) {
+        int retry = 3, attempt = 0;
+
+    again:
+        LOG_DEBUG("pulling blob from registry: ", VALUE(m_url), VALUE(offset), VALUE(count));
+
+        RangeFetch f{iov, iovcnt, offset, count, tmo.timeout()};
+        auto delay = m_fs->hedge_delay();
+        if (delay > 0)
+            hedged_fetch(f, delay, tmo);
+        else
+            fetch(&f);
+        if (f.status != 200 && f.status != 206) {
+            errno = f.eno;
             ERRNO eno;
             if (tmo.expire() < photon::now) {
                 LOG_ERROR_RETURN(ETIMEDOUT, -1, "timed out in preadv ", VALUE(m_url), VALUE(offset));
             }
-            if (retry--) {
-                LOG_WARN("failed to perform HTTP GET, going to retry ", VALUE(op.status_code), VALUE(offset),
-                         VALUE(count), VALUE(ret), eno);
-                photon::thread_usleep(1000);
+            if (retry-- && m_fs->retry_wait(attempt++, tmo)) {
+                LOG_WARN("failed to perform HTTP GET, going to retry ", VALUE(f.status), VALUE(offset),
+                         VALUE(count), VALUE(f.ret), eno);
                 goto again;
             } else {
                 LOG_ERROR_RETURN(ENOENT, -1, "failed to perform HTTP GET ", VALUE(m_url),
                                  VALUE(offset));
             }
         }
-        return op.resp.readv(iov, iovcnt);
+        if (f.nread < 0)
+            errno = f.eno;
+        return f.nread;
+    }
+
+    struct SplitTask {
+        const struct iovec *iov;
+        int iovcnt;
+        off_t offset;
+        size_t count;
+        size_t split_size;
+        Timeout &tmo;
+        size_t next = 0;
+        int eno = 0;
+    };
+
+    // sub-ranges are fetched over separate connections of the http client, and
+    // received directly into the caller's buffers
+    ssize_t split_preadv(const struct iovec *iov, int iovcnt, off_t offset, size_t count,
+                         size_t split_size, Timeout &tmo) {
+        SplitTask task{iov, iovcnt, offset, count, split_size, tmo};
+        auto nsplits = (count + split_size - 1) / split_size;
+        auto nworkers = std::min(nsplits, (size_t)m_fs->split_concurrency());
+        std::vector<photon::join_handle *> jhs;
+        for (size_t i = 0; i < nworkers; i++) {
+            auto th = photon::thread_create11(&RegistryFileImpl_v2::split_worker, this, &task);
+            jhs.push_back(photon::thread_enable_join(th));
+        }
+        for (auto jh : jhs) {
+            photon::thread_join(jh);
+        }
+        if (task.eno != 0) {
+            LOG_ERROR_RETURN(task.eno, -1, "failed to read split ranges ", VALUE(m_url),
+                             VALUE(offset), VALUE(count));
+        }
+        return count;
+    }
+
+    void split_worker(SplitTask *task) {
+        while (task->eno == 0 && task->next < task->count) {
+            auto skip = task->next;
+            auto len = std::min(task->split_size, task->count - skip);
+            task->next += len;
+
+            // iovecs of [skip, skip + len) in the caller's buffers
+            std::vector<struct iovec> sub;
+            size_t base = 0;
+            for (int i = 0; i < task->iovcnt && base < skip + len; i++) {
+                size_t end = base + task->iov[i].iov_len;
+                if (end > skip) {
+                    auto from = std::max(base, skip);
+                    auto to = std::min(end, skip + len);
+                    sub.push_back({(char *)task->iov[i].iov_base + (from - base), to - from});
+                }
+                base = end;
+            }
+            auto ret = range_preadv(sub.data(), (int)sub.size(), task->offset + skip, len, task->tmo);
+            if (ret != (ssize_t)len) {
+                task->eno = (ret < 0 && errno) ? errno : EIO;
+                return;
+            }
+        }
     }
 
     int64_t get_length(uint64_t timeout = -1) {
         Timeout tmo(timeout);
-        int retry = 3;
+        int retry = 3, attempt = 0;
     again:
         HTTP_OP op;
         auto ret = m_fs->get_data(m_url, 0, 1, tmo.timeout(), op);
@@ -437,7 +1118,7 @@ public:
                     goto again;
                 LOG_ERROR_RETURN(EPERM, -1, "Authorization failed");
             }
-            if (retry--)
+            if (retry-- && m_fs->retry_wait(attempt++, tmo))
                 goto again;
             LOG_ERROR_RETURN(ENOENT, -1, "failed to get meta from server");
         }
@@ -476,6 +1157,10 @@ IFileSystem *new_registryfs_v2(PasswordCB callback, const char *caFile, uint64_t
     return new RegistryFSImpl_v2(callback, caFile ? caFile : "", timeout);
 }
 
+// local reads of a chunk are double buffered in blocks of kUploadBlock, so that
+// the next block is read and hashed while the current one is being sent
+static const size_t kUploadBlock = 1024 * 1024;
+
 class RegistryUploader : public VirtualFile {
 public:
     photon::semaphore m_sem, m_init_sem;
@@ -485,7 +1170,6 @@ public:
     IFile *m_local_file;
     estring m_origin_upload_url, m_upload_url;
     ssize_t m_upload_chunk_size = 128 * 1024 * 1024;
-    void *m_upload_buf;
     off_t m_upload_pos = 0, m_write_pos = 0;
     bool m_finished = false, m_failed = false;
     RegistryFSImpl_v2 *m_upload_fs;
@@ -493,6 +1177,9 @@ public:
     std::string m_username, m_password;
     uint64_t m_timeout = -1;
     estring m_token;
+    photon::WorkPool *m_read_pool = nullptr;
+    // the file is hashed in order, up to m_hashed_pos
+    off_t m_hashed_pos = 0;
 
     RegistryUploader(IFile *lfile, std::string &upload_url, std::string &username,
                      std::string &password, uint64_t timeout = -1, ssize_t upload_bs = -1)
@@ -522,15 +1209,6 @@ public:
             m_upload_th.join();
             return -1;
         }
-        // calc sha256 result
-        unsigned char sha[32];
-        SHA256_Final(sha, &m_sha256_ctx);
-        char res[SHA256_DIGEST_LENGTH * 2];
-        for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
-            sprintf(res + (i * 2), "%02x", sha[i]);
-        m_sha256sum = "sha256:" + std::string(res, SHA256_DIGEST_LENGTH * 2);
-        LOG_INFO(VALUE(m_sha256sum));
-
         m_finished = true;
         m_sem.signal(1);
         m_upload_th.join();
@@ -564,9 +1242,6 @@ public:
         if (rc < 0) {
             LOG_ERRNO_RETURN(0, -1, "failed to write local file", VALUE(rc));
         }
-        if (rc > 0 && SHA256_Update(&m_sha256_ctx, buf, rc) < 0) {
-            LOG_ERRNO_RETURN(0, -1, "sha256 calculate error");
-        }
         m_write_pos += rc;
         m_sem.signal(1);
         return rc;
@@ -580,6 +1255,51 @@ public:
         return std::make_pair(m_username, m_password);
     }
 
+    struct ChunkPipe {
+        off_t offset;
+        size_t count;
+        void *buf[2];
+        ssize_t len[2] = {0, 0};
+        photon::semaphore filled{0}, freed{2};
+        bool stop = false;
+    };
+
+    // hash the part of [offset, offset + len) not hashed yet, chunks are
+    // sent in order and a retried session resends what is already hashed
+    int hash_block(void *buf, off_t offset, size_t len) {
+        if (offset > m_hashed_pos)
+            LOG_ERROR_RETURN(EINVAL, -1, "hash out of order ", VALUE(offset), VALUE(m_hashed_pos));
+        auto end = offset + (off_t)len;
+        if (end <= m_hashed_pos)
+            return 0;
+        auto skip = m_hashed_pos - offset;
+        m_read_pool->call([&]() {
+            SHA256_Update(&m_sha256_ctx, (char *)buf + skip, len - skip);
+        });
+        m_hashed_pos = end;
+        return 0;
+    }
+
+    void read_blocks(ChunkPipe *p) {
+        auto end = p->offset + (off_t)p->count;
+        for (off_t pos = p->offset, i = 0; pos < end; pos += kUploadBlock, i ^= 1) {
+            p->freed.wait(1);
+            if (p->stop)
+                return;
+            ssize_t cnt = std::min((off_t)kUploadBlock, end - pos);
+            ssize_t rc = -1;
+            m_read_pool->call([&]() { rc = m_local_file->pread(p->buf[i], cnt, pos); });
+            if (rc != cnt || hash_block(p->buf[i], pos, cnt) < 0) {
+                LOG_ERROR("failed to read file ", VALUE(rc), VALUE(cnt), VALUE(pos));
+                p->len[i] = -1;
+                p->filled.signal(1);
+                return;
+            }
+            p->len[i] = cnt;
+            p->filled.signal(1);
+        }
+    }
+
     // non-empty digest means complete request
     off_t upload_chunk(off_t offset, size_t count, std::string_view digest) {
         LOG_INFO("upload chunk ", VALUE(offset), VALUE(count), VALUE(digest));
@@ -597,33 +1317,42 @@ public:
         int retry = 3;
         LOG_INFO(VALUE(url));
     again:
-        if (photon::now - m_http_client_ts >= 5ULL * 60 * 1000 * 1000) {
-            LOG_INFO("http client expire, refresh");
-            m_upload_fs->refresh_client();
-            m_http_client_ts = photon::now;
-        }
         HTTP_OP op(m_upload_fs->get_client(), verb, url);
         op.follow = 0;
         op.retry = 0;
         op.req.headers.content_length(count);
 
         auto writer = [&](Request *req) -> ssize_t {
-            auto start = offset;
+            ChunkPipe p{offset, count};
+            if (::posix_memalign(&p.buf[0], 4096, kUploadBlock) != 0)
+                p.buf[0] = nullptr;
+            if (::posix_memalign(&p.buf[1], 4096, kUploadBlock) != 0)
+                p.buf[1] = nullptr;
+            DEFER({
+                free(p.buf[0]);
+                free(p.buf[1]);
+            });
+            if (p.buf[0] == nullptr || p.buf[1] == nullptr)
+                LOG_ERROR_RETURN(ENOMEM, -1, "failed to alloc upload buffer");
+            auto th = photon::thread_create11(&RegistryUploader::read_blocks, this, &p);
+            auto jh = photon::thread_enable_join(th);
+            DEFER({
+                p.stop = true;
+                p.freed.signal(2);
+                photon::thread_join(jh);
+            });
             ssize_t ret = 0;
-            while (start < (off_t)(offset + count)) {
-                ssize_t cnt = 1024 * 1024;
-                if ((off_t)(start + cnt) > (off_t)(offset + count))
-                    cnt = offset + count - start;
-                auto rc = m_local_file->pread(m_upload_buf, cnt, start);
-                if (rc != cnt) {
-                    LOG_ERRNO_RETURN(0, -1, "failed to read file", VALUE(rc), VALUE(cnt));
-                }
-                rc = req->write(m_upload_buf, cnt);
+            for (int i = 0; ret < (ssize_t)count; i ^= 1) {
+                p.filled.wait(1);
+                auto cnt = p.len[i];
+                if (cnt < 0)
+                    LOG_ERROR_RETURN(EIO, -1, "failed to read file");
+                auto rc = req->write(p.buf[i], cnt);
                 if (rc != cnt) {
                     LOG_ERRNO_RETURN(0, -1, "failed to upload", VALUE(rc), VALUE(cnt));
                 }
-                start += cnt;
                 ret += cnt;
+                p.freed.signal(1);
             }
             return ret;
         };
@@ -665,14 +1394,34 @@ public:
         LOG_ERRNO_RETURN(0, -1, "failed to upload, code=", op.status_code);
     }
 
+    // upload chunks available, the last one is kept for more data unless `all`
+    int upload_chunks(bool all) {
+        while (!m_failed) {
+            auto avail = m_write_pos - m_upload_pos;
+            if (avail <= 0 || (!all && avail <= m_upload_chunk_size))
+                return 0;
+            if (photon::now - m_http_client_ts >= 5ULL * 60 * 1000 * 1000) {
+                LOG_INFO("http client expire, refresh");
+                m_upload_fs->refresh_client();
+                m_http_client_ts = photon::now;
+            }
+            auto size = std::min((off_t)m_upload_chunk_size, avail);
+            m_upload_pos = upload_chunk(m_upload_pos, size, "");
+            if (m_upload_pos < 0)
+                return -1;
+        }
+        return -1;
+    }
+
     int upload_thread() {
         photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_NONE);
         DEFER(photon::fini());
         m_upload_fs = new RegistryFSImpl_v2({this, &RegistryUploader::load_auth}, "", m_timeout);
         DEFER({ delete m_upload_fs; });
         m_http_client_ts = photon::now;
-        ::posix_memalign(&m_upload_buf, 4096, 1024 * 1024);
-        DEFER(free(m_upload_buf));
+        // local reads and hashing are done on the pool, off the sending vcpu
+        m_read_pool = new photon::WorkPool(1, photon::INIT_EVENT_DEFAULT, photon::INIT_IO_NONE);
+        DEFER(delete m_read_pool);
         int retry = 3;
     again:
         m_upload_pos = 0;
@@ -688,34 +1437,37 @@ public:
         m_init_sem.signal(1);
         while (!m_finished && !m_failed) {
             m_sem.wait(1);
-            while (m_write_pos > m_upload_pos + m_upload_chunk_size) {
-                m_upload_pos = upload_chunk(m_upload_pos, m_upload_chunk_size, "");
-                if (m_upload_pos < 0) {
-                    if (retry--) {
-                        LOG_ERROR("failed to upload chunk, retry");
-                        m_sem.signal(1);
-                        goto again;
-                    }
-
-                    m_failed = true;
-                    goto fail;
-                }
-            }
-        }
-        while (m_write_pos > m_upload_pos && !m_failed) {
-            auto size = m_write_pos - m_upload_pos;
-            if (size > m_upload_chunk_size)
-                size = m_upload_chunk_size;
-            m_upload_pos = upload_chunk(m_upload_pos, size, "");
-            if (m_upload_pos < 0) {
+            if (upload_chunks(false) < 0) {
                 if (retry--) {
                     LOG_ERROR("failed to upload chunk, retry");
+                    m_sem.signal(1);
                     goto again;
                 }
                 m_failed = true;
                 goto fail;
             }
         }
+        if (!m_failed && upload_chunks(true) < 0) {
+            if (retry--) {
+                LOG_ERROR("failed to upload chunk, retry");
+                goto again;
+            }
+            m_failed = true;
+            goto fail;
+        }
+        if (m_failed)
+            goto fail;
+
+        if (m_sha256sum.empty()) {
+            // every byte is hashed by now, as it's uploaded
+            unsigned char sha[32];
+            SHA256_Final(sha, &m_sha256_ctx);
+            char res[SHA256_DIGEST_LENGTH * 2];
+            for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+                sprintf(res + (i * 2), "%02x", sha[i]);
+            m_sha256sum = "sha256:" + std::string(res, SHA256_DIGEST_LENGTH * 2);
+            LOG_INFO(VALUE(m_sha256sum));
+        }
 
         // send complete
         m_upload_pos = upload_chunk(m_upload_pos, 0, m_sha256sum);
@@ -13,21 +13,27 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <map>
 #include <queue>
 #include <unistd.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
 #include "prefetch.h"
 #include <photon/common/alog.h>
 #include <photon/common/alog-stdstring.h>
+#include <photon/fs/fiemap.h>
 #include <photon/fs/forwardfs.h>
 #include <photon/fs/localfs.h>
+#include <photon/thread/thread.h>
 #include <photon/thread/thread11.h>
+#include "overlaybd/extfs/extfs.h"
 #include "overlaybd/zfile/crc32/crc32c.h"
 
 using namespace std;
@@ -47,7 +53,10 @@ private:
 
 class PrefetcherImpl : public Prefetcher {
 public:
-    explicit PrefetcherImpl(const string &trace_file_path, int concurrency) : m_concurrency(concurrency) {
+    explicit PrefetcherImpl(const string &trace_file_path, int concurrency,
+                            uint64_t lead_window_ms, bool record_lba)
+        : m_concurrency(concurrency), m_lead_us(lead_window_ms * 1000) {
+        m_record_lba = record_lba;
         // Detect mode
         size_t file_size = 0;
         m_mode = detect_mode(trace_file_path, &file_size);
@@ -64,6 +73,7 @@ public:
 
         // Loop detect lock file if going to record
         if (m_mode == Mode::Record) {
+            m_record_start = photon::now;
             int lock_fd = open(m_lock_file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_EXCL, 0666);
             close(lock_fd);
             auto th = photon::thread_create11(&PrefetcherImpl::detect_lock, this);
@@ -76,6 +86,13 @@ public:
         }
     }
 
+    // prefetch files of `patterns`
+    PrefetcherImpl(const vector<string> &patterns, int concurrency)
+        : m_file_patterns(patterns), m_concurrency(concurrency), m_lead_us(0) {
+        m_mode = Mode::Replay;
+        LOG_INFO("Prefetch: run with mode `, ` file patterns", m_mode, patterns.size());
+    }
+
     ~PrefetcherImpl() {
         if (m_mode == Mode::Record) {
             m_record_stopped = true;
@@ -110,17 +127,21 @@ public:
         if (m_record_stopped) {
             return;
         }
-        TraceFormat trace = {op, layer_index, count, offset};
+        TraceFormat trace = {op, layer_index, count, offset, photon::now - m_record_start};
         m_record_array.push_back(trace);
     }
 
     void do_replay() {
         struct timeval start;
         gettimeofday(&start, NULL);
-        LOG_INFO("Prefetch: Replay ` records from ` layers, concurrency `",
-                 m_replay_queue.size(), m_src_files.size(), m_concurrency);
+        // a timed replay starts with a quarter of workers, more are added once it
+        // falls behind the container
+        m_active = m_timed ? max(1, m_concurrency / 4) : m_concurrency;
+        m_replay_start = photon::now;
+        LOG_INFO("Prefetch: Replay ` records from ` layers, concurrency `, timed `",
+                 m_replay_queue.size(), m_src_files.size(), m_concurrency, m_timed);
         for (int i = 0; i < m_concurrency; ++i) {
-            auto th = photon::thread_create11(&PrefetcherImpl::replay_worker_thread, this);
+            auto th = photon::thread_create11(&PrefetcherImpl::replay_worker_thread, this, i);
             auto join_handle = photon::thread_enable_join(th);
             m_replay_threads.push_back(join_handle);
         }
@@ -131,22 +152,70 @@ public:
         struct timeval end;
         gettimeofday(&end, NULL);
         uint64_t elapsed = 1000000UL * (end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
-        LOG_INFO("Prefetch: Replay done, time cost ` ms", elapsed / 1000);
+        LOG_INFO("Prefetch: Replay done, time cost ` ms, concurrency `", elapsed / 1000, m_active);
     }
 
-    void replay() override {
-        if (m_mode != Mode::Replay) {
+    void replay(LSMT::IFileRO *lowers) override {
+        if (m_mode != Mode::Replay || m_src_files.empty()) {
+            return;
+        }
+        if (!m_file_patterns.empty()) {
+            // files are resolved in background, which reads the image
+            auto th = photon::thread_create11(&PrefetcherImpl::do_file_replay, this, lowers);
+            m_replay_thread = photon::thread_enable_join(th);
             return;
         }
-        if (m_replay_queue.empty() || m_src_files.empty()) {
+        if (m_replay_traces.empty()) {
             return;
         }
+        prepare_replay(lowers ? lowers->index() : nullptr);
         auto th = photon::thread_create11(&PrefetcherImpl::do_replay, this);
         m_replay_thread = photon::thread_enable_join(th);
     }
 
-    int replay_worker_thread() {
+    void do_file_replay(LSMT::IFileRO *lowers) {
+        if (lowers == nullptr || resolve_files(lowers) < 0 || m_replay_traces.empty()) {
+            return;
+        }
+        prepare_replay(lowers->index());
+        do_replay();
+    }
+
+    void prepare_replay(LSMT::IMemoryIndex *index) {
+        translate(index);
+        // traces dumped by former versions are not compacted, and the reads
+        // translated from LBA are coalesced by their offsets in layers
+        compact(m_replay_traces);
+        for (auto &each : m_replay_traces) {
+            m_replay_queue.push(each);
+            if (m_timed && each.op == TraceOp::READ) {
+                m_replay_index[each.layer_index][each.offset] = {each.offset + each.count,
+                                                                 each.time_us};
+            }
+        }
+        vector<TraceFormat>().swap(m_replay_traces);
+    }
+
+    int replay_worker_thread(int id) {
         while (!m_replay_queue.empty() && !m_replay_stopped) {
+            if (m_timed) {
+                if (id >= m_active) {
+                    m_replay_cond.wait_no_lock(REPLAY_TICK_US);
+                    continue;
+                }
+                // reads are issued in order of the time they were needed, no
+                // further than the lead window ahead of the container
+                auto progress = boot_progress();
+                auto deadline = m_replay_queue.front().time_us;
+                if (deadline > progress + m_lead_us) {
+                    auto ahead = deadline - progress - m_lead_us;
+                    m_replay_cond.wait_no_lock(min(ahead, (uint64_t)REPLAY_TICK_US));
+                    continue;
+                }
+                if (deadline < progress) {
+                    fall_behind();
+                }
+            }
             auto trace = m_replay_queue.front();
             m_replay_queue.pop();
             auto iter = m_src_files.find(trace.layer_index);
@@ -170,12 +239,39 @@ public:
         m_src_files[layer_index] = src_file;
     }
 
+    // a read of the container, which tells how far the boot goes in the trace
+    void on_live_read(uint32_t layer_index, off_t offset) {
+        auto layer = m_replay_index.find(layer_index);
+        if (layer == m_replay_index.end()) {
+            return;
+        }
+        auto it = layer->second.upper_bound(offset);
+        if (it == layer->second.begin() || offset >= (--it)->second.first) {
+            return;
+        }
+        if (it->second.second > m_progress_us) {
+            m_progress_us = it->second.second;
+            m_replay_cond.notify_all();
+        }
+    }
+
 private:
+    // record of trace with TRACE_MAGIC
+    struct TraceFormatV1 {
+        TraceOp op;
+        uint32_t layer_index;
+        size_t count;
+        off_t offset;
+    };
+
+    // record of trace with TRACE_MAGIC_V2, with the time of the read since
+    // recording started
     struct TraceFormat {
         TraceOp op;
         uint32_t layer_index;
         size_t count;
         off_t offset;
+        uint64_t time_us;
     };
 
     struct TraceHeader {
@@ -185,9 +281,17 @@ private:
     };
 
     static const int MAX_IO_SIZE = 1024 * 1024;
+    // reads closer than this are merged, reading the gap costs less than a request
+    static const int MERGE_GAP = 64 * 1024;
     static const uint32_t TRACE_MAGIC = 3270449184; // CRC32 of `Container Image Trace Format`
+    static const uint32_t TRACE_MAGIC_V2 = 4233965968; // CRC32 of `Container Image Trace Format v2`
+    static const uint64_t REPLAY_TICK_US = 100 * 1000;
+    static const size_t SECTOR_SIZE = 512;
+    static const uint32_t MAX_FILE_EXTENTS = 8192;
 
     vector<TraceFormat> m_record_array;
+    vector<TraceFormat> m_replay_traces; // reloaded, until replay
+    vector<string> m_file_patterns;
     queue<TraceFormat> m_replay_queue;
     map<uint32_t, IFile *> m_src_files;
     vector<photon::join_handle *> m_replay_threads;
@@ -201,6 +305,221 @@ private:
     bool m_record_stopped = false;
     bool m_buffer_released = false;
     int m_concurrency;
+    uint64_t m_record_start = 0;
+
+    // timed replay
+    bool m_timed = false;
+    uint64_t m_lead_us;
+    int m_active = 0;
+    uint64_t m_last_grow = 0;
+    uint64_t m_replay_start = 0;
+    uint64_t m_progress_us = 0;
+    photon::condition_variable m_replay_cond;
+    // layer index -> offset -> (end, time) of the reads in trace
+    map<uint32_t, map<off_t, pair<off_t, uint64_t>>> m_replay_index;
+
+    // time of the container in trace, from the latest read of it recorded in
+    // trace, but no less than the time since replay started, as the container
+    // may go on with reads missing from trace or served by page cache
+    uint64_t boot_progress() {
+        return max(m_progress_us, photon::now - m_replay_start);
+    }
+
+    void fall_behind() {
+        if (m_active >= m_concurrency || photon::now - m_last_grow < REPLAY_TICK_US) {
+            return;
+        }
+        m_active = min(m_active * 2, m_concurrency);
+        m_last_grow = photon::now;
+        m_replay_cond.notify_all();
+        LOG_DEBUG("Prefetch: replay falls behind, concurrency `", m_active);
+    }
+
+    // Deduplicate reads and merge the ones of the same layer within MERGE_GAP of
+    // each other, up to MAX_IO_SIZE. A merged read takes the place of the first
+    // read in it, so the order of first touch is kept.
+    static void compact(vector<TraceFormat> &traces) {
+        vector<TraceFormat> out;
+        vector<bool> merged;
+        // layer index -> offset -> index in `out`
+        map<uint32_t, map<off_t, size_t>> layers;
+        for (auto &t : traces) {
+            if (t.op != TraceOp::READ) {
+                out.push_back(t);
+                merged.push_back(false);
+                continue;
+            }
+            auto &ranges = layers[t.layer_index];
+            off_t begin = t.offset, end = t.offset + t.count;
+            size_t pos = out.size();
+            auto it = ranges.upper_bound(begin);
+            if (it != ranges.begin())
+                --it;
+            while (it != ranges.end() && it->first <= end + MERGE_GAP) {
+                auto &r = out[it->second];
+                off_t r_begin = r.offset, r_end = r.offset + r.count;
+                auto new_begin = min(begin, r_begin), new_end = max(end, r_end);
+                bool covered = r_begin <= begin && r_end >= end;
+                if (r_end + MERGE_GAP < begin || (!covered && new_end - new_begin > MAX_IO_SIZE)) {
+                    ++it;
+                    continue;
+                }
+                begin = new_begin;
+                end = new_end;
+                merged[it->second] = true;
+                pos = min(pos, it->second);
+                it = ranges.erase(it);
+            }
+            if (pos == out.size()) {
+                out.push_back(t);
+                merged.push_back(false);
+            }
+            out[pos].offset = begin;
+            out[pos].count = end - begin;
+            merged[pos] = false;
+            ranges[begin] = pos;
+        }
+        traces.clear();
+        for (size_t i = 0; i < out.size(); i++) {
+            if (!merged[i])
+                traces.push_back(out[i]);
+        }
+    }
+
+    // expand `parts` of a path pattern from the i-th one under `base` into
+    // regular files, sorted in each directory
+    static void expand(IFileSystem *fs, const string &base, const vector<string> &parts,
+                       size_t i, vector<string> &out) {
+        if (i == parts.size()) {
+            struct stat st;
+            if (fs->stat(base.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                out.push_back(base);
+            }
+            return;
+        }
+        auto &part = parts[i];
+        if (part.find_first_of("*?[") == string::npos) {
+            expand(fs, base + "/" + part, parts, i + 1, out);
+            return;
+        }
+        auto dirs = fs->opendir(base.empty() ? "/" : base.c_str());
+        if (dirs == nullptr) {
+            return;
+        }
+        DEFER(delete dirs);
+        vector<string> names;
+        dirent *dir_info;
+        while ((dir_info = dirs->get()) != nullptr) {
+            if (strcmp(dir_info->d_name, ".") != 0 && strcmp(dir_info->d_name, "..") != 0 &&
+                fnmatch(part.c_str(), dir_info->d_name, FNM_PERIOD) == 0) {
+                names.push_back(dir_info->d_name);
+            }
+            dirs->next();
+        }
+        sort(names.begin(), names.end());
+        for (auto &name : names) {
+            expand(fs, base + "/" + name, parts, i + 1, out);
+        }
+    }
+
+    // resolve files of m_file_patterns in the filesystem of `lowers` into reads
+    // in LBA of their extents
+    int resolve_files(LSMT::IFileRO *lowers) {
+        // the lowers are shared and read-only, nothing is flushed to them
+        auto fs = new_extfs(lowers, false, true);
+        if (fs == nullptr) {
+            LOG_ERRNO_RETURN(0, -1, "Prefetch: failed to open filesystem of image");
+        }
+        DEFER(delete fs);
+        vector<string> paths;
+        for (auto &pattern : m_file_patterns) {
+            vector<string> parts;
+            for (size_t begin = 0, end; begin < pattern.size(); begin = end + 1) {
+                end = min(pattern.find('/', begin), pattern.size());
+                if (end > begin) {
+                    parts.push_back(pattern.substr(begin, end - begin));
+                }
+            }
+            auto n = paths.size();
+            expand(fs, "", parts, 0, paths);
+            if (paths.size() == n) {
+                LOG_WARN("Prefetch: no file matches `", pattern);
+            }
+        }
+
+        unique_ptr<photon::fs::fiemap_t<MAX_FILE_EXTENTS>> fie;
+        for (auto &path : paths) {
+            if (m_replay_stopped) {
+                return -1;
+            }
+            auto file = fs->open(path.c_str(), O_RDONLY);
+            if (file == nullptr) {
+                LOG_WARN("Prefetch: failed to open `: `", path, ERRNO());
+                continue;
+            }
+            DEFER(delete file);
+            struct stat st;
+            if (file->fstat(&st) != 0) {
+                LOG_WARN("Prefetch: failed to stat `: `", path, ERRNO());
+                continue;
+            }
+            fie.reset(new photon::fs::fiemap_t<MAX_FILE_EXTENTS>(0, st.st_size));
+            if (file->fiemap(fie.get()) != 0) {
+                LOG_WARN("Prefetch: failed to get extents of `: `", path, ERRNO());
+                continue;
+            }
+            // a highly fragmented file is prefetched up to the extents fetched
+            if (fie->fm_mapped_extents == MAX_FILE_EXTENTS) {
+                LOG_INFO("Prefetch: prefetch first ` extents of `", fie->fm_mapped_extents, path);
+            }
+            for (uint32_t i = 0; i < fie->fm_mapped_extents; i++) {
+                auto &extent = fie->fm_extents[i];
+                for (uint64_t offset = 0; offset < extent.fe_length; offset += MAX_IO_SIZE) {
+                    auto count = min((uint64_t)(extent.fe_length - offset), (uint64_t)MAX_IO_SIZE);
+                    m_replay_traces.push_back({TraceOp::READ, LBA_LAYER, count,
+                                               (off_t)(extent.fe_physical + offset), 0});
+                }
+            }
+        }
+        LOG_INFO("Prefetch: Resolve ` files into ` LBA records", paths.size(),
+                 m_replay_traces.size());
+        return 0;
+    }
+
+    // translate reads in LBA into reads of layers, through the index of the
+    // current layers, holes and zeroed blocks are not read
+    void translate(LSMT::IMemoryIndex *index) {
+        vector<TraceFormat> out;
+        size_t nlba = 0;
+        for (auto &t : m_replay_traces) {
+            if (t.layer_index != LBA_LAYER) {
+                out.push_back(t);
+                continue;
+            }
+            nlba++;
+            if (index == nullptr) {
+                continue;
+            }
+            uint64_t begin = t.offset / SECTOR_SIZE;
+            uint64_t end = (t.offset + t.count + SECTOR_SIZE - 1) / SECTOR_SIZE;
+            LSMT::Segment s{begin, (uint32_t)(end - begin)};
+            LSMT::foreach_segments(
+                index, s, [](const LSMT::Segment &) { return 0; },
+                [&](const LSMT::SegmentMapping &m) {
+                    // moffset of a zeroed mapping is no data offset
+                    if (m.zeroed)
+                        return 0;
+                    out.push_back({t.op, m.tag, m.length * SECTOR_SIZE,
+                                   (off_t)(m.moffset * SECTOR_SIZE), t.time_us});
+                    return 0;
+                });
+        }
+        if (nlba > 0) {
+            LOG_INFO("Prefetch: Translate ` LBA records into `", nlba,
+                     out.size() + nlba - m_replay_traces.size());
+        }
+        m_replay_traces.swap(out);
+    }
 
     int dump() {
         if (m_trace_file == nullptr) {
@@ -219,8 +538,12 @@ private:
         };
         DEFER(close_trace_file());
 
+        auto nrecords = m_record_array.size();
+        compact(m_record_array);
+        LOG_INFO("Prefetch: Compact ` records into `", nrecords, m_record_array.size());
+
         TraceHeader hdr = {};
-        hdr.magic = TRACE_MAGIC;
+        hdr.magic = TRACE_MAGIC_V2;
         hdr.checksum = 0; // calculate and re-write checksum later
         hdr.data_size = sizeof(TraceFormat) * m_record_array.size();
 
@@ -263,9 +586,12 @@ private:
         if (n_read != sizeof(TraceHeader)) {
             LOG_ERRNO_RETURN(0, -1, "Prefetch: reload header failed");
         }
-        if (TRACE_MAGIC != hdr.magic) {
+        if (TRACE_MAGIC != hdr.magic && TRACE_MAGIC_V2 != hdr.magic) {
             LOG_ERROR_RETURN(0, -1, "Prefetch: trace magic mismatch");
         }
+        // reads in traces of v1 have no time, which are replayed at once
+        bool v1 = hdr.magic == TRACE_MAGIC;
+        size_t record_size = v1 ? sizeof(TraceFormatV1) : sizeof(TraceFormat);
         if (trace_file_size != hdr.data_size + sizeof(TraceHeader)) {
             LOG_ERROR_RETURN(0, -1, "Prefetch: trace file size mismatch");
         }
@@ -273,23 +599,29 @@ private:
         // Reload content
         uint32_t checksum = 0;
         TraceFormat fmt = {};
-        for (int i = 0; i < hdr.data_size / sizeof(TraceFormat); ++i) {
-            n_read = m_trace_file->read(&fmt, sizeof(TraceFormat));
-            if (n_read != sizeof(TraceFormat)) {
+        TraceFormatV1 fmt_v1 = {};
+        void *record = v1 ? (void *)&fmt_v1 : (void *)&fmt;
+        vector<TraceFormat> traces;
+        for (size_t i = 0; i < hdr.data_size / record_size; ++i) {
+            n_read = m_trace_file->read(record, record_size);
+            if (n_read != (ssize_t)record_size) {
                 LOG_ERRNO_RETURN(0, -1, "Prefetch: reload content failed");
             }
-            checksum = crc32::crc32c_extend(&fmt, sizeof(TraceFormat), checksum);
-            // Save in memory
-            m_replay_queue.push(fmt);
+            checksum = crc32::crc32c_extend(record, record_size, checksum);
+            if (v1) {
+                fmt = {fmt_v1.op, fmt_v1.layer_index, fmt_v1.count, fmt_v1.offset, 0};
+            }
+            traces.push_back(fmt);
         }
 
         if (checksum != hdr.checksum) {
-            queue<TraceFormat> tmp;
-            m_replay_queue.swap(tmp);
             LOG_ERROR_RETURN(0, -1, "Prefetch: reload checksum error");
         }
 
-        LOG_INFO("Prefetch: Reload ` records", m_replay_queue.size());
+        m_timed = !v1 && m_lead_us > 0;
+        m_replay_traces.swap(traces);
+
+        LOG_INFO("Prefetch: Reload ` records", m_replay_traces.size());
         return 0;
     }
 
@@ -315,7 +647,7 @@ private:
 
 LogBuffer &operator<<(LogBuffer &log, const PrefetcherImpl::TraceFormat &f) {
     return log << "Op " << char(f.op) << ", Count " << f.count << ", Offset " << f.offset
-               << ", Layer_index " << f.layer_index;
+               << ", Layer_index " << f.layer_index << ", Time " << f.time_us;
 }
 
 PrefetchFile::PrefetchFile(IFile *src_file, uint32_t layer_index, Prefetcher *prefetcher)
@@ -328,14 +660,22 @@ PrefetchFile::PrefetchFile(IFile *src_file, uint32_t layer_index, Prefetcher *pr
 
 ssize_t PrefetchFile::pread(void *buf, size_t count, off_t offset) {
     ssize_t n_read = m_file->pread(buf, count, offset);
-    if (n_read == (ssize_t)count && m_prefetcher->get_mode() == PrefetcherImpl::Mode::Record) {
+    if (n_read == (ssize_t)count && m_prefetcher->get_mode() == PrefetcherImpl::Mode::Record &&
+        !m_prefetcher->record_lba()) {
         m_prefetcher->record(PrefetcherImpl::TraceOp::READ, m_layer_index, count, offset);
+    } else if (m_prefetcher->get_mode() == PrefetcherImpl::Mode::Replay) {
+        m_prefetcher->on_live_read(m_layer_index, offset);
     }
     return n_read;
 }
 
-Prefetcher *new_prefetcher(const string &trace_file_path, int concurrency) {
-    return new PrefetcherImpl(trace_file_path, concurrency);
+Prefetcher *new_prefetcher(const string &trace_file_path, int concurrency,
+                           uint64_t lead_window_ms, bool record_lba) {
+    return new PrefetcherImpl(trace_file_path, concurrency, lead_window_ms, record_lba);
+}
+
+Prefetcher *new_file_prefetcher(const vector<string> &patterns, int concurrency) {
+    return new PrefetcherImpl(patterns, concurrency);
 }
 
 Prefetcher::Mode Prefetcher::detect_mode(const string &trace_file_path, size_t *file_size) {
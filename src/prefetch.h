@@ -16,8 +16,11 @@ limitations under the License.
 #pragma once
 
 #include <cctype>
+#include <cstdint>
 #include <string>
 #include <photon/fs/filesystem.h>
+#include <vector>
+#include "overlaybd/lsmt/file.h"
 
 using namespace photon::fs;
 /*
@@ -45,9 +48,20 @@ public:
     };
     enum class TraceOp : char { READ = 'R', WRITE = 'W' };
 
+    // layer index of reads recorded in logical offsets of the image
+    static const uint32_t LBA_LAYER = UINT32_MAX;
+
     virtual void record(TraceOp op, uint32_t layer_index, size_t count, off_t offset) = 0;
 
-    virtual void replay() = 0;
+    // reads recorded in LBA are translated into reads of layers by the index of
+    // `lowers`, and dropped if it's null
+    virtual void replay(LSMT::IFileRO *lowers = nullptr) = 0;
+
+    // whether the reads of the image are recorded in LBA by ImageFile, instead
+    // of the ones of each layer by prefetch files
+    bool record_lba() const {
+        return m_record_lba && m_mode == Mode::Record;
+    }
 
     // Prefetch file inherits ForwardFile, and it is the actual caller of `record` method.
     // The source file is supposed to have cache.
@@ -61,6 +75,17 @@ public:
 
 protected:
     Mode m_mode;
+    bool m_record_lba = false;
 };
 
-Prefetcher *new_prefetcher(const std::string &trace_file_path, int concurrency);
+// Replay of traces with time keeps `lead_window_ms` ahead of the reads of the
+// container, or replays as fast as possible if it's 0. Traces recorded with
+// `record_lba` are independent of the layout of layers, and serve all the
+// images whose layers give the same content.
+Prefetcher *new_prefetcher(const std::string &trace_file_path, int concurrency,
+                           uint64_t lead_window_ms = 0, bool record_lba = false);
+
+// Prefetch files of the ext4 filesystem in the image, given by absolute paths,
+// whose components may have wildcards of fnmatch(3). They are resolved on
+// replay, and their extents are replayed in order of files as reads in LBA.
+Prefetcher *new_file_prefetcher(const std::vector<std::string> &patterns, int concurrency);
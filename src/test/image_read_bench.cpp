@@ -0,0 +1,252 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// End-to-end read benchmark of ImageFile over a loopback registry.
+//
+// A synthetic overlaybd layer is committed locally and served by
+// RegistrySimulator. Each round starts from an empty registry cache, and
+// measures the cold start (open the image and read its first block), then
+// random reads and a sequential scan of the image.
+
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/common/utility.h>
+#include <photon/fs/localfs.h>
+
+#include "../image_file.h"
+#include "../image_service.h"
+#include "../overlaybd/lsmt/file.h"
+#include "registry_sim.h"
+
+DEFINE_bool(ut_pass, false, "pass unit test directly. This suite is only for manual test");
+DEFINE_string(work_dir, "/tmp/overlaybd-bench", "dir for configs, layer and registry cache");
+DEFINE_uint64(port, 19878, "port of the registry simulator");
+DEFINE_uint64(image_size_mb, 256, "size of the synthetic layer");
+DEFINE_uint64(rounds, 3, "rounds of cold start");
+DEFINE_uint64(read_count, 1000, "random reads per round");
+DEFINE_uint64(read_size, 4096, "size of each random read");
+DEFINE_bool(seq_scan, true, "scan the whole image sequentially after random reads");
+
+// registry simulator params
+DEFINE_bool(auth, true, "challenge for a bearer token");
+DEFINE_bool(redirect, true, "redirect blob requests to signed urls");
+DEFINE_uint64(latency_us, 1000, "latency of each request to registry");
+DEFINE_uint64(bandwidth_mbps, 0, "bandwidth of registry in MB/s, 0 for unlimited");
+DEFINE_uint64(error_percent, 0, "percent of blob requests failed with 503");
+
+struct LatencyStat {
+    std::vector<uint64_t> samples;
+
+    void add(uint64_t us) {
+        samples.push_back(us);
+    }
+
+    uint64_t percentile(int p) {
+        if (samples.empty())
+            return 0;
+        std::sort(samples.begin(), samples.end());
+        return samples[(samples.size() - 1) * p / 100];
+    }
+
+    uint64_t avg() {
+        uint64_t sum = 0;
+        for (auto x : samples)
+            sum += x;
+        return samples.empty() ? 0 : sum / samples.size();
+    }
+
+    void report(const char *name) {
+        LOG_INFO("` latency(us): count=`, avg=`, p50=`, p90=`, p99=`, max=`", name,
+                 samples.size(), avg(), percentile(50), percentile(90), percentile(99),
+                 percentile(100));
+    }
+};
+
+static photon::fs::IFile *open_file(const std::string &fn, int flags) {
+    auto file = photon::fs::open_localfile_adaptor(fn.c_str(), flags, 0644);
+    if (file == nullptr)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to open `", fn);
+    return file;
+}
+
+// commit a layer of random data, returns the blob
+static int make_layer(const std::string &dir, size_t size, std::string &blob) {
+    const int flags = O_RDWR | O_CREAT | O_TRUNC;
+    auto fdata = open_file(dir + "/layer.data", flags);
+    auto findex = open_file(dir + "/layer.index", flags);
+    if (fdata == nullptr || findex == nullptr)
+        return -1;
+    LSMT::LayerInfo args(fdata, findex);
+    args.virtual_size = size;
+    auto rw = LSMT::create_file_rw(args, true);
+    if (rw == nullptr)
+        LOG_ERRNO_RETURN(0, -1, "failed to create lsmt file");
+    DEFER(delete rw);
+
+    std::vector<char> buf(1024 * 1024);
+    for (size_t offset = 0; offset < size; offset += buf.size()) {
+        for (auto &c : buf)
+            c = rand() & 0xff;
+        if (rw->pwrite(buf.data(), buf.size(), offset) != (ssize_t)buf.size())
+            LOG_ERRNO_RETURN(0, -1, "failed to write lsmt file");
+    }
+
+    auto fcommit = open_file(dir + "/layer.commit", flags);
+    if (fcommit == nullptr)
+        return -1;
+    DEFER(delete fcommit);
+    LSMT::CommitArgs cargs(fcommit);
+    if (rw->commit(cargs) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to commit lsmt file");
+    struct stat st;
+    fcommit->fstat(&st);
+    blob.resize(st.st_size);
+    if (fcommit->pread(&blob[0], st.st_size, 0) != st.st_size)
+        LOG_ERRNO_RETURN(0, -1, "failed to read committed layer");
+    return 0;
+}
+
+static std::string sha256_digest(const std::string &data) {
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *)data.data(), data.size(), md);
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        sprintf(hex + i * 2, "%02x", md[i]);
+    return std::string("sha256:") + hex;
+}
+
+static int write_config(const std::string &path, const std::string &content) {
+    auto file = open_file(path, O_RDWR | O_CREAT | O_TRUNC);
+    if (file == nullptr)
+        return -1;
+    DEFER(delete file);
+    if (file->pwrite(content.data(), content.size(), 0) != (ssize_t)content.size())
+        LOG_ERRNO_RETURN(0, -1, "failed to write `", path);
+    return 0;
+}
+
+static int bench_round(const std::string &global_conf, const std::string &image_conf,
+                       LatencyStat &cold_start, LatencyStat &random_read) {
+    auto cache_dir = FLAGS_work_dir + "/registry_cache";
+    auto layer_dir = FLAGS_work_dir + "/layer";
+    if (system(("rm -rf " + cache_dir + " " + layer_dir + " && mkdir -p " + cache_dir + " " +
+                layer_dir).c_str()) != 0)
+        LOG_ERROR_RETURN(0, -1, "failed to reset registry cache");
+
+    auto start = photon::now;
+    auto is = create_image_service(global_conf.c_str());
+    if (is == nullptr)
+        LOG_ERROR_RETURN(0, -1, "failed to create image service");
+    DEFER(delete is);
+    auto image = is->create_image_file(image_conf.c_str());
+    if (image == nullptr)
+        LOG_ERROR_RETURN(0, -1, "failed to create image file");
+    DEFER(delete image);
+    std::vector<char> buf(std::max(FLAGS_read_size, 1024UL * 1024));
+    if (image->pread(buf.data(), FLAGS_read_size, 0) != (ssize_t)FLAGS_read_size)
+        LOG_ERRNO_RETURN(0, -1, "failed to read first block");
+    cold_start.add(photon::now - start);
+
+    struct stat st;
+    image->fstat(&st);
+    auto nblocks = st.st_size / FLAGS_read_size;
+    for (uint64_t i = 0; i < FLAGS_read_count; i++) {
+        off_t offset = (rand() % nblocks) * FLAGS_read_size;
+        auto t = photon::now;
+        if (image->pread(buf.data(), FLAGS_read_size, offset) != (ssize_t)FLAGS_read_size)
+            LOG_ERRNO_RETURN(0, -1, "failed to read image at `", offset);
+        random_read.add(photon::now - t);
+    }
+
+    if (FLAGS_seq_scan) {
+        auto t = photon::now;
+        for (off_t offset = 0; offset < st.st_size; offset += buf.size()) {
+            auto len = std::min((off_t)buf.size(), st.st_size - offset);
+            if (image->pread(buf.data(), len, offset) != len)
+                LOG_ERRNO_RETURN(0, -1, "failed to scan image at `", offset);
+        }
+        auto us = std::max(photon::now - t, 1UL);
+        LOG_INFO("sequential scan: ` MB in ` ms, ` MB/s", st.st_size >> 20, us / 1000,
+                 (st.st_size >> 20) * 1000 * 1000 / us);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_ut_pass)
+        return 0;
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_LIBAIO);
+    DEFER(photon::fini());
+    set_log_output_level(ALOG_INFO);
+
+    if (system(("mkdir -p " + FLAGS_work_dir).c_str()) != 0)
+        LOG_ERROR_RETURN(0, -1, "failed to create work dir");
+    std::string blob;
+    if (make_layer(FLAGS_work_dir, FLAGS_image_size_mb << 20, blob) < 0)
+        return -1;
+    auto digest = sha256_digest(blob);
+    LOG_INFO("synthetic layer: `, ` bytes", digest, blob.size());
+
+    RegistrySimConfig sim_conf;
+    sim_conf.auth = FLAGS_auth;
+    sim_conf.redirect = FLAGS_redirect;
+    sim_conf.latency_us = FLAGS_latency_us;
+    sim_conf.bandwidth = FLAGS_bandwidth_mbps << 20;
+    sim_conf.error_percent = FLAGS_error_percent;
+    RegistrySimulator sim(sim_conf);
+    sim.add_blob(digest, blob);
+    if (sim.start(FLAGS_port) < 0)
+        return -1;
+
+    auto global_conf = FLAGS_work_dir + "/overlaybd.json";
+    auto image_conf = FLAGS_work_dir + "/image.json";
+    auto cred = FLAGS_work_dir + "/cred.json";
+    if (write_config(cred, R"({"auths": {}})") < 0 ||
+        write_config(global_conf,
+                     R"({"registryCacheDir": ")" + FLAGS_work_dir + R"(/registry_cache",
+                         "registryCacheSizeGB": 1, "cacheType": "file",
+                         "credentialFilePath": ")" + cred + R"(",
+                         "logPath": "", "enableAudit": false})") < 0 ||
+        write_config(image_conf,
+                     R"({"repoBlobUrl": ")" + sim.repo_blob_url() + R"(",
+                         "lowers": [{"digest": ")" + digest + R"(", "size": )" +
+                         std::to_string(blob.size()) + R"(, "dir": ")" + FLAGS_work_dir +
+                         R"(/layer"}],
+                         "resultFile": ")" + FLAGS_work_dir + R"(/result"})") < 0)
+        return -1;
+
+    LatencyStat cold_start, random_read;
+    for (uint64_t i = 0; i < FLAGS_rounds; i++) {
+        if (bench_round(global_conf, image_conf, cold_start, random_read) < 0)
+            return -1;
+    }
+    cold_start.report("cold start");
+    random_read.report("random read");
+    LOG_INFO("registry: ` requests, ` blob requests, ` token requests, ` errors injected, ` "
+             "bytes sent",
+             sim.requests, sim.blob_requests, sim.token_requests, sim.injected_errors,
+             sim.sent_bytes);
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/common/utility.h>
+#include <photon/fs/localfs.h>
+
+#include "../layer_meta.h"
+
+static const std::string kDir = "/tmp/overlaybd/layer_meta_test/";
+static const std::string kBlob = kDir + "blob";
+static const std::string kMeta = kDir + LAYER_META_FILE_NAME;
+static const size_t kBlobSize = 1024 * 1024;
+
+class LayerMetaTest : public ::testing::Test {
+protected:
+    std::vector<char> data;
+    int opened = 0;
+
+    void SetUp() override {
+        system(("rm -rf " + kDir).c_str());
+        system(("mkdir -p " + kDir).c_str());
+        data.resize(kBlobSize);
+        for (size_t i = 0; i < kBlobSize; i++)
+            data[i] = (char)(i * 7 + i / 4096);
+        auto file = photon::fs::open_localfile_adaptor(kBlob.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                                                       0644, 0);
+        ASSERT_NE(nullptr, file);
+        EXPECT_EQ((ssize_t)kBlobSize, file->pwrite(data.data(), kBlobSize, 0));
+        delete file;
+    }
+
+    RemoteOpener opener() {
+        return [this]() -> photon::fs::IFile * {
+            opened++;
+            return photon::fs::open_localfile_adaptor(kBlob.c_str(), O_RDONLY, 0644, 0);
+        };
+    }
+
+    void read_meta(ILayerMetaFile *file) {
+        char buf[4096];
+        EXPECT_EQ(512, file->pread(buf, 512, 0));
+        EXPECT_EQ(0, memcmp(data.data(), buf, 512));
+        EXPECT_EQ(4096, file->pread(buf, 4096, kBlobSize - 4096));
+        EXPECT_EQ(0, memcmp(data.data() + kBlobSize - 4096, buf, 4096));
+        // covered by the first range
+        EXPECT_EQ(100, file->pread(buf, 100, 200));
+        EXPECT_EQ(0, memcmp(data.data() + 200, buf, 100));
+    }
+};
+
+TEST_F(LayerMetaTest, SealAndReload) {
+    auto file = open_layer_meta_file(kMeta, opener());
+    ASSERT_NE(nullptr, file);
+    EXPECT_EQ(1, opened);
+    read_meta(file);
+    EXPECT_EQ(0, file->seal());
+    delete file;
+    EXPECT_EQ(0, ::access(kMeta.c_str(), F_OK));
+
+    // reopened without the remote blob
+    file = open_layer_meta_file(kMeta, opener());
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+    struct stat st;
+    EXPECT_EQ(0, file->fstat(&st));
+    EXPECT_EQ((off_t)kBlobSize, st.st_size);
+    read_meta(file);
+    EXPECT_EQ(1, opened);
+
+    // nothing new to persist, data reads go to the remote blob once sealed
+    EXPECT_EQ(0, file->seal());
+    char buf[4096];
+    EXPECT_EQ(4096, file->pread(buf, 4096, 8192));
+    EXPECT_EQ(0, memcmp(data.data() + 8192, buf, 4096));
+    EXPECT_EQ(2, opened);
+}
+
+TEST_F(LayerMetaTest, Truncated) {
+    auto file = open_layer_meta_file(kMeta, opener());
+    ASSERT_NE(nullptr, file);
+    read_meta(file);
+    EXPECT_EQ(0, file->seal());
+    delete file;
+
+    struct stat st;
+    ASSERT_EQ(0, ::stat(kMeta.c_str(), &st));
+    ASSERT_EQ(0, ::truncate(kMeta.c_str(), st.st_size - 100));
+
+    // the truncated meta file is ignored, the remote blob is opened at once
+    file = open_layer_meta_file(kMeta, opener());
+    ASSERT_NE(nullptr, file);
+    EXPECT_EQ(2, opened);
+    read_meta(file);
+    EXPECT_EQ(0, file->seal());
+    delete file;
+
+    // and it's rewritten in full
+    file = open_layer_meta_file(kMeta, opener());
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+    EXPECT_EQ(2, opened);
+    read_meta(file);
+}
+
+int main(int argc, char **argv) {
+    log_output_level = 1;
+    ::testing::InitGoogleTest(&argc, argv);
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    DEFER(photon::fini());
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,201 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/common/estring.h>
+#include <photon/net/http/server.h>
+#include <photon/net/socket.h>
+#include <photon/thread/thread.h>
+
+// A loopback registry serving blobs for tests and benchmarks.
+//
+//   GET /v2/<repo>/blobs/<digest>   blob url, challenges for a bearer token if
+//                                   `auth`, then redirects to /data if `redirect`
+//   GET /token                      issues the token, basic auth is not checked
+//   GET /data/<digest>?Expires=..   signed blob data
+//
+// Every request is delayed by `latency_us`, bodies are sent no faster than
+// `bandwidth` bytes/sec, and `error_percent` of blob requests fail with 503.
+struct RegistrySimConfig {
+    bool auth = true;
+    bool redirect = true;
+    uint64_t latency_us = 0;
+    uint64_t bandwidth = 0; // 0 for unlimited
+    uint32_t error_percent = 0;
+    uint64_t url_life_sec = 600;
+};
+
+class RegistrySimulator : public photon::net::http::HTTPHandler {
+public:
+    static constexpr const char *kToken = "registry-sim-token";
+
+    RegistrySimConfig config;
+    uint64_t requests = 0;
+    uint64_t blob_requests = 0;
+    uint64_t token_requests = 0;
+    uint64_t injected_errors = 0;
+    uint64_t sent_bytes = 0;
+
+    explicit RegistrySimulator(const RegistrySimConfig &conf = {}) : config(conf) {
+    }
+
+    ~RegistrySimulator() {
+        stop();
+    }
+
+    // listen on 127.0.0.1:`port`, returns 0 on success
+    int start(uint16_t port) {
+        m_port = port;
+        m_tcpserver = photon::net::new_tcp_socket_server();
+        m_tcpserver->setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
+        if (m_tcpserver->bind(port, photon::net::IPAddr("127.0.0.1")) < 0 ||
+            m_tcpserver->listen() < 0) {
+            stop();
+            LOG_ERRNO_RETURN(0, -1, "failed to listen registry simulator on port `", port);
+        }
+        m_httpserver = photon::net::http::new_http_server();
+        m_httpserver->add_handler(this, false, "/");
+        m_tcpserver->set_handler(m_httpserver->get_connection_handler());
+        m_tcpserver->start_loop();
+        return 0;
+    }
+
+    void stop() {
+        delete m_tcpserver;
+        delete m_httpserver;
+        m_tcpserver = nullptr;
+        m_httpserver = nullptr;
+    }
+
+    void add_blob(const std::string &digest, std::string data) {
+        m_blobs[digest] = std::move(data);
+    }
+
+    // base url to be used as `repoBlobUrl` of an image config
+    std::string repo_blob_url(const std::string &repo = "library/sim") const {
+        return "http://127.0.0.1:" + std::to_string(m_port) + "/v2/" + repo + "/blobs";
+    }
+
+    int handle_request(photon::net::http::Request &req, photon::net::http::Response &resp,
+                       std::string_view) override {
+        requests++;
+        if (config.latency_us > 0)
+            photon::thread_usleep(config.latency_us);
+        estring_view target = req.target();
+        auto query = target.find('?');
+        auto path = target.substr(0, query);
+        resp.keep_alive(true);
+
+        if (path == "/token") {
+            token_requests++;
+            std::string body = std::string("{\"token\":\"") + kToken + "\"}";
+            resp.set_result(200);
+            resp.headers.content_length(body.size());
+            resp.write((void *)body.data(), body.size());
+            return 0;
+        }
+        auto digest = std::string(path.substr(path.rfind('/') + 1));
+        auto it = m_blobs.find(digest);
+        if (it == m_blobs.end())
+            return reply(resp, 404);
+
+        blob_requests++;
+        if (config.error_percent > 0 && (uint32_t)(rand() % 100) < config.error_percent) {
+            injected_errors++;
+            return reply(resp, 503);
+        }
+        if (path.starts_with("/v2/")) {
+            if (config.auth && req.headers["Authorization"] != std::string("Bearer ") + kToken) {
+                auto repo = path.substr(4, path.find("/blobs/") - 4);
+                return reply(resp, 401, "www-authenticate",
+                             std::string("Bearer realm=\"http://127.0.0.1:") +
+                                 std::to_string(m_port) +
+                                 "/token\",service=\"registry-sim\",scope=\"repository:" +
+                                 std::string(repo) + ":pull\"");
+            }
+            if (config.redirect) {
+                auto expires = time(nullptr) + config.url_life_sec;
+                return reply(resp, 307, "Location",
+                             "http://127.0.0.1:" + std::to_string(m_port) + "/data/" + digest +
+                                 "?Expires=" + std::to_string(expires));
+            }
+        }
+        return send_range(req, resp, it->second);
+    }
+
+protected:
+    uint16_t m_port = 0;
+    photon::net::ISocketServer *m_tcpserver = nullptr;
+    photon::net::http::HTTPServer *m_httpserver = nullptr;
+    std::unordered_map<std::string, std::string> m_blobs;
+
+    // headers are inserted after the status line is set
+    int reply(photon::net::http::Response &resp, int code, const char *key = nullptr,
+              const std::string &value = "") {
+        resp.set_result(code);
+        if (key != nullptr)
+            resp.headers.insert(key, value);
+        resp.headers.content_length(0);
+        return 0;
+    }
+
+    int send_range(photon::net::http::Request &req, photon::net::http::Response &resp,
+                   const std::string &blob) {
+        uint64_t start = 0, end = blob.size() - 1;
+        estring_view range = req.headers["Range"];
+        bool ranged = range.starts_with("bytes=");
+        if (ranged) {
+            auto spec = std::string(range.substr(6));
+            auto dash = spec.find('-');
+            start = strtoull(spec.c_str(), nullptr, 10);
+            if (dash != std::string::npos && dash + 1 < spec.size())
+                end = std::min(end, (uint64_t)strtoull(spec.c_str() + dash + 1, nullptr, 10));
+            if (start > end || start >= blob.size()) {
+                return reply(resp, 416, "Content-Range", "bytes */" + std::to_string(blob.size()));
+            }
+        }
+        auto len = end - start + 1;
+        resp.set_result(ranged ? 206 : 200);
+        if (ranged)
+            resp.headers.insert("Content-Range", "bytes " + std::to_string(start) + "-" +
+                                                     std::to_string(end) + "/" +
+                                                     std::to_string(blob.size()));
+        resp.headers.content_length(len);
+
+        // throttle by sending in 64KB pieces
+        const uint64_t piece = 64 * 1024;
+        for (uint64_t sent = 0; sent < len;) {
+            auto n = std::min(piece, len - sent);
+            auto ret = resp.write((void *)(blob.data() + start + sent), n);
+            if (ret != (ssize_t)n)
+                LOG_ERRNO_RETURN(0, -1, "registry simulator failed to send body");
+            sent += n;
+            sent_bytes += n;
+            if (config.bandwidth > 0)
+                photon::thread_usleep(n * 1000 * 1000 / config.bandwidth);
+        }
+        return 0;
+    }
+};
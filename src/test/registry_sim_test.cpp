@@ -0,0 +1,232 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/common/utility.h>
+#include <photon/fs/filesystem.h>
+
+#include "../overlaybd/registryfs/registryfs.h"
+#include "registry_sim.h"
+
+struct SimAuth {
+    std::pair<std::string, std::string> load(const char *) {
+        return {"", ""};
+    }
+};
+
+static std::string random_blob(size_t size) {
+    std::string blob(size, 0);
+    for (auto &c : blob)
+        c = rand() & 0xff;
+    return blob;
+}
+
+class RegistrySimTest : public ::testing::Test {
+protected:
+    const uint16_t kPort = 19877;
+    const std::string kDigest = "sha256:0123456789abcdef";
+    SimAuth auth;
+    RegistrySimulator sim;
+    std::string blob = random_blob(8 * 1024 * 1024);
+    photon::fs::IFileSystem *fs = nullptr;
+
+    void SetUp() override {
+        sim.add_blob(kDigest, blob);
+        ASSERT_EQ(0, sim.start(kPort));
+        fs = new_registryfs_v2({&auth, &SimAuth::load}, "", 10UL * 1000 * 1000);
+        ASSERT_NE(nullptr, fs);
+    }
+
+    void TearDown() override {
+        delete fs;
+        sim.stop();
+    }
+
+    std::string blob_url() {
+        return sim.repo_blob_url() + "/" + kDigest;
+    }
+
+    void verify_reads(photon::fs::IFile *file, int n, size_t max_len) {
+        std::unique_ptr<char[]> buf(new char[max_len]);
+        for (int i = 0; i < n; i++) {
+            auto len = rand() % max_len + 1;
+            auto offset = rand() % (blob.size() - len);
+            ASSERT_EQ((ssize_t)len, file->pread(buf.get(), len, offset));
+            EXPECT_EQ(0, memcmp(buf.get(), blob.data() + offset, len));
+        }
+    }
+};
+
+TEST_F(RegistrySimTest, token_and_redirect) {
+    auto file = fs->open(blob_url().c_str(), O_RDONLY);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+    struct stat st;
+    ASSERT_EQ(0, file->fstat(&st));
+    EXPECT_EQ((off_t)blob.size(), st.st_size);
+    verify_reads(file, 100, 1024 * 1024);
+    EXPECT_GE(sim.token_requests, 1UL);
+}
+
+TEST_F(RegistrySimTest, without_auth) {
+    sim.config.auth = false;
+    sim.config.redirect = false;
+    auto file = fs->open(blob_url().c_str(), O_RDONLY);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+    verify_reads(file, 100, 64 * 1024);
+    EXPECT_EQ(0UL, sim.token_requests);
+}
+
+TEST_F(RegistrySimTest, error_injection) {
+    sim.config.error_percent = 10;
+    auto file = fs->open(blob_url().c_str(), O_RDONLY);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+    verify_reads(file, 50, 64 * 1024);
+    EXPECT_GT(sim.injected_errors, 0UL);
+}
+
+TEST_F(RegistrySimTest, latency_and_bandwidth) {
+    sim.config.latency_us = 10 * 1000;
+    sim.config.bandwidth = 16 * 1024 * 1024;
+    auto file = fs->open(blob_url().c_str(), O_RDONLY);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+    auto start = photon::now;
+    verify_reads(file, 1, 1);
+    EXPECT_GE(photon::now - start, 10UL * 1000);
+
+    std::unique_ptr<char[]> buf(new char[4 * 1024 * 1024]);
+    start = photon::now;
+    ASSERT_EQ(4 * 1024 * 1024, file->pread(buf.get(), 4 * 1024 * 1024, 0));
+    // 4MB at 16MB/s takes at least 250ms
+    EXPECT_GE(photon::now - start, 250UL * 1000);
+}
+
+TEST_F(RegistrySimTest, circuit_breaker) {
+    RegistryRetryPolicy policy;
+    policy.backoff_base_us = 1000;
+    policy.backoff_max_us = 10 * 1000;
+    policy.breaker_failures = 3;
+    policy.breaker_cooldown_us = 200 * 1000;
+    ASSERT_EQ(0, ((RegistryFS *)fs)->setRetryPolicy(policy));
+    auto file = fs->open(blob_url().c_str(), O_RDONLY);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+    verify_reads(file, 10, 64 * 1024);
+
+    // the registry fails every request, the circuit opens after 3 of them
+    sim.config.error_percent = 100;
+    char buf[4096];
+    EXPECT_GT(0, file->pread(buf, sizeof(buf), 0));
+    EXPECT_GE(sim.injected_errors, 3UL);
+    auto requests = sim.blob_requests;
+    EXPECT_GT(0, file->pread(buf, sizeof(buf), 0));
+    EXPECT_EQ(requests, sim.blob_requests);
+
+    // a probe is let through after the cooldown, and closes the circuit
+    sim.config.error_percent = 0;
+    photon::thread_usleep(policy.breaker_cooldown_us + 50 * 1000);
+    verify_reads(file, 10, 64 * 1024);
+    EXPECT_LT(requests, sim.blob_requests);
+}
+
+TEST_F(RegistrySimTest, hedge) {
+    auto rfs = (RegistryFS *)fs;
+    // any failure reported would keep the circuit open through the test
+    RegistryRetryPolicy policy;
+    policy.breaker_failures = 1;
+    policy.breaker_cooldown_us = 60UL * 1000 * 1000;
+    ASSERT_EQ(0, rfs->setRetryPolicy(policy));
+    ASSERT_EQ(0, rfs->setHedge(50, 1000));
+    auto file = fs->open(blob_url().c_str(), O_RDONLY);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+    // learn the hedge delay from fast responses
+    verify_reads(file, 64, 4096);
+    uint64_t hedged = 0, wins = 0;
+
+    // every response is now slower than the delay, so each read is hedged and
+    // the slower of the two is cancelled without counting as a failure
+    sim.config.latency_us = 20 * 1000;
+    verify_reads(file, 10, 4096);
+    ASSERT_EQ(0, rfs->getHedgeStat(hedged, wins));
+    EXPECT_LT(0UL, hedged);
+    EXPECT_LE(wins, hedged);
+    verify_reads(file, 10, 4096);
+}
+
+struct CoalesceRead {
+    photon::fs::IFile *file;
+    const std::string *blob;
+    off_t offset;
+    size_t count;
+    bool ok = false;
+
+    static void *run(void *arg) {
+        auto r = (CoalesceRead *)arg;
+        std::unique_ptr<char[]> buf(new char[r->count]);
+        r->ok = r->file->pread(buf.get(), r->count, r->offset) == (ssize_t)r->count &&
+                memcmp(buf.get(), r->blob->data() + r->offset, r->count) == 0;
+        return nullptr;
+    }
+};
+
+TEST_F(RegistrySimTest, coalesce) {
+    ASSERT_EQ(0, ((RegistryFS *)fs)->setRangeCoalesce(200 * 1000, 64 * 1024, 1024 * 1024));
+    auto file = fs->open(blob_url().c_str(), O_RDONLY);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+
+    // a lone read is not held for the window
+    char buf[4096];
+    auto start = photon::now;
+    ASSERT_EQ(4096, file->pread(buf, sizeof(buf), 0));
+    EXPECT_LT(photon::now - start, 200UL * 1000);
+
+    // reads arriving while one is in flight are merged into a single request,
+    // and each gets its own part of the response
+    sim.config.latency_us = 20 * 1000;
+    const int n = 8;
+    std::vector<CoalesceRead> reads;
+    for (int i = 0; i < n; i++)
+        reads.push_back({file, &blob, (off_t)(1024 * 1024 + i * 8192), 4096});
+    auto requests = sim.blob_requests;
+    std::vector<photon::join_handle *> jhs;
+    for (auto &r : reads)
+        jhs.push_back(photon::thread_enable_join(photon::thread_create(&CoalesceRead::run, &r)));
+    for (auto jh : jhs)
+        photon::thread_join(jh);
+    for (auto &r : reads)
+        EXPECT_TRUE(r.ok);
+    EXPECT_EQ(2UL, sim.blob_requests - requests);
+}
+
+int main(int argc, char **argv) {
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_NONE);
+    DEFER(photon::fini());
+    set_log_output_level(ALOG_INFO);
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}